@@ -0,0 +1,74 @@
+#include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
+#include "../include/ofs_instance.h"
+#include "../include/session_manager.h"
+#include "../include/helper_functions.h"
+#include "../include/durability.h"
+#include <iostream>
+#include <cstring>
+
+using namespace std;
+
+// file_operations.cpp, directory_operations.cpp, info_operations.cpp
+int createFile(OFSInstance* fs, ManagedSession* ms, const char* path, const char* data, size_t size);
+int editFile(OFSInstance* fs, ManagedSession* ms, const char* path, const char* data, size_t size, uint32_t index);
+int deleteFile(OFSInstance* fs, ManagedSession* ms, const char* path);
+int createDirectory(OFSInstance* fs, ManagedSession* ms, const char* path);
+int deleteDirectory(OFSInstance* fs, ManagedSession* ms, const char* path);
+int readMetadata(OFSInstance* fs, ManagedSession* ms, const char* path, FileMetadata* meta);
+
+static int runBatchOp(OFSInstance* fs, ManagedSession* ms, const BatchOp& op) {
+    switch (op.type) {
+        case BATCH_OP_FILE_CREATE:
+            return createFile(fs, ms, op.path, op.data, op.size);
+        case BATCH_OP_FILE_EDIT:
+            return editFile(fs, ms, op.path, op.data, op.size, op.index);
+        case BATCH_OP_FILE_DELETE:
+            return deleteFile(fs, ms, op.path);
+        case BATCH_OP_DIR_CREATE:
+            return createDirectory(fs, ms, op.path);
+        case BATCH_OP_DIR_DELETE:
+            return deleteDirectory(fs, ms, op.path);
+        case BATCH_OP_STAT:
+            if (!op.meta) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+            return readMetadata(fs, ms, op.path, op.meta);
+        default:
+            return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+}
+
+// runs ops in order under one session lookup and one lock, with their
+// metadata flushes folded into one at the end. Every op runs even if an
+// earlier one failed; results (if given) gets each op's code and the first
+// failure is returned.
+extern "C" int ofs_batch(void* session, const BatchOp* ops, uint32_t count, int* results) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    if (!ops && count > 0) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+
+    int status = static_cast<int>(OFSErrorCodes::SUCCESS);
+
+    fs->flush_hold++;
+    for (uint32_t i = 0; i < count; i++) {
+        int result = runBatchOp(fs, ms.get(), ops[i]);
+        if (results) results[i] = result;
+        if (result != static_cast<int>(OFSErrorCodes::SUCCESS) &&
+            status == static_cast<int>(OFSErrorCodes::SUCCESS)) {
+            status = result;
+        }
+    }
+    fs->flush_hold--;
+
+    flushMetadata(fs);
+
+    return status;
+}
@@ -1,4 +1,5 @@
 #include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
 #include <iostream>
 #include <string>
 #include <cstring>
@@ -34,6 +35,14 @@ extern "C" {
     int set_permissions(void* session, const char* path, uint32_t permissions);
     int get_stats(void* session, FSStats* stats);
     
+    int fs_defragment(void* admin_session, uint32_t max_blocks, DefragStats* stats);
+    int get_defrag_stats(void* session, DefragStats* stats);
+    int fs_sync(void* session);
+    int get_reclaim_stats(void* session, ReclaimStats* stats);
+    int get_path_cache_stats(void* session, PathCacheStats* stats);
+    int set_durability(void* session, uint32_t mode);
+    int get_durability_stats(void* session, DurabilityStats* stats);
+    
     void free_buffer(void* buffer);
     const char* get_error_message(int error_code);
 }
@@ -142,6 +151,48 @@ void shutdownFileSystem() {
     }
 }
 
+void defragmentFileSystem() {
+    cout << "\n--- Defragment File System ---" << endl;
+    
+    if (current_session == nullptr) {
+        cout << "ERROR: Must be logged in" << endl;
+        return;
+    }
+    
+    uint32_t max_blocks;
+    cout << "Max blocks to move (0 for default): ";
+    cin >> max_blocks;
+    clearInputBuffer();
+    
+    DefragStats stats;
+    int result = fs_defragment(current_session, max_blocks, &stats);
+    if (result == static_cast<int>(OFSErrorCodes::SUCCESS)) {
+        cout << "Files examined: " << stats.files_examined << endl;
+        cout << "Fragmented files left: " << stats.fragmented_files << endl;
+        cout << "Files moved (total): " << stats.files_moved << endl;
+        cout << "Blocks moved (total): " << stats.blocks_moved << endl;
+        cout << "Bytes moved (total): " << stats.bytes_moved << endl;
+    } else {
+        printError(result);
+    }
+}
+
+void syncFileSystem() {
+    cout << "\n--- Sync File System ---" << endl;
+    
+    if (current_session == nullptr) {
+        cout << "ERROR: Must be logged in" << endl;
+        return;
+    }
+    
+    int result = fs_sync(current_session);
+    if (result == static_cast<int>(OFSErrorCodes::SUCCESS)) {
+        cout << "All buffered writes flushed" << endl;
+    } else {
+        printError(result);
+    }
+}
+
 void loginUser() {
     cout << "\n--- User Login ---" << endl;
     
@@ -606,6 +657,23 @@ void showStats() {
         cout << "Total users: " << stats.total_users << endl;
         cout << "Active sessions: " << stats.active_sessions << endl;
         cout << "Fragmentation: " << stats.fragmentation << "%" << endl;
+        
+        ReclaimStats reclaim;
+        if (get_reclaim_stats(current_session, &reclaim) == static_cast<int>(OFSErrorCodes::SUCCESS)) {
+            cout << "Pending free: " << reclaim.pending_free << " bytes (" << reclaim.pending_files << " deleted files)" << endl;
+        }
+        
+        PathCacheStats path_cache;
+        if (get_path_cache_stats(current_session, &path_cache) == static_cast<int>(OFSErrorCodes::SUCCESS)) {
+            cout << "Path cache hit rate: " << (path_cache.hit_rate * 100) << "% (" << path_cache.entries
+                 << "/" << path_cache.capacity << " paths cached)" << endl;
+        }
+        
+        DurabilityStats durability;
+        if (get_durability_stats(current_session, &durability) == static_cast<int>(OFSErrorCodes::SUCCESS)) {
+            cout << "Syncs issued: " << durability.syncs << " (" << durability.synced_operations
+                 << " operations made durable)" << endl;
+        }
     } else {
         printError(result);
     }
@@ -633,6 +701,8 @@ void systemOperationsMenu() {
         cout << "1. Initialize File System" << endl;
         cout << "2. Format File System" << endl;
         cout << "3. Shutdown File System" << endl;
+        cout << "4. Defragment File System" << endl;
+        cout << "5. Sync File System" << endl;
         cout << "0. Back to Main Menu" << endl;
         cout << "\nChoice: ";
         
@@ -644,6 +714,8 @@ void systemOperationsMenu() {
             case 1: initializeFileSystem(); pressEnterToContinue(); break;
             case 2: formatFileSystem(); pressEnterToContinue(); break;
             case 3: shutdownFileSystem(); pressEnterToContinue(); break;
+            case 4: defragmentFileSystem(); pressEnterToContinue(); break;
+            case 5: syncFileSystem(); pressEnterToContinue(); break;
             case 0: return;
             default: cout << "Invalid choice" << endl;
         }
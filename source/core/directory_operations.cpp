@@ -1,24 +1,21 @@
 #include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
 #include "../include/ofs_instance.h"
 #include "../include/session_manager.h"
 #include "../include/helper_functions.h"
+#include "../include/directory_index.h"
+#include "../include/durability.h"
 #include <iostream>
 #include <cstring>
 #include <ctime>
+#include <algorithm>
+#include <unordered_map>
 
 using namespace std;
 
-// create a new directory
-extern "C" int dir_create(void* session, const char* path) {
-    string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
-    
-    if (!ms || !ms->instance) {
-        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
-    }
-    
-    OFSInstance* fs = ms->instance;
-
+// the body of dir_create, for callers that hold the session and the
+// operation lock already (ofs_batch)
+int createDirectory(OFSInstance* fs, ManagedSession* ms, const char* path) {
     // check for valid path
     if (!path || path[0] != '/') {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
@@ -30,8 +27,8 @@ extern "C" int dir_create(void* session, const char* path) {
     }
     
     // get parent index for this directory
-    uint32_t parent_idx = getParentIndexFromPath(fs, string(path));
-    if (parent_idx == 0 && string(path) != "/") {
+    uint32_t parent_idx = getParentIndexFromPath(fs, path);
+    if (parent_idx == 0 && strcmp(path, "/") != 0) {
         // parent doesn't exist
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
     }
@@ -42,62 +39,82 @@ extern "C" int dir_create(void* session, const char* path) {
     }
     
     // find next free index
-    uint32_t free_index = findFreeEntryIndex(fs);
+    uint32_t free_index = allocateEntryIndex(fs);
     if (free_index == 0) {
         fs->file_tree->deleteNode(path);
         return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
     }
     
+    if (!addChildEntry(fs, node->parent, free_index, node->name)) {
+        releaseEntryIndex(fs, free_index);
+        fs->file_tree->deleteNode(path);
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    
     node->entryIndex = free_index;
     node->permissions = 0755;
     node->created_time = time(nullptr);
-    node->modified_time = node->created_time;
+    node->setModifiedTime(node->created_time);
+    fs->file_tree->indexEntry(node);
     
     fs->total_directories++;
     
-    // write fileEntry to disk with parent_index
-    string filename = extractFilename(string(path));
+    // write fileEntry to disk with parent_index; it starts with an empty child list
+    string filename = extractFilename(path);
     FileEntry dir_entry(filename, EntryType::DIRECTORY, 0, node->permissions, 
-                       node->owner, node->entryIndex, parent_idx);
+                       node->getOwner(), 0, parent_idx);
+    dir_entry.reserved[0] |= ENTRY_FLAG_CHILD_INDEX;
     
     dir_entry.created_time = node->created_time;
     dir_entry.modified_time = node->modified_time;
     dir_entry.markValid();
     
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo)) +
-                                (node->entryIndex * sizeof(FileEntry));
-    
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fwrite(&dir_entry, sizeof(FileEntry), 1, fs->omni_file);
-    fflush(fs->omni_file);
+    writeFileEntry(fs, node->entryIndex, dir_entry);
+    flushMetadata(fs);
     
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
+// create a new directory
+extern "C" int dir_create(void* session, const char* path) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    return createDirectory(fs, ms.get(), path);
+}
+
 // list all directories at path
 extern "C" int dir_list(void* session, const char* path, FileEntry** entries, int* count) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     
     // is valid directory
-    if (!fs->file_tree->isDirectory(path)) {
+    TreeNode* dir = fs->file_tree->findNode(path);
+    if (!dir || dir->isFile) {
         return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
     }
     
-    vector<FileEntry> dir_entries = fs->file_tree->listDirectory(path);
-    *count = dir_entries.size();
+    fs->file_tree->loadChildren(dir);
+    *count = dir->children.size();
     
     if (*count > 0) {
         *entries = new FileEntry[*count];
         for (int i = 0; i < *count; i++) {
-            (*entries)[i] = dir_entries[i];
+            FileTree::fillListEntry(dir->children[i], (*entries)[i]);
         }
     } else {
         *entries = nullptr;
@@ -106,17 +123,184 @@ extern "C" int dir_list(void* session, const char* path, FileEntry** entries, in
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
-// delete directory 
-extern "C" int dir_delete(void* session, const char* path) {
+// one page of a directory listing into a caller buffer of limit entries;
+// pass the same cursor back for the next page until cursor->done is set
+extern "C" int dir_list_page(void* session, const char* path, DirListCursor* cursor, uint32_t limit,
+                             uint32_t sort_key, FileEntry* entries, uint32_t* count) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    if (!cursor || !entries || !count || limit == 0 || sort_key >= DIR_LIST_SORT_COUNT) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    // a cursor stays with the order it was started in
+    if (cursor->position > 0 && cursor->sort_key != sort_key) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    cursor->sort_key = sort_key;
+    
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    TreeNode* dir = fs->file_tree->findNode(path);
+    if (!dir || dir->isFile) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    }
+    
+    *count = fs->file_tree->listPage(dir, *cursor, entries, limit);
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// names under root matching pattern ('*' and '?' wildcards, a plain
+// pattern matches names containing it), a page of up to limit results at a
+// time; pass the same cursor back until cursor->done is set
+extern "C" int fs_find(void* session, const char* root, const char* pattern, FindCursor* cursor,
+                       uint32_t limit, FileMetadata* results, uint32_t* count) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    if (!pattern || !cursor || !results || !count || limit == 0) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    TreeNode* dir = fs->file_tree->findNode(root);
+    if (!dir || dir->isFile) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    }
+    
+    vector<TreeNode*> matches = fs->file_tree->findByName(dir, pattern);
+    sort(matches.begin(), matches.end(),
+         [](const TreeNode* a, const TreeNode* b) { return a->entryIndex < b->entryIndex; });
+    
+    // resume after the last entry returned, wherever it is now
+    size_t start = 0;
+    if (cursor->returned > 0) {
+        start = upper_bound(matches.begin(), matches.end(), cursor->last_entry,
+                            [](uint32_t entry, const TreeNode* node) { return entry < node->entryIndex; })
+                - matches.begin();
+    }
+    
+    *count = 0;
+    while (*count < limit && start + *count < matches.size()) {
+        TreeNode* node = matches[start + *count];
+        fillMetadata(fs, node, node->getFullPath(), &results[*count]);
+        cursor->last_entry = node->entryIndex;
+        (*count)++;
+    }
+    
+    cursor->returned += *count;
+    cursor->done = (start + *count >= matches.size()) ? 1 : 0;
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// metadata for indexed entries, skipping any whose node can't be reached
+static uint32_t fillEntryResults(OFSInstance* fs, const vector<uint32_t>& entries, FileMetadata* results) {
+    vector<TreeNode*> nodes = fs->file_tree->resolveEntries(entries);
+    
+    uint32_t filled = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i]) {
+            fillMetadata(fs, nodes[i], nodes[i]->getFullPath(), &results[filled++]);
+        }
+    }
+    return filled;
+}
+
+// files and directories owned by a user, a page of up to limit results at
+// a time in entry index order; pass the same cursor back until cursor->done
+extern "C" int find_by_owner(void* session, const char* owner, FindCursor* cursor, uint32_t limit,
+                             FileMetadata* results, uint32_t* count) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    if (!owner || !cursor || !results || !count || limit == 0) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    // a name nothing was ever owned by owns nothing
+    *count = 0;
+    uint16_t owner_id;
+    if (!OwnerNames::find(owner, owner_id)) {
+        cursor->done = 1;
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+    
+    bool done;
+    vector<uint32_t> entries = fs->file_tree->getAttributeIndex().ownedBy(owner_id, cursor->last_entry,
+                                                                          limit, done);
+    
+    *count = fillEntryResults(fs, entries, results);
+    if (!entries.empty()) {
+        cursor->last_entry = entries.back();
+    }
+    cursor->returned += *count;
+    cursor->done = done ? 1 : 0;
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// files and directories last modified between since and until (inclusive),
+// a page of up to limit results at a time, oldest first; pass the same
+// cursor back until cursor->done is set
+extern "C" int find_modified(void* session, uint64_t since, uint64_t until, FindCursor* cursor,
+                             uint32_t limit, FileMetadata* results, uint32_t* count) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
+    if (!cursor || !results || !count || limit == 0 || since > until) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
     OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     
+    bool done;
+    vector<pair<uint64_t, uint32_t> > found = fs->file_tree->getAttributeIndex().modifiedBetween(
+        since, until, cursor->last_time, cursor->last_entry, limit, done);
+    
+    vector<uint32_t> entries(found.size());
+    for (size_t i = 0; i < found.size(); i++) {
+        entries[i] = found[i].second;
+    }
+    
+    *count = fillEntryResults(fs, entries, results);
+    if (!found.empty()) {
+        cursor->last_time = found.back().first;
+        cursor->last_entry = found.back().second;
+    }
+    cursor->returned += *count;
+    cursor->done = done ? 1 : 0;
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// the body of dir_delete, for callers that hold the session and the
+// operation lock already (ofs_batch)
+int deleteDirectory(OFSInstance* fs, ManagedSession* ms, const char* path) {
     // cannot delete root 
     if (strcmp(path, "/") == 0) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
@@ -134,30 +318,28 @@ extern "C" int dir_delete(void* session, const char* path) {
     }
     
     // can not delete non empty directories
+    fs->file_tree->loadChildren(node);
     if (!node->children.empty()) {
         return static_cast<int>(OFSErrorCodes::ERROR_DIRECTORY_NOT_EMPTY);
     }
     
     // owner/admin to delete directory
-    if (strcmp(node->owner.c_str(), ms->info.user.username) != 0 && 
+    if (strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
         ms->info.user.role != UserRole::ADMIN) {
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
     }
     
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo)) +
-                                (node->entryIndex * sizeof(FileEntry));
-    
     FileEntry entry;
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fread(&entry, sizeof(FileEntry), 1, fs->omni_file);
+    readFileEntry(fs, node->entryIndex, entry);
     
     // mark validity to invalid
     entry.markInvalid();
     
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fwrite(&entry, sizeof(FileEntry), 1, fs->omni_file);
-    fflush(fs->omni_file);
+    writeFileEntry(fs, node->entryIndex, entry);
+    flushMetadata(fs);
+    
+    releaseEntryIndex(fs, node->entryIndex);
+    removeChildEntry(fs, node->parent, node->entryIndex, node->name);
     
     if (fs->file_tree->deleteNode(path)) {
         fs->total_directories--;
@@ -167,16 +349,457 @@ extern "C" int dir_delete(void* session, const char* path) {
     return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
 }
 
+// delete directory 
+extern "C" int dir_delete(void* session, const char* path) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    return deleteDirectory(fs, ms.get(), path);
+}
+
+// delete a directory with everything below it. The subtree is walked once
+// in memory, every FileEntry is invalidated in one batched pass and every
+// block chain is freed in one go, or left to the reclaimer with
+// DIR_DELETE_BACKGROUND_FREE. removed (optional) gets what was deleted,
+// the directory itself included.
+extern "C" int dir_delete_recursive(void* session, const char* path, uint32_t flags, DirUsage* removed) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    if (!path || strcmp(path, "/") == 0) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    TreeNode* dir = fs->file_tree->findNode(path);
+    if (!dir) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    }
+    if (dir->isFile || dir == fs->file_tree->getRoot()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    // nothing changes unless the caller could delete every node one by one
+    vector<TreeNode*> nodes = fs->file_tree->getSubtree(dir);
+    bool admin = ms->info.user.role == UserRole::ADMIN;
+    for (size_t i = 0; i < nodes.size() && !admin; i++) {
+        bool checked = !nodes[i]->isFile || fs->config.require_auth;
+        if (checked && strcmp(nodes[i]->getOwner().c_str(), ms->info.user.username) != 0) {
+            return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+        }
+    }
+    
+    bool background = (flags & DIR_DELETE_BACKGROUND_FREE) != 0;
+    uint32_t usable_block_size = getUsableBlockSize(fs);
+    DirectoryUsage usage = fs->file_tree->getUsage(dir);
+    
+    // entry order, so neighbouring entries share a read and a write
+    sort(nodes.begin(), nodes.end(),
+         [](const TreeNode* a, const TreeNode* b) { return a->entryIndex < b->entryIndex; });
+    vector<uint32_t> indexes(nodes.size());
+    uint32_t files = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        indexes[i] = nodes[i]->entryIndex;
+        if (nodes[i]->isFile) {
+            files++;
+            fs->delayed_writes.remove(nodes[i]->entryIndex);
+        }
+    }
+    
+    // a file's chain holds its data, a directory's its child list; a chain
+    // left to the reclaimer keeps its entry flagged until it is freed
+    updateFileEntries(fs, indexes, [&](size_t i, FileEntry& entry) {
+        entry.markInvalid();
+        if (background && nodes[i]->startBlockIndex != 0) {
+            entry.reserved[0] |= ENTRY_FLAG_PENDING_RECLAIM;
+            entry.inode = nodes[i]->startBlockIndex;
+        }
+    });
+    commitMetadata(fs);
+    
+    vector<uint32_t> blocks;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        uint32_t start = nodes[i]->startBlockIndex;
+        if (start != 0 && background) {
+            uint32_t chain_blocks = nodes[i]->isFile ? calculateBlocksNeeded(nodes[i]->size, usable_block_size) : 0;
+            fs->reclaim_queue.push(nodes[i]->entryIndex, start, chain_blocks);
+            continue;
+        }
+        
+        if (start != 0) {
+            vector<uint32_t> chain = getBlockChain(fs, start);
+            blocks.insert(blocks.end(), chain.begin(), chain.end());
+        }
+        releaseEntryIndex(fs, nodes[i]->entryIndex);
+    }
+    
+    // the entries stopped pointing at the chains before they are given back
+    fs->free_manager->freeBlockSegments(blocks);
+    
+    removeChildEntry(fs, dir->parent, dir->entryIndex, dir->name);
+    
+    if (!fs->file_tree->deleteTree(dir)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+    
+    fs->total_files -= files;
+    fs->total_directories -= nodes.size() - files;
+    
+    if (removed) {
+        *removed = DirUsage();
+        removed->total_bytes = usage.bytes;
+        removed->file_count = usage.files;
+        removed->directory_count = usage.directories + 1;
+        removed->blocks_used = usage.blocks;
+        removed->actual_size = usage.blocks * fs->header.block_size;
+    }
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// true when node is dir or anywhere below it
+static bool isWithin(const TreeNode* node, const TreeNode* dir) {
+    for (; node; node = node->parent) {
+        if (node == dir) return true;
+    }
+    return false;
+}
+
+// path of a new child called name in dir
+static string childPath(TreeNode* dir, string_view name) {
+    string path = dir->parent ? dir->getFullPath() : string();
+    path += '/';
+    path.append(name.data(), name.size());
+    return path;
+}
+
+// move or rename a directory. Only the directory itself changes: its entry
+// gets the new name and parent_index and the two child lists are updated;
+// everything below it moves along without being touched.
+extern "C" int dir_rename(void* session, const char* old_path, const char* new_path) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    if (!old_path || !new_path || new_path[0] != '/') {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    
+    TreeNode* node = fs->file_tree->findNode(old_path);
+    if (!node || node->isFile) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    }
+    if (node == fs->file_tree->getRoot()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    if (strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
+        ms->info.user.role != UserRole::ADMIN) {
+        return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+    }
+    
+    if (fs->file_tree->exists(new_path)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    }
+    
+    TreeNode* new_parent = getParentNodeFromPath(fs, new_path);
+    if (!new_parent) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    
+    // a directory can't end up inside itself
+    if (isWithin(new_parent, node)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    string new_name = extractFilename(new_path);
+    if (new_name.empty()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    if (new_name.length() > fs->config.max_filename_length) {
+        new_name = new_name.substr(0, fs->config.max_filename_length);
+    }
+    
+    string target = childPath(new_parent, new_name);
+    if (fs->file_tree->exists(target)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    }
+    
+    // as with files, the new name goes into the target's child list first,
+    // so running out of space leaves the directory where it was
+    TreeNode* old_parent = node->parent;
+    string old_name(node->name.view());
+    if (!addChildEntry(fs, new_parent, node->entryIndex, new_name)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    
+    FileEntry dir_entry;
+    readFileEntry(fs, node->entryIndex, dir_entry);
+    strncpy(dir_entry.name, new_name.c_str(), sizeof(dir_entry.name) - 1);
+    dir_entry.name[sizeof(dir_entry.name) - 1] = '\0';
+    dir_entry.parent_index = new_parent->entryIndex;
+    dir_entry.modified_time = time(nullptr);
+    writeFileEntry(fs, node->entryIndex, dir_entry);
+    commitMetadata(fs);
+    
+    removeChildEntry(fs, old_parent, node->entryIndex, old_name);
+    
+    if (fs->file_tree->rename(old_path, target)) {
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+    
+    return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+}
+
+// copy a file or a directory tree to a path that doesn't exist yet without
+// the data leaving the server. Metadata is duplicated, file content is read
+// through each chain in long sequential runs and written to freshly
+// allocated runs, and each new directory's child list is written once. The
+// copy belongs to the caller, keeps the source's permissions and gets new
+// timestamps. copied (optional) gets what was copied.
+extern "C" int tree_copy(void* session, const char* src_path, const char* dst_path, DirUsage* copied) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    if (!src_path || !dst_path || dst_path[0] != '/') {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    
+    TreeNode* source = fs->file_tree->findNode(src_path);
+    if (!source) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    }
+    if (source == fs->file_tree->getRoot()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    if (fs->file_tree->exists(dst_path)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    }
+    
+    TreeNode* dest_parent = getParentNodeFromPath(fs, dst_path);
+    if (!dest_parent) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    if (isWithin(dest_parent, source)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    string name = extractFilename(dst_path);
+    if (name.empty()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    if (name.length() > fs->config.max_filename_length) {
+        name = name.substr(0, fs->config.max_filename_length);
+    }
+    if (fs->file_tree->exists(childPath(dest_parent, name))) {
+        return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    }
+    
+    // the caller has to be able to read every file it copies
+    vector<TreeNode*> nodes = fs->file_tree->getSubtree(source);
+    bool admin = ms->info.user.role == UserRole::ADMIN;
+    uint32_t usable_block_size = getUsableBlockSize(fs);
+    uint64_t blocks_needed = 0;
+    uint32_t files = 0;
+    
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i]->isFile) continue;
+        
+        files++;
+        blocks_needed += max(1u, calculateBlocksNeeded(nodes[i]->size, usable_block_size));
+        if (fs->config.require_auth && !admin && (nodes[i]->permissions & 0444) == 0 &&
+            strcmp(nodes[i]->getOwner().c_str(), ms->info.user.username) != 0) {
+            return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+        }
+    }
+    
+    // everything the copy needs up front; child lists are checked as they are written
+    if (fs->entry_slots.getFreeCount() < nodes.size() ||
+        fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + blocks_needed) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    
+    // the copy in memory first, parents before children
+    vector<TreeNode*> copies(nodes.size(), nullptr);
+    unordered_map<const TreeNode*, TreeNode*> copy_of;
+    time_t now = time(nullptr);
+    
+    for (size_t i = 0; i < nodes.size(); i++) {
+        TreeNode* node = nodes[i];
+        string path = (i == 0) ? childPath(dest_parent, name)
+                               : childPath(copy_of[node->parent], node->name);
+        
+        TreeNode* copy = fs->file_tree->createNode(path, node->isFile, ms->info.user.username);
+        copy->entryIndex = allocateEntryIndex(fs);
+        copy->permissions = node->permissions;
+        copy->created_time = now;
+        copy->setModifiedTime(now);
+        fs->file_tree->indexEntry(copy);
+        
+        copies[i] = copy;
+        copy_of[node] = copy;
+    }
+    
+    vector<uint32_t> written_blocks;
+    bool entries_written = false;
+    
+    // puts everything back as it was when a step runs out of space
+    auto undo = [&](OFSErrorCodes error) {
+        vector<uint32_t> indexes;
+        for (size_t i = 0; i < copies.size(); i++) {
+            if (!copies[i]->isFile && copies[i]->startBlockIndex != 0) {
+                vector<uint32_t> chain = getBlockChain(fs, copies[i]->startBlockIndex);
+                written_blocks.insert(written_blocks.end(), chain.begin(), chain.end());
+            }
+            indexes.push_back(copies[i]->entryIndex);
+        }
+        sort(indexes.begin(), indexes.end());
+        
+        if (entries_written) {
+            updateFileEntries(fs, indexes, [](size_t, FileEntry& entry) { entry.markInvalid(); });
+            commitMetadata(fs);
+        }
+        fs->free_manager->freeBlockSegments(written_blocks);
+        for (size_t i = 0; i < indexes.size(); i++) {
+            releaseEntryIndex(fs, indexes[i]);
+        }
+        
+        if (copies[0]->isFile) {
+            fs->file_tree->deleteNode(copies[0]->getFullPath());
+        } else {
+            fs->file_tree->deleteTree(copies[0]);
+        }
+        return static_cast<int>(error);
+    };
+    
+    vector<char> data;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i]->isFile) continue;
+        
+        TreeNode* copy = copies[i];
+        DirtyFile* dirty = fs->delayed_writes.find(nodes[i]->entryIndex);
+        if (dirty) {
+            data.assign(dirty->data.begin(), dirty->data.begin() + min((size_t)nodes[i]->size, dirty->data.size()));
+        } else if (!readChainData(fs, nodes[i]->startBlockIndex, nodes[i]->size, data)) {
+            return undo(OFSErrorCodes::ERROR_IO_ERROR);
+        }
+        
+        uint32_t count = max(1u, calculateBlocksNeeded(data.size(), usable_block_size));
+        vector<uint32_t> blocks = allocateFileBlocks(fs->free_manager, count,
+                                                     getHomeGroup(fs, copy->parent->entryIndex));
+        if (blocks.empty()) {
+            return undo(OFSErrorCodes::ERROR_NO_SPACE);
+        }
+        
+        writeBlockChain(fs, blocks, data.data(), data.size());
+        written_blocks.insert(written_blocks.end(), blocks.begin(), blocks.end());
+        copy->startBlockIndex = blocks[0];
+        fs->file_tree->setFileSize(copy, data.size());
+    }
+    
+    // every new entry in entry order, then one child list per directory
+    vector<size_t> order(copies.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    sort(order.begin(), order.end(),
+         [&](size_t a, size_t b) { return copies[a]->entryIndex < copies[b]->entryIndex; });
+    
+    vector<uint32_t> indexes(order.size());
+    for (size_t i = 0; i < order.size(); i++) indexes[i] = copies[order[i]]->entryIndex;
+    
+    auto makeEntry = [&](TreeNode* copy) {
+        FileEntry entry(copy->name.c_str(), copy->isFile ? EntryType::FILE : EntryType::DIRECTORY,
+                        copy->size, copy->permissions, copy->getOwner(),
+                        copy->isFile ? copy->startBlockIndex : 0, copy->parent->entryIndex);
+        entry.created_time = copy->created_time;
+        entry.modified_time = copy->modified_time;
+        if (!copy->isFile) {
+            entry.size = 0;
+            entry.reserved[0] |= ENTRY_FLAG_CHILD_INDEX;
+        }
+        entry.markValid();
+        return entry;
+    };
+    
+    entries_written = true;
+    updateFileEntries(fs, indexes, [&](size_t i, FileEntry& entry) { entry = makeEntry(copies[order[i]]); });
+    
+    for (size_t i = 0; i < copies.size(); i++) {
+        TreeNode* copy = copies[i];
+        if (copy->isFile || copy->children.empty()) continue;
+        
+        vector<ChildRecord> children;
+        for (size_t j = 0; j < copy->children.size(); j++) {
+            children.push_back(ChildRecord(copy->children[j]->entryIndex, copy->children[j]->name));
+        }
+        sort(children.begin(), children.end(),
+             [](const ChildRecord& a, const ChildRecord& b) { return a.name < b.name; });
+        
+        FileEntry dir_entry = makeEntry(copy);
+        if (!writeChildList(fs, copy, dir_entry, children)) {
+            return undo(OFSErrorCodes::ERROR_NO_SPACE);
+        }
+    }
+    flushMetadata(fs);
+    
+    // linking the top of the copy into its parent makes it visible
+    if (!addChildEntry(fs, dest_parent, copies[0]->entryIndex, copies[0]->name)) {
+        return undo(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    
+    fs->total_files += files;
+    fs->total_directories += nodes.size() - files;
+    
+    if (copied) {
+        DirectoryUsage usage = fs->file_tree->getContribution(copies[0]);
+        *copied = DirUsage();
+        copied->total_bytes = usage.bytes;
+        copied->file_count = usage.files;
+        copied->directory_count = usage.directories;
+        copied->blocks_used = usage.blocks;
+        copied->actual_size = usage.blocks * fs->header.block_size;
+    }
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
 // check if directory exist
 extern "C" int dir_exists(void* session, const char* path) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     
     if (fs->file_tree->isDirectory(path)) {
         return static_cast<int>(OFSErrorCodes::SUCCESS);
@@ -2,23 +2,18 @@
 #include "../include/ofs_instance.h"
 #include "../include/session_manager.h"
 #include "../include/helper_functions.h"
+#include "../include/directory_index.h"
 #include "../include/config_parser.h"
+#include "../include/durability.h"
 #include <iostream>
 #include <cstring>
 #include <algorithm>
 
 using namespace std;
 
-extern "C" int file_create(void* session, const char* path, const char* data, size_t size) {
-    string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
-    
-    if (!ms || !ms->instance) {
-        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
-    }
-    
-    OFSInstance* fs = ms->instance;
-    
+// the body of file_create, for callers that hold the session and the
+// operation lock already (ofs_batch)
+int createFile(OFSInstance* fs, ManagedSession* ms, const char* path, const char* data, size_t size) {
     if (!path || path[0] != '/') {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
     }
@@ -27,8 +22,8 @@ extern "C" int file_create(void* session, const char* path, const char* data, si
         return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
     }
     
-    uint32_t parent_idx = getParentIndexFromPath(fs, string(path));
-    if (parent_idx == 0 && string(path) != "/") {
+    uint32_t parent_idx = getParentIndexFromPath(fs, path);
+    if (parent_idx == 0 && strcmp(path, "/") != 0) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
     }
     
@@ -39,93 +34,105 @@ extern "C" int file_create(void* session, const char* path, const char* data, si
     }
     if (blocks_needed == 0) blocks_needed = 1;
     
-    vector<uint32_t> blocks = allocateFileBlocks(fs->free_manager, blocks_needed);
-    if (blocks.empty()) {
+    // blocks promised to buffered files can't be handed out again
+    if (fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + blocks_needed) {
         return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
     }
     
+    // with delayed allocation the data stays in memory until flushed
+    bool delayed = fs->config.delayed_allocation && buffersContent(getDurability(fs, ms));
+    
+    vector<uint32_t> blocks;
+    if (!delayed) {
+        blocks = allocateFileBlocks(fs->free_manager, blocks_needed, getHomeGroup(fs, parent_idx));
+        if (blocks.empty()) {
+            return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        }
+    }
+    
     TreeNode* node = fs->file_tree->createNode(path, true, ms->info.user.username);
     if (!node) {
         fs->free_manager->freeBlockSegments(blocks);
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
     }
     
-    uint32_t next_entry_index = findFreeEntryIndex(fs, fs->config.max_files);
+    uint32_t next_entry_index = allocateEntryIndex(fs);
     if (next_entry_index == 0) {
         fs->file_tree->deleteNode(path);
         fs->free_manager->freeBlockSegments(blocks);
         return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
     }
     
+    string filename = extractFilename(path);
+    if (filename.length() > fs->config.max_filename_length) {
+        filename = filename.substr(0, fs->config.max_filename_length);
+    }
+    
+    if (!addChildEntry(fs, node->parent, next_entry_index, filename)) {
+        releaseEntryIndex(fs, next_entry_index);
+        fs->file_tree->deleteNode(path);
+        fs->free_manager->freeBlockSegments(blocks);
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    
     node->entryIndex = next_entry_index;
-    node->startBlockIndex = blocks[0];
-    node->size = size;
+    node->startBlockIndex = delayed ? 0 : blocks[0];
+    fs->file_tree->setFileSize(node, size);
     node->permissions = fs->config.require_auth ? 0644 : 0666;
     node->created_time = time(nullptr);
-    node->modified_time = node->created_time;
+    node->setModifiedTime(node->created_time);
+    fs->file_tree->indexEntry(node);
     
-    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
-    
-    size_t written = 0;
-    
-    for (size_t i = 0; i < blocks.size(); i++) {
-        uint64_t block_offset = content_offset + (blocks[i] * fs->header.block_size);
-        fseek(fs->omni_file, block_offset, SEEK_SET);
-        
-        uint32_t next_block = (i < blocks.size() - 1) ? blocks[i + 1] : 0;
-        fwrite(&next_block, sizeof(uint32_t), 1, fs->omni_file);
-        
-        size_t to_write = min(size - written, (size_t)usable_block_size);
-        if (to_write > 0 && data) {
-            fwrite(data + written, 1, to_write, fs->omni_file);
-            written += to_write;
-        } else if (to_write > 0) {
-            vector<char> zeros(to_write, 0);
-            fwrite(zeros.data(), 1, to_write, fs->omni_file);
-            written += to_write;
-        }
-        
-        if (to_write < usable_block_size) {
-            size_t remaining = usable_block_size - to_write;
-            vector<char> zeros(remaining, 0);
-            fwrite(zeros.data(), 1, remaining, fs->omni_file);
-        }
+    if (delayed) {
+        fs->delayed_writes.insert(node->entryIndex, node, data, size, blocks_needed);
+    } else {
+        writeBlockChain(fs, blocks, data, size);
     }
     
-    string filename = extractFilename(string(path));
-    if (filename.length() > fs->config.max_filename_length) {
-        filename = filename.substr(0, fs->config.max_filename_length);
-    }
-    
-    FileEntry file_entry(filename, EntryType::FILE, node->size, node->permissions,
-                        node->owner, node->startBlockIndex, parent_idx);
+    // a buffered file stays empty on disk until its flush
+    FileEntry file_entry(filename, EntryType::FILE, delayed ? 0 : node->size, node->permissions,
+                        node->getOwner(), node->startBlockIndex, parent_idx);
     
     file_entry.created_time = node->created_time;
     file_entry.modified_time = node->modified_time;
     file_entry.markValid();
     
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo)) +
-                                (node->entryIndex * sizeof(FileEntry));
-    
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fwrite(&file_entry, sizeof(FileEntry), 1, fs->omni_file);
-    fflush(fs->omni_file);
+    writeFileEntry(fs, node->entryIndex, file_entry);
+    flushMetadata(fs);
     
     fs->total_files++;
     
+    if (delayed) {
+        enforceDelayedWriteLimit(fs);
+    }
+    
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
+extern "C" int file_create(void* session, const char* path, const char* data, size_t size) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    return createFile(fs, ms.get(), path, data, size);
+}
+
 extern "C" int file_read(void* session, const char* path, char** buffer, size_t* size) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     
     TreeNode* node = fs->file_tree->findNode(path);
     if (!node || !node->isFile) {
@@ -133,13 +140,22 @@ extern "C" int file_read(void* session, const char* path, char** buffer, size_t*
     }
     
     if (fs->config.require_auth && (node->permissions & 0444) == 0) {
-        if (strcmp(node->owner.c_str(), ms->info.user.username) != 0 && 
+        if (strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
             ms->info.user.role != UserRole::ADMIN) {
             return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
         }
     }
     
     *size = node->size;
+    
+    DirtyFile* dirty = fs->delayed_writes.find(node->entryIndex);
+    if (dirty) {
+        *buffer = new char[*size + 1];
+        memcpy(*buffer, dirty->data.data(), *size);
+        (*buffer)[*size] = '\0';
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+    
     if (*size == 0) {
         *buffer = new char[1];
         (*buffer)[0] = '\0';
@@ -176,61 +192,40 @@ extern "C" int file_read(void* session, const char* path, char** buffer, size_t*
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
-extern "C" int file_delete(void* session, const char* path) {
-    string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
-    
-    if (!ms || !ms->instance) {
-        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
-    }
-    
-    OFSInstance* fs = ms->instance;
-    
+// the body of file_delete, for callers that hold the session and the
+// operation lock already (ofs_batch)
+int deleteFile(OFSInstance* fs, ManagedSession* ms, const char* path) {
     TreeNode* node = fs->file_tree->findNode(path);
     if (!node || !node->isFile) {
         return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
     }
     
-    if (fs->config.require_auth && strcmp(node->owner.c_str(), ms->info.user.username) != 0 && 
+    if (fs->config.require_auth && strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
         ms->info.user.role != UserRole::ADMIN) {
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
     }
     
-    vector<uint32_t> blocks_to_free;
-    uint32_t current_block = node->startBlockIndex;
+    fs->delayed_writes.remove(node->entryIndex);
     
-    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
+    FileEntry entry;
+    readFileEntry(fs, node->entryIndex, entry);
     
-    while (current_block != 0) {
-        blocks_to_free.push_back(current_block);
-        
-        uint64_t block_offset = content_offset + (current_block * fs->header.block_size);
-        fseek(fs->omni_file, block_offset, SEEK_SET);
-        
-        uint32_t next_block;
-        if (fread(&next_block, sizeof(uint32_t), 1, fs->omni_file) != 1) {
-            break;
-        }
-        current_block = next_block;
-    }
+    entry.markInvalid();
     
-    if (!blocks_to_free.empty()) {
-        fs->free_manager->freeBlockSegments(blocks_to_free);
+    // the chain is freed by the maintenance worker; until then the entry
+    // keeps the chain head and its slot stays taken
+    if (node->startBlockIndex != 0) {
+        entry.reserved[0] |= ENTRY_FLAG_PENDING_RECLAIM;
+        fs->reclaim_queue.push(node->entryIndex, node->startBlockIndex,
+                               calculateBlocksNeeded(node->size, getUsableBlockSize(fs)));
+    } else {
+        releaseEntryIndex(fs, node->entryIndex);
     }
     
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo)) +
-                                (node->entryIndex * sizeof(FileEntry));
-    
-    FileEntry entry;
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fread(&entry, sizeof(FileEntry), 1, fs->omni_file);
-    
-    entry.markInvalid();
+    writeFileEntry(fs, node->entryIndex, entry);
+    flushMetadata(fs);
     
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fwrite(&entry, sizeof(FileEntry), 1, fs->omni_file);
-    fflush(fs->omni_file);
+    removeChildEntry(fs, node->parent, node->entryIndex, string(entry.name));
     
     if (fs->file_tree->deleteNode(path)) {
         fs->total_files--;
@@ -240,15 +235,30 @@ extern "C" int file_delete(void* session, const char* path) {
     return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
 }
 
+extern "C" int file_delete(void* session, const char* path) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    return deleteFile(fs, ms.get(), path);
+}
+
 extern "C" int file_exists(void* session, const char* path) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     
     if (fs->file_tree->isFile(path)) {
         return static_cast<int>(OFSErrorCodes::SUCCESS);
@@ -259,20 +269,21 @@ extern "C" int file_exists(void* session, const char* path) {
 
 extern "C" int file_rename(void* session, const char* old_path, const char* new_path) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
     
     TreeNode* node = fs->file_tree->findNode(old_path);
     if (!node || !node->isFile) {
         return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
     }
     
-    if (fs->config.require_auth && strcmp(node->owner.c_str(), ms->info.user.username) != 0 && 
+    if (fs->config.require_auth && strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
         ms->info.user.role != UserRole::ADMIN) {
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
     }
@@ -281,32 +292,40 @@ extern "C" int file_rename(void* session, const char* old_path, const char* new_
         return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
     }
     
-    uint32_t new_parent_idx = getParentIndexFromPath(fs, string(new_path));
-    if (new_parent_idx == 0 && string(new_path) != "/") {
+    uint32_t new_parent_idx = getParentIndexFromPath(fs, new_path);
+    if (new_parent_idx == 0 && strcmp(new_path, "/") != 0) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
     }
     
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo)) +
-                                (node->entryIndex * sizeof(FileEntry));
-    
     FileEntry file_entry;
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fread(&file_entry, sizeof(FileEntry), 1, fs->omni_file);
+    readFileEntry(fs, node->entryIndex, file_entry);
     
-    string new_name = extractFilename(string(new_path));
+    string new_name = extractFilename(new_path);
     if (new_name.length() > fs->config.max_filename_length) {
         new_name = new_name.substr(0, fs->config.max_filename_length);
     }
     
+    // the new name is recorded in the target directory's child list before
+    // anything else changes, so running out of space leaves the file as it was
+    TreeNode* old_parent = node->parent;
+    TreeNode* new_parent = getParentNodeFromPath(fs, new_path);
+    string old_name = file_entry.name;
+    if (!new_parent) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    if (!addChildEntry(fs, new_parent, node->entryIndex, new_name)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    
     strncpy(file_entry.name, new_name.c_str(), sizeof(file_entry.name) - 1);
     file_entry.name[sizeof(file_entry.name) - 1] = '\0';
     file_entry.parent_index = new_parent_idx;
     file_entry.modified_time = time(nullptr);
     
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fwrite(&file_entry, sizeof(FileEntry), 1, fs->omni_file);
-    fflush(fs->omni_file);
+    writeFileEntry(fs, node->entryIndex, file_entry);
+    flushMetadata(fs);
+    
+    removeChildEntry(fs, old_parent, node->entryIndex, old_name);
     
     if (fs->file_tree->rename(old_path, new_path)) {
         return static_cast<int>(OFSErrorCodes::SUCCESS);
@@ -315,22 +334,15 @@ extern "C" int file_rename(void* session, const char* old_path, const char* new_
     return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
 }
 
-extern "C" int file_edit(void* session, const char* path, const char* data, size_t size, uint32_t index) {
-    string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
-    
-    if (!ms || !ms->instance) {
-        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
-    }
-    
-    OFSInstance* fs = ms->instance;
-    
+// the body of file_edit, for callers that hold the session and the
+// operation lock already (ofs_batch)
+int editFile(OFSInstance* fs, ManagedSession* ms, const char* path, const char* data, size_t size, uint32_t index) {
     TreeNode* node = fs->file_tree->findNode(path);
     if (!node || !node->isFile) {
         return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
     }
     
-    if (fs->config.require_auth && strcmp(node->owner.c_str(), ms->info.user.username) != 0 && 
+    if (fs->config.require_auth && strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
         ms->info.user.role != UserRole::ADMIN) {
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
     }
@@ -339,12 +351,37 @@ extern "C" int file_edit(void* session, const char* path, const char* data, size
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
     }
     
+    // a file buffered by an earlier call goes out first, and the edit then
+    // lands on disk
+    if (!buffersContent(getDurability(fs, ms))) {
+        int flushed = flushDelayedFile(fs, node->entryIndex);
+        if (flushed != static_cast<int>(OFSErrorCodes::SUCCESS)) return flushed;
+    }
+    
     uint32_t usable_block_size = fs->header.block_size - 4;
     uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
     
     uint64_t new_size = index + size;
     bool needs_expansion = (new_size > node->size);
     
+    DirtyFile* dirty = fs->delayed_writes.find(node->entryIndex);
+    if (dirty) {
+        uint64_t buffered_size = needs_expansion ? new_size : node->size;
+        uint32_t blocks_needed = calculateBlocksNeeded(buffered_size, usable_block_size);
+        uint32_t extra_blocks = blocks_needed > dirty->reservedBlocks ? blocks_needed - dirty->reservedBlocks : 0;
+        
+        if (fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + extra_blocks) {
+            return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        }
+        
+        fs->delayed_writes.write(node->entryIndex, index, data, size, blocks_needed);
+        fs->file_tree->setFileSize(node, buffered_size);
+        fs->file_tree->setModifiedTime(node, time(nullptr));
+        
+        enforceDelayedWriteLimit(fs);
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+    
     if (needs_expansion) {
         uint32_t current_blocks = (node->size + usable_block_size - 1) / usable_block_size;
         uint32_t needed_blocks = (new_size + usable_block_size - 1) / usable_block_size;
@@ -363,16 +400,15 @@ extern "C" int file_edit(void* session, const char* path, const char* data, size
                 current_block = next_block;
             }
             
-            vector<uint32_t> new_blocks;
-            for (uint32_t i = 0; i < additional_blocks; i++) {
-                vector<uint32_t> single_block = fs->free_manager->allocateBlocks(1);
-                if (single_block.empty()) {
-                    if (!new_blocks.empty()) {
-                        fs->free_manager->freeBlockSegments(new_blocks);
-                    }
-                    return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
-                }
-                new_blocks.push_back(single_block[0]);
+            if (fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + additional_blocks) {
+                return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+            }
+            
+            uint32_t parent_idx = node->parent ? node->parent->entryIndex : 1;
+            vector<uint32_t> new_blocks = allocateFileBlocks(fs->free_manager, additional_blocks,
+                                                             getHomeGroup(fs, parent_idx));
+            if (new_blocks.empty()) {
+                return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
             }
             
             if (!current_block_chain.empty()) {
@@ -394,7 +430,7 @@ extern "C" int file_edit(void* session, const char* path, const char* data, size
             }
         }
         
-        node->size = new_size;
+        fs->file_tree->setFileSize(node, new_size);
     }
     
     uint32_t block_index = index / usable_block_size;
@@ -434,42 +470,56 @@ extern "C" int file_edit(void* session, const char* path, const char* data, size
         current_block = next_block;
     }
     
+    fs->file_tree->setModifiedTime(node, time(nullptr));
+    
     if (needs_expansion) {
-        uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                    (fs->header.max_users * sizeof(UserInfo)) +
-                                    (node->entryIndex * sizeof(FileEntry));
-        
         FileEntry file_entry;
-        fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-        fread(&file_entry, sizeof(FileEntry), 1, fs->omni_file);
+        readFileEntry(fs, node->entryIndex, file_entry);
         
         file_entry.size = node->size;
-        file_entry.modified_time = time(nullptr);
+        file_entry.modified_time = node->modified_time;
         
-        fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-        fwrite(&file_entry, sizeof(FileEntry), 1, fs->omni_file);
-        fflush(fs->omni_file);
+        writeFileEntry(fs, node->entryIndex, file_entry);
     }
     
+    // also for an edit in place, so its content is flushed and, in the
+    // strict and group modes, synced before the call returns
+    flushMetadata(fs);
+    
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
+extern "C" int file_edit(void* session, const char* path, const char* data, size_t size, uint32_t index) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    return editFile(fs, ms.get(), path, data, size, index);
+}
+
 extern "C" int file_truncate(void* session, const char* path) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
     
     TreeNode* node = fs->file_tree->findNode(path);
     if (!node || !node->isFile) {
         return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
     }
     
-    if (fs->config.require_auth && strcmp(node->owner.c_str(), ms->info.user.username) != 0 && 
+    if (fs->config.require_auth && strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
         ms->info.user.role != UserRole::ADMIN) {
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
     }
@@ -477,6 +527,19 @@ extern "C" int file_truncate(void* session, const char* path) {
     const char* text = "siruamr";
     size_t text_len = strlen(text);
     
+    if (!operation.buffersContent()) {
+        int flushed = flushDelayedFile(fs, node->entryIndex);
+        if (flushed != static_cast<int>(OFSErrorCodes::SUCCESS)) return flushed;
+    }
+    
+    DirtyFile* dirty = fs->delayed_writes.find(node->entryIndex);
+    if (dirty) {
+        for (size_t i = 0; i < dirty->data.size(); i++) {
+            dirty->data[i] = text[i % text_len];
+        }
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+    
     uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
     
     uint32_t current_block = node->startBlockIndex;
@@ -506,7 +569,7 @@ extern "C" int file_truncate(void* session, const char* path) {
         current_block = next_block;
     }
     
-    fflush(fs->omni_file);
+    flushMetadata(fs);
     
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
\ No newline at end of file
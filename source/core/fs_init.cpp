@@ -4,13 +4,24 @@
 #include "../include/helper_functions.h"
 #include "../include/config_parser.h"
 #include "../include/session_manager.h"
+#include "../include/index_snapshot.h"
+#include "../include/directory_index.h"
+#include "../include/transaction.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unistd.h>
 
 using namespace std;
 
+// FileEntry slots read per fread while loading the table
+#define ENTRY_TABLE_CHUNK 4096
+
 inline bool fileExists(const char* path) {
     return filesystem::exists(path);
 }
@@ -100,6 +111,332 @@ int createNewFileSystem(const char* omni_path, const FileSystemConfig& config) {
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
+// reads the free space snapshot with one read for the header and one for the
+// payload. A snapshot for another block count is stale and isn't read; nor is
+// a legacy one claiming more segments than there are blocks.
+FreeSpaceManager* loadFreeSpaceSnapshot(FILE* file, uint64_t offset, uint32_t total_blocks, uint32_t group_blocks) {
+    fseek(file, offset, SEEK_SET);
+    
+    vector<uint8_t> data(sizeof(FreeSpaceSnapshotHeader));
+    size_t got = fread(data.data(), 1, data.size(), file);
+    
+    FreeSpaceSnapshotHeader header;
+    if (FreeSpaceManager::readSnapshotHeader(data.data(), got, header)) {
+        if (header.totalBlocks != total_blocks) {
+            return nullptr;
+        }
+        data.resize(sizeof(header) + header.payloadSize);
+        if (header.payloadSize > 0 &&
+            fread(data.data() + sizeof(header), 1, header.payloadSize, file) != header.payloadSize) {
+            return nullptr;
+        }
+        return FreeSpaceManager::deserialize(data, group_blocks);
+    }
+    
+    // legacy layout: 12 byte big-endian header, 8 bytes per segment
+    if (got < 12) {
+        return nullptr;
+    }
+    
+    uint32_t seg_count = ((uint32_t)data[8] << 24) |
+                         ((uint32_t)data[9] << 16) |
+                         ((uint32_t)data[10] << 8) |
+                         (uint32_t)data[11];
+    if (seg_count > total_blocks) {
+        return nullptr;
+    }
+    
+    size_t needed = 12 + (size_t)seg_count * 8;
+    if (needed > got) {
+        data.resize(needed);
+        if (fread(data.data() + got, 1, needed - got, file) != needed - got) {
+            return nullptr;
+        }
+    } else {
+        data.resize(needed);
+    }
+    
+    return FreeSpaceManager::deserialize(data, group_blocks);
+}
+
+// rebuilds the free map by walking every block chain the entry table
+// points at: files, files still queued for the reclaimer and, when they
+// can be trusted, directory child lists. Works on a partly loaded tree.
+FreeSpaceManager* rebuildFreeSpace(OFSInstance* fs, uint32_t total_blocks, bool with_child_indexes) {
+    vector<bool> used(total_blocks, false);
+    if (total_blocks > 0) {
+        used[0] = true;
+    }
+    
+    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
+    
+    // the journal region isn't a chain; the header extension records it
+    const OMNIHeaderExt& ext = fs->header_ext;
+    if (ext.isValid()) {
+        for (uint32_t i = 0; i < ext.journal_blocks && ext.journal_block + i < total_blocks; i++) {
+            used[ext.journal_block + i] = true;
+        }
+    }
+    
+    vector<uint32_t> chain_heads;
+    vector<FileEntry> chunk(ENTRY_TABLE_CHUNK);
+    
+    fseek(fs->omni_file, getFileEntryOffset(fs, 0), SEEK_SET);
+    for (uint32_t first = 0; first < fs->config.max_files; first += ENTRY_TABLE_CHUNK) {
+        uint32_t wanted = min((uint32_t)ENTRY_TABLE_CHUNK, fs->config.max_files - first);
+        size_t got = fread(chunk.data(), sizeof(FileEntry), wanted, fs->omni_file);
+        
+        for (size_t j = 0; j < got; j++) {
+            const FileEntry& entry = chunk[j];
+            if (first + j < 1 || entry.inode == 0) continue;
+            
+            bool live_file = entry.isValid() && entry.getType() == EntryType::FILE;
+            bool indexed_dir = with_child_indexes && entry.isValid() && hasChildIndex(entry);
+            if (live_file || indexed_dir || isPendingReclaim(entry)) {
+                chain_heads.push_back(entry.inode);
+            }
+        }
+        
+        if (got < wanted) break;
+    }
+    
+    for (size_t i = 0; i < chain_heads.size(); i++) {
+        uint32_t current_block = chain_heads[i];
+        while (current_block != 0 && current_block < total_blocks && !used[current_block]) {
+            used[current_block] = true;
+            
+            fseek(fs->omni_file, content_offset + ((uint64_t)current_block * fs->header.block_size), SEEK_SET);
+            uint32_t next_block;
+            if (fread(&next_block, sizeof(uint32_t), 1, fs->omni_file) != 1) {
+                break;
+            }
+            current_block = next_block;
+        }
+    }
+    
+    return FreeSpaceManager::fromUsageMap(used, fs->config.allocation_group_blocks);
+}
+
+// gives the journal the region the config asks for, reusing the one on
+// disk when its size still matches, and starts journaling into it. The
+// region is empty here: fs_init has replayed it and a clean shutdown
+// checkpoints it.
+void setupJournal(OFSInstance* fs, uint32_t journal_blocks) {
+    OMNIHeaderExt& ext = fs->header_ext;
+    
+    if (ext.journal_block != 0 && ext.journal_blocks != journal_blocks) {
+        vector<uint32_t> region;
+        for (uint32_t i = 0; i < ext.journal_blocks; i++) {
+            region.push_back(ext.journal_block + i);
+        }
+        fs->free_manager->freeBlockSegments(region);
+        ext.journal_block = 0;
+        ext.journal_blocks = 0;
+    }
+    
+    if (ext.journal_block == 0 && journal_blocks > 0) {
+        vector<uint32_t> region = fs->free_manager->allocateBlocks(journal_blocks);
+        if (region.empty()) {
+            cout << "   No room for a " << journal_blocks << " block journal, writing metadata in place" << endl;
+            return;
+        }
+        ext.journal_block = region[0];
+        ext.journal_blocks = journal_blocks;
+    }
+    
+    if (ext.journal_block != 0) {
+        fs->journal.attach(ext.journal_block, ext.journal_blocks,
+                           (uint64_t)ext.journal_blocks * fs->header.block_size, ext.journal_sequence);
+    }
+}
+
+// reads the user table (one read for the whole table) into the AVL index
+void loadUserTable(OFSInstance* fs) {
+    vector<UserInfo> table(fs->header.max_users);
+    fseek(fs->omni_file, fs->header.user_table_offset, SEEK_SET);
+    size_t got = fread(table.data(), sizeof(UserInfo), table.size(), fs->omni_file);
+    
+    for (size_t i = 0; i < got; i++) {
+        const UserInfo& user = table[i];
+        if (user.is_active && user.username[0] != '\0') {
+            fs->users.insert(user.username, user);
+            cout << "   User: " << user.username;
+            cout << " (";
+            if (user.role == UserRole::ADMIN){
+                cout << "Admin";
+            }
+            else{
+                cout << "Normal";
+            }
+            cout << ")" << endl;
+        }
+    }
+}
+
+// decodes one chunk of the entry table: a detached node and parent index
+// per live entry, plus the files still waiting for block reclamation.
+// Chunks touch disjoint slots of nodes/parents, so they can run in parallel;
+// owners are interned once per chunk, as the owner table has one lock.
+void decodeEntryChunk(const FileEntry* chunk, size_t count, uint32_t first, uint32_t usable_block_size,
+                      vector<TreeNode*>& nodes, vector<uint32_t>& parents, vector<PendingReclaim>& pending) {
+    unordered_map<string_view, uint16_t> owners;
+    
+    for (size_t j = 0; j < count; j++) {
+        uint32_t i = first + j;
+        const FileEntry& entry = chunk[j];
+        
+        if (i < 2) {
+            continue;
+        }
+        
+        if (entry.isValid() && entry.name[0] != '\0') {
+            string_view owner(entry.owner, strnlen(entry.owner, sizeof(entry.owner)));
+            unordered_map<string_view, uint16_t>::iterator known = owners.find(owner);
+            if (known == owners.end()) {
+                known = owners.insert(make_pair(owner, OwnerNames::intern(owner))).first;
+            }
+            nodes[i] = createNodeFromEntry(entry, i, known->second);
+            // parent 0 has always been read as the root
+            parents[i] = entry.parent_index == 0 ? 1 : entry.parent_index;
+        } else if (isPendingReclaim(entry)) {
+            // deleted before the last shutdown finished freeing it
+            pending.push_back(PendingReclaim(i, entry.inode,
+                                             calculateBlocksNeeded(entry.size, usable_block_size)));
+        }
+    }
+}
+
+// reads the FileEntry table in large chunks and builds the tree without
+// path lookups: one node per live entry, then each node is linked to its
+// parent by index. init_threads workers are started once and each takes
+// the next chunk from a shared counter, reads it (positioned reads, so they
+// never share a file offset) and decodes it. Also fills the slot map and
+// re-queues files whose blocks weren't reclaimed before the last shutdown.
+void loadEntryTable(OFSInstance* fs) {
+    const uint32_t max_entries = fs->config.max_files;
+    const uint32_t chunk_count = (max_entries + ENTRY_TABLE_CHUNK - 1) / ENTRY_TABLE_CHUNK;
+    
+    uint32_t thread_count = fs->config.init_threads;
+    if (thread_count == 0) {
+        thread_count = max(1u, thread::hardware_concurrency());
+    }
+    // no point in threads that would never get a chunk
+    thread_count = min(thread_count, max(1u, chunk_count));
+    
+    vector<TreeNode*> nodes(max_entries, nullptr);
+    vector<uint32_t> parents(max_entries, 0);
+    fs->entry_slots.reset(max_entries);
+    
+    vector<vector<PendingReclaim> > pending(thread_count);
+    uint32_t usable_block_size = getUsableBlockSize(fs);
+    
+    fflush(fs->omni_file);
+    int fd = fileno(fs->omni_file);
+    uint64_t table_offset = getFileEntryOffset(fs, 0);
+    atomic<uint32_t> next_chunk(0);
+    
+    auto decodeChunks = [&](vector<PendingReclaim>& found) {
+        // nodes and names come from this worker's own batches, not one
+        // pool lock per entry shared with the other workers
+        SlabCacheScope slabs;
+        vector<FileEntry> chunk(ENTRY_TABLE_CHUNK);
+        for (uint32_t c = next_chunk++; c < chunk_count; c = next_chunk++) {
+            uint32_t first = c * ENTRY_TABLE_CHUNK;
+            uint32_t wanted = min((uint32_t)ENTRY_TABLE_CHUNK, max_entries - first);
+            ssize_t got = pread(fd, chunk.data(), (size_t)wanted * sizeof(FileEntry),
+                                table_offset + (uint64_t)first * sizeof(FileEntry));
+            if (got <= 0) continue;
+            
+            decodeEntryChunk(chunk.data(), got / sizeof(FileEntry), first, usable_block_size,
+                             nodes, parents, found);
+        }
+    };
+    
+    vector<thread> workers;
+    for (uint32_t t = 1; t < thread_count; t++) {
+        workers.push_back(thread(decodeChunks, ref(pending[t])));
+    }
+    decodeChunks(pending[0]);
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    
+    // workers took chunks in no fixed order; queue in table order
+    vector<PendingReclaim> reclaim;
+    for (uint32_t t = 0; t < thread_count; t++) {
+        reclaim.insert(reclaim.end(), pending[t].begin(), pending[t].end());
+    }
+    sort(reclaim.begin(), reclaim.end(),
+         [](const PendingReclaim& a, const PendingReclaim& b) { return a.entryIndex < b.entryIndex; });
+    for (size_t k = 0; k < reclaim.size(); k++) {
+        fs->reclaim_queue.push(reclaim[k].entryIndex, reclaim[k].nextBlock, reclaim[k].pendingBlocks);
+        fs->entry_slots.markUsed(reclaim[k].entryIndex);
+    }
+    
+    for (uint32_t i = 2; i < max_entries; i++) {
+        if (nodes[i]) {
+            fs->entry_slots.markUsed(i);
+        }
+    }
+    
+    fs->entry_slots.finishBuild();
+    
+    TreeNode* root = fs->file_tree->getRoot();
+    if (max_entries > 1) {
+        nodes[1] = root;
+    }
+    
+    for (uint32_t i = 2; i < max_entries; i++) {
+        if (!nodes[i]) continue;
+        
+        uint32_t parent_idx = parents[i];
+        if (parent_idx >= max_entries || parent_idx == i || !nodes[parent_idx] || nodes[parent_idx]->isFile) {
+            continue;
+        }
+        
+        // names are cut to max_filename_length on disk, so two entries can
+        // share one; the first keeps it and the later one is dropped with
+        // the unreachable entries below, as createNode used to refuse it
+        if (!nodes[parent_idx]->findChild(nodes[i]->name)) {
+            nodes[parent_idx]->addChild(nodes[i]);
+        }
+    }
+    
+    // count what hangs off the root; whatever doesn't (a missing parent
+    // or a parent cycle) is dropped, as the old path based loader did
+    vector<bool> reachable(max_entries, false);
+    vector<TreeNode*> stack;
+    stack.push_back(root);
+    
+    while (!stack.empty()) {
+        TreeNode* node = stack.back();
+        stack.pop_back();
+        
+        if (node != root) {
+            reachable[node->entryIndex] = true;
+            if (node->isFile) {
+                fs->total_files++;
+            } else {
+                fs->total_directories++;
+            }
+        }
+        
+        for (size_t i = 0; i < node->children.size(); i++) {
+            stack.push_back(node->children[i]);
+        }
+    }
+    
+    for (uint32_t i = 2; i < max_entries; i++) {
+        if (nodes[i] && !reachable[i]) {
+            // unreachable children are deleted by this same loop
+            nodes[i]->children.clear();
+            delete nodes[i];
+        }
+    }
+    
+    fs->file_tree->recountNodes();
+}
+
 extern "C" int fs_init(void** instance, const char* omni_path, const char* config_path) {
     cout << "OMNI file: " << omni_path << endl;
     cout << "Config file: " << config_path << endl;
@@ -139,157 +476,117 @@ extern "C" int fs_init(void** instance, const char* omni_path, const char* confi
         return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
     }
     
-    // loading users
-    fseek(fs->omni_file, fs->header.user_table_offset, SEEK_SET);
-    
-    int user_count = 0;
-    for (uint32_t i = 0; i < fs->header.max_users; i++) {
-        UserInfo user;
-        if (fread(&user, sizeof(UserInfo), 1, fs->omni_file) == 1) {
-            if (user.is_active && user.username[0] != '\0') {
-                fs->users.insert(user.username, user);
-                user_count++;
-                cout << "   User: " << user.username;
-                cout << " (";
-                if (user.role == UserRole::ADMIN){
-                    cout << "Admin";
-                }
-                else{
-                    cout << "Normal";
-                }
-                cout << ")" << endl;
-            }
-        }
-    }
-    
-    // Initialize file tree
     fs->file_tree = new FileTree();
     fs->total_directories = 1;
     fs->total_files = 0;
     
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo));
-    
-    const uint32_t MAX_ENTRIES = config.max_files;
-    
-    // Load entries
-    FileEntry* entries = new FileEntry[MAX_ENTRIES];
-    bool* entry_valid = new bool[MAX_ENTRIES];
-    bool* entry_processed = new bool[MAX_ENTRIES];
-    
-    for (uint32_t i = 0; i < MAX_ENTRIES; i++) {
-        entry_valid[i] = false;
-        entry_processed[i] = false;
+    // a snapshot from the last clean shutdown replaces reading both tables;
+    // with lazy loading it may hold only part of the tree, the rest is read
+    // through the directory child lists when first touched
+    fs->header_ext = readHeaderExt(fs->header);
+    
+    // entry images journaled but not yet checkpointed go home first; the
+    // journal only holds records after an unclean shutdown
+    if (fs->header_ext.isValid()) {
+        uint32_t replayed = replayJournal(fs);
+        if (replayed > 0) {
+            cout << "   Replayed " << replayed << " metadata journal records" << endl;
+            fs->header_ext.clean_generation = 0;
+        }
     }
     
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    int valid_count = 0;
-    for (uint32_t i = 0; i < MAX_ENTRIES; i++) {
-        if (fread(&entries[i], sizeof(FileEntry), 1, fs->omni_file) == 1) {
-            if (entries[i].isValid() && entries[i].name[0] != '\0') {
-                entry_valid[i] = true;
-                valid_count++;
-            }
+    // a commit cut short after its commit point is finished here; the mount
+    // then takes the crash route, which rebuilds everything else from the table
+    if (fs->header_ext.isValid() && fs->header_ext.txn_record_block != 0) {
+        if (replayTxnRecord(fs)) {
+            cout << "   Replayed an interrupted transaction commit" << endl;
         }
+        fs->header_ext.clean_generation = 0;
     }
-        
-    entry_processed[0] = true;
-    entry_processed[1] = true;
     
-    bool progress = true;
-    int pass = 0;
-    int total_processed = 2;
+    bool clean = fs->header_ext.isClean();
+    bool indexes_ready = clean && (fs->header_ext.flags & OMNI_EXT_CHILD_INDEX_READY);
+    bool from_snapshot = loadIndexSnapshot(fs, config.lazy_load && indexes_ready);
     
-    while (progress && total_processed < valid_count + 2) {
-        progress = false;
-        pass++;
-        
-        for (uint32_t entry_idx = 2; entry_idx < MAX_ENTRIES; entry_idx++) {
-            if (!entry_valid[entry_idx] || entry_processed[entry_idx]) {
-                continue;
-            }
-            
-            const FileEntry& entry = entries[entry_idx];
-            
-            if (entry.parent_index == 1 || entry_processed[entry.parent_index]) {
-                string path = reconstructPath(fs, entry_idx);
-                
-                if (path.empty()) {
-                    continue;
-                }
-                
-                bool is_file = (entry.getType() == EntryType::FILE);
-                TreeNode* node = fs->file_tree->createNode(path, is_file, string(entry.owner));
-                
-                if (node) {
-                    node->entryIndex = entry_idx;
-                    node->size = entry.size;
-                    node->permissions = entry.permissions;
-                    node->created_time = entry.created_time;
-                    node->modified_time = entry.modified_time;
-                    
-                    if (is_file) {
-                        node->startBlockIndex = entry.inode;
-                        fs->total_files++;
-                    } else {
-                        node->startBlockIndex = 0;
-                        fs->total_directories++;
-                    }
-                    
-                    entry_processed[entry_idx] = true;
-                    total_processed++;
-                    progress = true;
-                }
-            }
-        }
+    if (from_snapshot) {
+        cout << "   Loaded index snapshot: " << fs->users.size() << " users, "
+             << (fs->total_files + fs->total_directories) << " entries, "
+             << fs->file_tree->getNodeCount() << " in memory" << endl;
+    } else {
+        loadUserTable(fs);
+        loadEntryTable(fs);
+        // the whole tree is in memory here, so the owner and time indexes
+        // come straight from it; a snapshot carries its own
+        fs->file_tree->rebuildAttributeIndex();
     }
     
-    delete[] entries;
-    delete[] entry_valid;
-    delete[] entry_processed;
-        
     uint64_t content_offset = calculateContentOffset(fs->header, config.max_files);
     uint32_t total_blocks = calculateTotalBlocks(fs->header.total_size, content_offset, fs->header.block_size);
     uint64_t free_space_offset = content_offset + (total_blocks * fs->header.block_size);
     
-    fseek(fs->omni_file, free_space_offset, SEEK_SET);
+    // after an unclean shutdown the free space snapshot is stale as well, and
+    // it may count child list chains that are about to be rewritten; images
+    // from before the header extension only ever wrote that one snapshot
+    if (indexes_ready || !fs->header_ext.isValid()) {
+        fs->free_manager = loadFreeSpaceSnapshot(fs->omni_file, free_space_offset, total_blocks,
+                                                 config.allocation_group_blocks);
+    }
     
-    uint8_t free_space_header[12];
-    if (fread(free_space_header, 1, 12, fs->omni_file) == 12) {
-        uint32_t seg_count = ((uint32_t)free_space_header[8] << 24) |
-                            ((uint32_t)free_space_header[9] << 16) |
-                            ((uint32_t)free_space_header[10] << 8) |
-                            (uint32_t)free_space_header[11];
-        
-        size_t data_size = 12 + (seg_count * 8);
-        vector<uint8_t> free_space_data(data_size);
-        
-        for (int i = 0; i < 12; i++) {
-            free_space_data[i] = free_space_header[i];
-        }
-        
-        if (seg_count > 0) {
-            size_t remaining = seg_count * 8;
-            for (size_t i = 0; i < remaining; i++) {
-                uint8_t byte;
-                if (fread(&byte, 1, 1, fs->omni_file) == 1) {
-                    free_space_data[12 + i] = byte;
-                }
-            }
-        }
-        
-        fs->free_manager = FreeSpaceManager::deserialize(free_space_data);
-        
-        if (!fs->free_manager) {
-            fs->free_manager = new FreeSpaceManager(total_blocks);
+    if (!fs->free_manager || fs->free_manager->getTotalBlocks() != total_blocks) {
+        // missing, corrupt or stale snapshot, recover the map from the block chains
+        delete fs->free_manager;
+        fs->free_manager = rebuildFreeSpace(fs, total_blocks, indexes_ready);
+    }
+    
+    if (!fs->header_ext.isValid()) {
+        fs->header_ext = OMNIHeaderExt();
+        fs->header_ext.magic = OMNI_HEADER_EXT_MAGIC;
+        fs->header_ext.version = OMNI_HEADER_EXT_VERSION;
+    }
+    
+    // child lists can't be trusted after a crash (or don't exist yet on an
+    // older image); the whole tree is in memory here, so write them afresh
+    if (!indexes_ready) {
+        fs->header_ext.flags &= ~OMNI_EXT_CHILD_INDEX_READY;
+        if (buildChildLists(fs)) {
+            fs->header_ext.flags |= OMNI_EXT_CHILD_INDEX_READY;
         }
-    } else {
-        fs->free_manager = new FreeSpaceManager(total_blocks);
     }
     
-
+    fs->file_tree->setChildLoader([fs](TreeNode* dir) { loadDirectoryChildren(fs, dir); });
+    fs->file_tree->setChildLister([fs](uint32_t dir, vector<DiskChild>& children) {
+        listDirectoryChildren(fs, dir, children);
+    });
+    fs->file_tree->getPathCache().setCapacity(config.path_cache_entries);
+    fs->file_tree->setUsableBlockSize(getUsableBlockSize(fs));
+    
+    // a fully loaded tree gets its directory rollups in one pass now; a
+    // lazy one works them out per directory when first asked
+    if (!config.lazy_load) {
+        fs->file_tree->getUsage(fs->file_tree->getRoot());
+    }
+    
+    // from here on entry writes go through the journal; the header below
+    // records its region before the first record is written
+    setupJournal(fs, config.journal_blocks);
+    
+    // mounted: the snapshots on disk are stale until the next clean shutdown
+    fs->header_ext.generation++;
+    writeHeader(fs);
+    
     SessionManager::setInstance(fs);
     
+    fs->maintenance.start(MAINTENANCE_INTERVAL_MS, [fs]() { runMaintenanceTasks(fs); });
+    
+    // any session may pick the periodic mode, so the thread runs whatever
+    // the config says; it only syncs when a call is waiting for one
+    if (config.durability_interval_ms > 0) {
+        int fd = fileno(fs->omni_file);
+        fs->periodic_sync.start(config.durability_interval_ms, [fs, fd]() {
+            fs->group_commit.syncPending([fd]() { fdatasync(fd); });
+        });
+    }
+    
     *instance = fs;
     
     return static_cast<int>(OFSErrorCodes::SUCCESS);
@@ -300,7 +597,22 @@ extern "C" int fs_shutdown(void* instance) {
     if (instance) {
         OFSInstance* fs = (OFSInstance*)instance;
         
+        fs->maintenance.stop();
+        fs->periodic_sync.stop();
+        
+        // blocks staged by transactions never committed go back first
+        while (!fs->open_transactions.empty()) {
+            discardTransaction(fs, *fs->open_transactions.begin());
+        }
+        
         if (fs->free_manager && fs->omni_file) {
+            flushDelayedWrites(fs, time(nullptr));
+            drainReclaimQueue(fs);
+            
+            // the table is complete on disk before the snapshots are taken
+            commitMetadata(fs);
+            checkpointJournal(fs);
+            
             uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
             uint32_t total_blocks = calculateTotalBlocks(fs->header.total_size, content_offset, 
                                                         fs->header.block_size);
@@ -309,8 +621,20 @@ extern "C" int fs_shutdown(void* instance) {
             vector<uint8_t> free_space_data = fs->free_manager->serialize();
             fseek(fs->omni_file, free_space_offset, SEEK_SET);
             fwrite(free_space_data.data(), 1, free_space_data.size(), fs->omni_file);
+            
+            // index snapshot right after the free map; the header is written
+            // last, so a crash in between leaves the old generation in place
+            uint64_t generation = fs->header_ext.generation + 1;
+            vector<uint8_t> index_data = serializeIndexSnapshot(fs, generation);
+            uint64_t index_offset = free_space_offset + free_space_data.size();
+            fwrite(index_data.data(), 1, index_data.size(), fs->omni_file);
             fflush(fs->omni_file);
             
+            fs->header_ext.generation = generation;
+            fs->header_ext.clean_generation = generation;
+            fs->header_ext.index_snapshot_offset = index_offset;
+            fs->header_ext.index_snapshot_size = index_data.size();
+            writeHeader(fs);
         }
         
         // Clear sessions
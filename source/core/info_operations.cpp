@@ -1,73 +1,53 @@
 #include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
 #include "../include/ofs_instance.h"
 #include "../include/session_manager.h"
+#include "../include/helper_functions.h"
+#include "../include/durability.h"
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 
-// get metadata for the file
-extern "C" int get_metadata(void* session, const char* path, FileMetadata* meta) {
-    string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
-    
-    if (!ms || !ms->instance) {
-        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
-    }
-    
-    OFSInstance* fs = ms->instance;
-    
+// the body of get_metadata, for callers that hold the session and the
+// operation lock already (ofs_batch)
+int readMetadata(OFSInstance* fs, ManagedSession*, const char* path, FileMetadata* meta) {
     // finds the node
     TreeNode* node = fs->file_tree->findNode(path);
     if (!node) {
         return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
     }
     
-    strncpy(meta->path, path, sizeof(meta->path) - 1);
-    meta->path[sizeof(meta->path) - 1] = '\0';
+    fillMetadata(fs, node, path, meta);
     
-    // Fill entry info
-    strncpy(meta->entry.name, node->name.c_str(), sizeof(meta->entry.name) - 1);
-    meta->entry.name[sizeof(meta->entry.name) - 1] = '\0';
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// get metadata for the file
+extern "C" int get_metadata(void* session, const char* path, FileMetadata* meta) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
     
-    // set type to FILE/DIRECTORY
-    if (node->isFile) {
-        meta->entry.type = static_cast<uint8_t>(EntryType::FILE);
-    } 
-    else {
-        meta->entry.type = static_cast<uint8_t>(EntryType::DIRECTORY);
-    }
-    meta->entry.size = node->size;
-    meta->entry.permissions = node->permissions;
-    meta->entry.inode = node->entryIndex;
-    
-    strncpy(meta->entry.owner, node->owner.c_str(), sizeof(meta->entry.owner) - 1);
-    meta->entry.owner[sizeof(meta->entry.owner) - 1] = '\0';
-    
-    meta->entry.created_time = node->created_time;
-    meta->entry.modified_time = node->modified_time;
-    
-    // calculate blocks used
-    uint32_t usable_block_size = fs->header.block_size - 4;
-    if (node->isFile && node->size > 0) {
-        meta->blocks_used = (node->size + usable_block_size - 1) / usable_block_size;
-        meta->actual_size = meta->blocks_used * fs->header.block_size;
-    } else {
-        meta->blocks_used = 0;
-        meta->actual_size = 0;
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
-    return static_cast<int>(OFSErrorCodes::SUCCESS);
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    return readMetadata(fs, ms.get(), path, meta);
 }
 
 // set permissoins
 extern "C" int set_permissions(void* session, const char* path, uint32_t permissions) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
     
     // find node
     TreeNode* node = fs->file_tree->findNode(path);
@@ -76,7 +56,7 @@ extern "C" int set_permissions(void* session, const char* path, uint32_t permiss
     }
     
     // check for permissions
-    if (strcmp(node->owner.c_str(), ms->info.user.username) != 0 && 
+    if (strcmp(node->getOwner().c_str(), ms->info.user.username) != 0 && 
         ms->info.user.role != UserRole::ADMIN) {
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
     }
@@ -85,20 +65,14 @@ extern "C" int set_permissions(void* session, const char* path, uint32_t permiss
     node->permissions = permissions;
     
     // Update FileEntry on disk
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo)) +
-                                (node->entryIndex * sizeof(FileEntry));
-    
     FileEntry file_entry;
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fread(&file_entry, sizeof(FileEntry), 1, fs->omni_file);
+    readFileEntry(fs, node->entryIndex, file_entry);
     
     file_entry.permissions = permissions;
     file_entry.modified_time = time(nullptr);
     
-    fseek(fs->omni_file, file_entry_offset, SEEK_SET);
-    fwrite(&file_entry, sizeof(FileEntry), 1, fs->omni_file);
-    fflush(fs->omni_file);
+    writeFileEntry(fs, node->entryIndex, file_entry);
+    flushMetadata(fs);
     
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
@@ -106,20 +80,26 @@ extern "C" int set_permissions(void* session, const char* path, uint32_t permiss
 // gets the stats for session
 extern "C" int get_stats(void* session, FSStats* stats) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     
     // calculate stats
     stats->total_size = fs->header.total_size;
     
-    uint64_t used_blocks = fs->free_manager->getUsedBlocks();
+    // blocks reserved for buffered files count as used; blocks of deleted
+    // files the reclaimer hasn't freed yet are neither used nor free, they
+    // are reported as pending free by get_reclaim_stats
+    uint64_t reserved_blocks = fs->delayed_writes.getReservedBlocks();
+    uint64_t pending_blocks = min(fs->reclaim_queue.getPendingBlocks(), (uint64_t)fs->free_manager->getUsedBlocks());
+    uint64_t used_blocks = fs->free_manager->getUsedBlocks() - pending_blocks + reserved_blocks;
     stats->used_space = used_blocks * fs->header.block_size;
-    stats->free_space = fs->free_manager->getFreeBlocks() * fs->header.block_size;
+    stats->free_space = (fs->free_manager->getFreeBlocks() - reserved_blocks) * fs->header.block_size;
     
     stats->total_files = fs->total_files;
     stats->total_directories = fs->total_directories;
@@ -130,6 +110,59 @@ extern "C" int get_stats(void* session, FSStats* stats) {
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
+// hit rate of the path lookup cache since fs_init
+extern "C" int get_path_cache_stats(void* session, PathCacheStats* stats) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    DentryCache& cache = fs->file_tree->getPathCache();
+    stats->hits = cache.getHits();
+    stats->negative_hits = cache.getNegativeHits();
+    stats->misses = cache.getMisses();
+    stats->invalidations = cache.getInvalidations();
+    stats->entries = cache.getSize();
+    stats->capacity = cache.getCapacity();
+    
+    uint64_t lookups = stats->hits + stats->negative_hits + stats->misses;
+    stats->hit_rate = lookups > 0 ? (double)(stats->hits + stats->negative_hits) / lookups : 0.0;
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// recursive size and counts of a directory from its maintained rollup
+extern "C" int dir_usage(void* session, const char* path, DirUsage* usage) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    TreeNode* node = fs->file_tree->findNode(path);
+    if (!node || node->isFile) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    }
+    
+    DirectoryUsage rollup = fs->file_tree->getUsage(node);
+    usage->total_bytes = rollup.bytes;
+    usage->file_count = rollup.files;
+    usage->directory_count = rollup.directories;
+    usage->blocks_used = rollup.blocks;
+    usage->actual_size = rollup.blocks * fs->header.block_size;
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
 extern "C" void free_buffer(void* buffer) {
     if (buffer) {
         delete[] (char*)buffer;
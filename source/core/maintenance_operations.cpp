@@ -0,0 +1,351 @@
+#include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
+#include "../include/ofs_instance.h"
+#include "../include/session_manager.h"
+#include "../include/helper_functions.h"
+#include "../include/durability.h"
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+using namespace std;
+
+// blocks copied per fs_defragment call when the caller passes 0
+#define DEFAULT_DEFRAG_BLOCK_BUDGET 256
+
+// FileEntries read at a time while looking for fragmented files
+#define DEFRAG_SCAN_CHUNK 256
+
+struct DefragCandidate {
+    uint32_t entryIndex;
+    FileEntry entry;
+    vector<uint32_t> chain;
+    uint32_t contiguous;        // blocks at the front of the chain already in one run
+};
+
+// length of the run a block chain starts with
+static uint32_t countContiguousPrefix(const vector<uint32_t>& chain) {
+    if (chain.empty()) return 0;
+    
+    uint32_t length = 1;
+    while (length < chain.size() && chain[length] == chain[length - 1] + 1) {
+        length++;
+    }
+    return length;
+}
+
+// the file's node if every directory above it is loaded; never loads one
+static TreeNode* findLoadedNode(OFSInstance* fs, uint32_t entry_index, const FileEntry& entry) {
+    vector<uint32_t> path(1, entry_index);
+    uint32_t current = entry.parent_index;
+    while (current > 1) {
+        if (path.size() > 100) return nullptr;
+        path.push_back(current);
+        
+        FileEntry parent;
+        if (!readFileEntry(fs, current, parent) || !parent.isValid()) {
+            return nullptr;
+        }
+        current = parent.parent_index;
+    }
+    
+    TreeNode* node = fs->file_tree->getRoot();
+    for (size_t i = path.size(); i-- > 0; ) {
+        if (!node->childrenLoaded) return nullptr;
+        
+        TreeNode* next = nullptr;
+        for (size_t j = 0; j < node->children.size() && !next; j++) {
+            if (node->children[j]->entryIndex == path[i]) {
+                next = node->children[j];
+            }
+        }
+        if (!next) return nullptr;
+        node = next;
+    }
+    return node;
+}
+
+// copies the chain's blocks from first on, as many as run holds, into run,
+// then points the block before them (or the FileEntry) at the copy and only
+// then frees the old blocks. The chain stays whole at every step.
+static bool moveChainSection(OFSInstance* fs, DefragCandidate& candidate, uint32_t first,
+                             const vector<uint32_t>& run) {
+    vector<uint32_t>& chain = candidate.chain;
+    uint32_t count = run.size();
+    uint32_t after = first + count;
+    
+    uint64_t block_size = fs->header.block_size;
+    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
+    
+    vector<uint8_t> buffer(count * block_size, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* block = buffer.data() + (i * block_size);
+        
+        fseek(fs->omni_file, content_offset + ((uint64_t)chain[first + i] * block_size), SEEK_SET);
+        if (fread(block, 1, block_size, fs->omni_file) != block_size) {
+            fs->free_manager->freeBlockSegments(run);
+            return false;
+        }
+        
+        uint32_t next_block = (i < count - 1) ? run[i + 1] : (after < chain.size() ? chain[after] : 0);
+        memcpy(block, &next_block, sizeof(uint32_t));
+    }
+    
+    // the run is contiguous, so the section goes out in one write
+    fseek(fs->omni_file, content_offset + ((uint64_t)run[0] * block_size), SEEK_SET);
+    if (fwrite(buffer.data(), 1, buffer.size(), fs->omni_file) != buffer.size()) {
+        fs->free_manager->freeBlockSegments(run);
+        return false;
+    }
+    fflush(fs->omni_file);
+    
+    if (first == 0) {
+        FileEntry file_entry;
+        if (!readFileEntry(fs, candidate.entryIndex, file_entry) || file_entry.inode != chain[0]) {
+            fs->free_manager->freeBlockSegments(run);
+            return false;
+        }
+        
+        file_entry.inode = run[0];
+        writeFileEntry(fs, candidate.entryIndex, file_entry);
+        commitMetadata(fs);
+        
+        if (TreeNode* node = findLoadedNode(fs, candidate.entryIndex, file_entry)) {
+            node->startBlockIndex = run[0];
+        }
+    } else {
+        fseek(fs->omni_file, content_offset + ((uint64_t)chain[first - 1] * block_size), SEEK_SET);
+        if (fwrite(&run[0], sizeof(uint32_t), 1, fs->omni_file) != 1) {
+            fs->free_manager->freeBlockSegments(run);
+            return false;
+        }
+        fflush(fs->omni_file);
+    }
+    
+    vector<uint32_t> old_blocks(chain.begin() + first, chain.begin() + after);
+    fs->free_manager->freeBlockSegments(old_blocks);
+    copy(run.begin(), run.end(), chain.begin() + first);
+    candidate.contiguous = countContiguousPrefix(chain);
+    
+    fs->defrag_stats.blocks_moved += count;
+    fs->defrag_stats.bytes_moved += count * block_size;
+    
+    return true;
+}
+
+// moves at most budget blocks of a fragmented file and returns how many it
+// moved. The run the chain starts with grows in place while the blocks
+// after it are free; otherwise the file starts over where all of it fits.
+// A file larger than the budget is moved in parts over several passes.
+static uint32_t defragmentFile(OFSInstance* fs, DefragCandidate& candidate, uint32_t budget) {
+    uint32_t count = candidate.chain.size();
+    uint32_t first = candidate.contiguous;
+    
+    uint32_t moving = min(budget, count - first);
+    vector<uint32_t> run = fs->free_manager->allocateAt(candidate.chain[first - 1] + 1, moving);
+    if (!run.empty()) {
+        return moveChainSection(fs, candidate, first, run) ? moving : 0;
+    }
+    
+    // room for the whole file, so later parts can grow the run in place
+    uint32_t parent_idx = candidate.entry.parent_index;
+    run = fs->free_manager->allocateBlocks(count, getHomeGroup(fs, parent_idx));
+    if (run.empty()) {
+        return 0;
+    }
+    
+    moving = min(budget, count);
+    vector<uint32_t> spare(run.begin() + moving, run.end());
+    run.resize(moving);
+    fs->free_manager->freeBlockSegments(spare);
+    
+    return moveChainSection(fs, candidate, 0, run) ? moving : 0;
+}
+
+// walks the entry table from where the last pass stopped, moving the blocks
+// of fragmented files until max_blocks blocks have been copied, so a pass
+// costs about its budget however large the tree is
+extern "C" int fs_defragment(void* admin_session, uint32_t max_blocks, DefragStats* stats) {
+    string* session_str = (string*)admin_session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    if (ms->info.user.role != UserRole::ADMIN) {
+        return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    
+    if (max_blocks == 0) {
+        max_blocks = DEFAULT_DEFRAG_BLOCK_BUDGET;
+    }
+    
+    uint32_t max_files = fs->config.max_files;
+    uint32_t index = fs->defrag_cursor;
+    if (index < 2 || index >= max_files) {
+        index = 2;
+    }
+    
+    fs->defrag_stats.passes++;
+    fs->defrag_stats.files_examined = 0;
+    fs->defrag_stats.fragmented_files = 0;
+    
+    uint32_t budget = max_blocks;
+    uint32_t scanned = 0;
+    vector<FileEntry> chunk(DEFRAG_SCAN_CHUNK);
+    
+    while (budget > 0 && scanned + 2 < max_files) {
+        uint32_t wanted = min((uint32_t)DEFRAG_SCAN_CHUNK, max_files - index);
+        fseek(fs->omni_file, getFileEntryOffset(fs, index), SEEK_SET);
+        size_t got = fread(chunk.data(), sizeof(FileEntry), wanted, fs->omni_file);
+        if (got < wanted) {
+            break;
+        }
+        
+        uint32_t j = 0;
+        for (; j < wanted && budget > 0; j++) {
+            DefragCandidate candidate;
+            candidate.entryIndex = index + j;
+            const FileEntry* image = fs->journal.find(candidate.entryIndex);
+            candidate.entry = image ? *image : chunk[j];
+            
+            const FileEntry& entry = candidate.entry;
+            if (!entry.isValid() || entry.getType() != EntryType::FILE || entry.inode == 0 ||
+                fs->delayed_writes.find(candidate.entryIndex)) {
+                continue;
+            }
+            
+            fs->defrag_stats.files_examined++;
+            candidate.chain = getBlockChain(fs, entry.inode);
+            candidate.contiguous = countContiguousPrefix(candidate.chain);
+            if (candidate.contiguous == candidate.chain.size()) {
+                continue;
+            }
+            
+            fs->defrag_stats.fragmented_files++;
+            budget -= defragmentFile(fs, candidate, budget);
+            if (candidate.contiguous == candidate.chain.size()) {
+                fs->defrag_stats.fragmented_files--;
+                fs->defrag_stats.files_moved++;
+            } else if (budget == 0) {
+                // the rest of this file goes first next time
+                break;
+            }
+        }
+        
+        scanned += j;
+        index += j;
+        if (index >= max_files) {
+            index = 2;
+        }
+    }
+    
+    fs->defrag_cursor = index;
+    fs->defrag_stats.last_pass_time = time(nullptr);
+    
+    if (stats) {
+        *stats = fs->defrag_stats;
+    }
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// defragmentation counters since fs_init
+extern "C" int get_defrag_stats(void* session, DefragStats* stats) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    *stats = ms->instance->defrag_stats;
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// writes every buffered file to disk, allocating its blocks now, finishes
+// freeing the blocks of deleted files, and syncs whatever the durability mode
+extern "C" int fs_sync(void* session) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
+    operation.setMode(DURABILITY_STRICT);
+    
+    int result = flushDelayedWrites(fs, time(nullptr));
+    drainReclaimQueue(fs);
+    commitMetadata(fs);
+    
+    return result;
+}
+
+// deleted space the reclaimer hasn't given back yet
+extern "C" int get_reclaim_stats(void* session, ReclaimStats* stats) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    stats->pending_files = fs->reclaim_queue.size();
+    stats->pending_blocks = fs->reclaim_queue.getPendingBlocks();
+    stats->pending_free = stats->pending_blocks * fs->header.block_size;
+    stats->reclaimed_files = fs->reclaim_queue.getReclaimedFiles();
+    stats->reclaimed_blocks = fs->reclaim_queue.getReclaimedBlocks();
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// sets the durability mode of the session's mutating calls;
+// DURABILITY_DEFAULT goes back to the one in the config
+extern "C" int set_durability(void* session, uint32_t mode) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    if (mode > DURABILITY_STRICT && mode != DURABILITY_DEFAULT) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+    
+    ms->durability = mode;
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// syncs issued so far and how long they, and the calls waiting on them, took
+extern "C" int get_durability_stats(void* session, DurabilityStats* stats) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+    
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    
+    OFSInstance* fs = ms->instance;
+    
+    *stats = DurabilityStats();
+    stats->mode = getDurability(fs, ms.get());
+    stats->interval_ms = fs->config.durability_interval_ms;
+    fs->group_commit.getStats(*stats);
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
@@ -0,0 +1,597 @@
+#include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
+#include "../include/ofs_instance.h"
+#include "../include/session_manager.h"
+#include "../include/helper_functions.h"
+#include "../include/directory_index.h"
+#include "../include/index_snapshot.h"
+#include "../include/transaction.h"
+#include "../include/durability.h"
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <set>
+#include <unistd.h>
+
+using namespace std;
+
+// one entry a commit writes: the path, what the transaction did to it and
+// the FileEntry image it ends up with
+struct TxnStep {
+    string path;
+    TxnPath* entry;
+    FileEntry image;
+};
+
+static string parentOf(const string& path) {
+    size_t last_slash = path.find_last_of('/');
+    return last_slash == 0 ? string("/") : path.substr(0, last_slash);
+}
+
+static size_t pathDepth(const string& path) {
+    return count(path.begin(), path.end(), '/');
+}
+
+static bool isOwnerOrAdmin(ManagedSession* ms, TreeNode* node) {
+    return strcmp(node->getOwner().c_str(), ms->info.user.username) == 0 ||
+           ms->info.user.role == UserRole::ADMIN;
+}
+
+// the path as the transaction sees it; the first time, the tree's state is
+// recorded as its base. A buffered file is flushed first so its base is
+// what is on disk.
+static TxnPath& touchPath(Transaction* txn, const string& path) {
+    map<string, TxnPath>::iterator it = txn->paths.find(path);
+    if (it != txn->paths.end()) return it->second;
+
+    OFSInstance* fs = txn->fs;
+    TxnPath& entry = txn->paths[path];
+    TreeNode* node = fs->file_tree->findNode(path);
+    if (node) {
+        if (node->isFile) flushDelayedFile(fs, node->entryIndex);
+        entry.baseState = node->isFile ? TXN_PATH_FILE : TXN_PATH_DIRECTORY;
+        entry.baseEntry = node->entryIndex;
+        if (node->isFile) {
+            entry.baseBlock = node->startBlockIndex;
+            entry.baseSize = node->size;
+        }
+    }
+    entry.state = entry.baseState;
+    return entry;
+}
+
+static void releaseStaged(OFSInstance* fs, TxnPath& entry) {
+    fs->free_manager->freeBlockSegments(entry.blocks);
+    entry.blocks.clear();
+    entry.rewritten = false;
+    entry.size = 0;
+}
+
+// writes the path's new content into a chain of its own, replacing what
+// the transaction had staged for it before
+static int stageContent(Transaction* txn, const string& path, TxnPath& entry, const char* data, size_t size) {
+    OFSInstance* fs = txn->fs;
+    uint32_t blocks_needed = calculateBlocksNeeded(size, getUsableBlockSize(fs));
+    if (fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + blocks_needed) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+
+    uint32_t parent_idx = getParentIndexFromPath(fs, path);
+    vector<uint32_t> blocks = allocateFileBlocks(fs->free_manager, blocks_needed,
+                                                 getHomeGroup(fs, parent_idx ? parent_idx : 1));
+    if (blocks.empty()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    writeBlockChain(fs, blocks, data, size);
+
+    releaseStaged(fs, entry);
+    entry.blocks = blocks;
+    entry.size = size;
+    entry.rewritten = true;
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// content of a file as the transaction sees it; reading it from the tree
+// makes it part of what commit checks
+static bool stagedContent(Transaction* txn, const string& path, TxnPath& entry, vector<char>& data) {
+    OFSInstance* fs = txn->fs;
+    if (entry.rewritten) {
+        return readChainData(fs, entry.blocks[0], entry.size, data);
+    }
+
+    TreeNode* node = fs->file_tree->findNode(path);
+    if (!node) return false;
+
+    DirtyFile* dirty = fs->delayed_writes.find(node->entryIndex);
+    if (dirty) {
+        data.assign(dirty->data.begin(), dirty->data.end());
+        return true;
+    }
+    if (node->size == 0) {
+        data.clear();
+    } else if (!readChainData(fs, node->startBlockIndex, node->size, data)) {
+        return false;
+    }
+
+    entry.baseRead = true;
+    entry.baseChecksum = crc32(data.data(), data.size());
+    return true;
+}
+
+// the file still holds the content an edit in the transaction read
+static bool baseContentUnchanged(OFSInstance* fs, TreeNode* node, const TxnPath& entry) {
+    if (!entry.baseRead) return true;
+
+    vector<char> data;
+    if (node->size > 0 && !readChainData(fs, node->startBlockIndex, node->size, data)) {
+        return false;
+    }
+    return crc32(data.data(), data.size()) == entry.baseChecksum;
+}
+
+// nothing is left below the directory once the transaction is applied
+static bool leavesDirectoryEmpty(Transaction* txn, const string& path) {
+    string prefix = path + "/";
+    map<string, TxnPath>::iterator it = txn->paths.lower_bound(prefix);
+    for (; it != txn->paths.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        if (it->second.state != TXN_PATH_ABSENT) return false;
+    }
+
+    TreeNode* node = txn->fs->file_tree->findNode(path);
+    if (!node) return true;
+
+    txn->fs->file_tree->loadChildren(node);
+    for (size_t i = 0; i < node->children.size(); i++) {
+        it = txn->paths.find(prefix + string(node->children[i]->name.view()));
+        if (it == txn->paths.end() || it->second.state != TXN_PATH_ABSENT) return false;
+    }
+    return true;
+}
+
+// checks the transaction against the tree, writes its commit record and
+// then every entry in place. Nothing is written before the record; once
+// the header points at it, nothing can fail.
+static int commitTransaction(OFSInstance* fs, ManagedSession* ms, Transaction* txn) {
+    // everything the transaction looked at is still as it found it
+    for (map<string, TxnPath>::iterator it = txn->paths.begin(); it != txn->paths.end(); ++it) {
+        const TxnPath& entry = it->second;
+        TreeNode* node = fs->file_tree->findNode(it->first);
+
+        uint8_t state = !node ? TXN_PATH_ABSENT : node->isFile ? TXN_PATH_FILE : TXN_PATH_DIRECTORY;
+        if (state != entry.baseState || (node && node->entryIndex != entry.baseEntry)) {
+            return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+        }
+        if (node && node->isFile && (node->startBlockIndex != entry.baseBlock || node->size != entry.baseSize ||
+                                     fs->delayed_writes.find(node->entryIndex) ||
+                                     !baseContentUnchanged(fs, node, entry))) {
+            return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+        }
+        if (node && !node->isFile && entry.state == TXN_PATH_ABSENT && !leavesDirectoryEmpty(txn, it->first)) {
+            return static_cast<int>(OFSErrorCodes::ERROR_DIRECTORY_NOT_EMPTY);
+        }
+    }
+
+    // parents before children
+    vector<pair<string, TxnPath*> > order;
+    for (map<string, TxnPath>::iterator it = txn->paths.begin(); it != txn->paths.end(); ++it) {
+        order.push_back(make_pair(it->first, &it->second));
+    }
+    stable_sort(order.begin(), order.end(),
+                [](const pair<string, TxnPath*>& a, const pair<string, TxnPath*>& b) {
+                    return pathDepth(a.first) < pathDepth(b.first);
+                });
+
+    vector<TxnStep> removals, rewrites, creations;
+    for (size_t i = 0; i < order.size(); i++) {
+        TxnPath* entry = order[i].second;
+        bool had = entry->baseState != TXN_PATH_ABSENT;
+        bool has = entry->state != TXN_PATH_ABSENT;
+        bool same_kind = entry->baseState == entry->state;
+
+        TxnStep step;
+        step.path = order[i].first;
+        step.entry = entry;
+        if (had && (!has || !same_kind)) removals.push_back(step);
+        if (has && (!had || !same_kind)) creations.push_back(step);
+        else if (has && entry->state == TXN_PATH_FILE && entry->rewritten) rewrites.push_back(step);
+    }
+
+    if (creations.size() > fs->entry_slots.getFreeCount()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+
+    // each directory gaining entries may need one more child list block
+    set<string> growing;
+    for (size_t i = 0; i < creations.size(); i++) {
+        growing.insert(parentOf(creations[i].path));
+    }
+    uint32_t usable_block_size = getUsableBlockSize(fs);
+    uint32_t record_blocks_needed = calculateBlocksNeeded(
+        sizeof(TxnRecordHeader) + (removals.size() + rewrites.size() + creations.size()) * sizeof(TxnRecordEntry),
+        usable_block_size);
+    if (fs->free_manager->getFreeBlocks() <
+        fs->delayed_writes.getReservedBlocks() + growing.size() + record_blocks_needed) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+
+    uint64_t now = time(nullptr);
+    vector<TxnRecordEntry> images;
+
+    for (size_t i = 0; i < removals.size(); i++) {
+        TxnStep& step = removals[i];
+        readFileEntry(fs, step.entry->baseEntry, step.image);
+        step.image.markInvalid();
+        // a file's chain goes to the reclaimer, as with file_delete
+        if (step.entry->baseState == TXN_PATH_FILE && step.entry->baseBlock != 0) {
+            step.image.reserved[0] |= ENTRY_FLAG_PENDING_RECLAIM;
+        }
+    }
+
+    for (size_t i = 0; i < rewrites.size(); i++) {
+        TxnStep& step = rewrites[i];
+        readFileEntry(fs, step.entry->baseEntry, step.image);
+        step.image.size = step.entry->size;
+        step.image.inode = step.entry->blocks[0];
+        step.image.modified_time = now;
+    }
+
+    for (size_t i = 0; i < creations.size(); i++) {
+        creations[i].entry->entryIndex = allocateEntryIndex(fs);
+    }
+    for (size_t i = 0; i < creations.size(); i++) {
+        TxnStep& step = creations[i];
+        bool is_file = step.entry->state == TXN_PATH_FILE;
+
+        string parent = parentOf(step.path);
+        map<string, TxnPath>::iterator staged_parent = txn->paths.find(parent);
+        uint32_t parent_idx = 1;
+        if (staged_parent != txn->paths.end() && staged_parent->second.entryIndex != 0) {
+            parent_idx = staged_parent->second.entryIndex;
+        } else if (TreeNode* parent_node = fs->file_tree->findNode(parent)) {
+            parent_idx = parent_node->entryIndex;
+        }
+
+        string filename = extractFilename(step.path);
+        if (is_file && filename.length() > fs->config.max_filename_length) {
+            filename = filename.substr(0, fs->config.max_filename_length);
+        }
+
+        uint32_t permissions = is_file ? (fs->config.require_auth ? 0644 : 0666) : 0755;
+        step.image = FileEntry(filename, is_file ? EntryType::FILE : EntryType::DIRECTORY,
+                               is_file ? step.entry->size : 0, permissions, ms->info.user.username,
+                               is_file ? step.entry->blocks[0] : 0, parent_idx);
+        if (!is_file) step.image.reserved[0] |= ENTRY_FLAG_CHILD_INDEX;
+        step.image.created_time = now;
+        step.image.modified_time = now;
+        step.image.markValid();
+    }
+
+    vector<TxnStep>* groups[] = { &removals, &rewrites, &creations };
+    for (size_t g = 0; g < 3; g++) {
+        for (size_t i = 0; i < groups[g]->size(); i++) {
+            TxnStep& step = (*groups[g])[i];
+            TxnRecordEntry record;
+            record.entryIndex = groups[g] == &creations ? step.entry->entryIndex : step.entry->baseEntry;
+            record.padding = 0;
+            record.entry = step.image;
+            images.push_back(record);
+        }
+    }
+    sort(images.begin(), images.end(),
+         [](const TxnRecordEntry& a, const TxnRecordEntry& b) { return a.entryIndex < b.entryIndex; });
+
+    // with the journal on, every entry the commit writes (the images and the
+    // directories whose child lists change) goes out as one journal record
+    // at the end, which is the commit point. Otherwise, or if that record
+    // couldn't fit the journal, the images get a record of their own first.
+    set<string> list_owners = growing;
+    for (size_t i = 0; i < removals.size(); i++) {
+        list_owners.insert(parentOf(removals[i].path));
+    }
+    bool journaled = journalCanHold(fs, images.size() + list_owners.size());
+
+    vector<uint32_t> record_blocks;
+    if (!journaled) {
+        vector<char> record = serializeTxnRecord(images);
+        record_blocks = allocateFileBlocks(fs->free_manager, record_blocks_needed);
+        if (record_blocks.empty()) {
+            for (size_t i = 0; i < creations.size(); i++) {
+                releaseEntryIndex(fs, creations[i].entry->entryIndex);
+                creations[i].entry->entryIndex = 0;
+            }
+            return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        }
+
+        // commit point: the record is in the file before the header points at it
+        writeBlockChain(fs, record_blocks, record.data(), record.size());
+        fflush(fs->omni_file);
+        fs->header_ext.txn_record_block = record_blocks[0];
+        fs->header_ext.txn_record_size = record.size();
+        writeHeader(fs);
+    }
+
+    // home locations; their flushes are left to the header update at the end
+    fs->flush_hold++;
+
+    vector<uint32_t> indexes;
+    for (size_t i = 0; i < images.size(); i++) {
+        indexes.push_back(images[i].entryIndex);
+    }
+    updateFileEntries(fs, indexes, [&images](size_t i, FileEntry& entry) { entry = images[i].entry; });
+
+    vector<uint32_t> freed;
+    for (size_t i = removals.size(); i-- > 0; ) {
+        TxnStep& step = removals[i];
+        TreeNode* node = fs->file_tree->findNode(step.path);
+        if (node->isFile) {
+            if (node->startBlockIndex != 0) {
+                fs->reclaim_queue.push(node->entryIndex, node->startBlockIndex,
+                                       calculateBlocksNeeded(node->size, usable_block_size));
+            } else {
+                releaseEntryIndex(fs, node->entryIndex);
+            }
+        } else {
+            releaseEntryIndex(fs, node->entryIndex);
+        }
+
+        bool is_file = node->isFile;
+        removeChildEntry(fs, node->parent, node->entryIndex, string(step.image.name));
+        fs->file_tree->deleteNode(step.path);
+        if (is_file) {
+            fs->total_files--;
+        } else {
+            fs->total_directories--;
+        }
+    }
+
+    for (size_t i = 0; i < rewrites.size(); i++) {
+        TxnStep& step = rewrites[i];
+        TreeNode* node = fs->file_tree->findNode(step.path);
+        vector<uint32_t> old_chain = getBlockChain(fs, node->startBlockIndex);
+        freed.insert(freed.end(), old_chain.begin(), old_chain.end());
+
+        node->startBlockIndex = step.entry->blocks[0];
+        fs->file_tree->setFileSize(node, step.entry->size);
+        fs->file_tree->setModifiedTime(node, now);
+        step.entry->blocks.clear();
+    }
+
+    bool lists_written = true;
+    for (size_t i = 0; i < creations.size(); i++) {
+        TxnStep& step = creations[i];
+        bool is_file = step.entry->state == TXN_PATH_FILE;
+
+        TreeNode* node = fs->file_tree->createNode(step.path, is_file, ms->info.user.username);
+        node->entryIndex = step.entry->entryIndex;
+        node->startBlockIndex = step.image.inode;
+        if (is_file) fs->file_tree->setFileSize(node, step.entry->size);
+        node->permissions = step.image.permissions;
+        node->created_time = now;
+        node->setModifiedTime(now);
+        fs->file_tree->indexEntry(node);
+
+        if (!addChildEntry(fs, node->parent, node->entryIndex, string(step.image.name))) {
+            lists_written = false;
+        }
+        if (is_file) {
+            fs->total_files++;
+        } else {
+            fs->total_directories++;
+        }
+        step.entry->blocks.clear();
+    }
+
+    fs->flush_hold--;
+
+    // the entry table is complete either way; a child list that couldn't
+    // grow is rebuilt from it at the next mount
+    if (!lists_written) {
+        fs->header_ext.flags &= ~OMNI_EXT_CHILD_INDEX_READY;
+    }
+
+    commitMetadata(fs);
+    if (!journaled || !lists_written) {
+        fs->header_ext.txn_record_block = 0;
+        fs->header_ext.txn_record_size = 0;
+        writeHeader(fs);
+    }
+
+    // replaced chains and the record are only given back once nothing points at them
+    freed.insert(freed.end(), record_blocks.begin(), record_blocks.end());
+    fs->free_manager->freeBlockSegments(freed);
+
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// starts a transaction for the session; txn gets its handle
+extern "C" int txn_begin(void* session, void** txn) {
+    string* session_str = (string*)session;
+    SessionRef ms = SessionManager::getSession(*session_str);
+
+    if (!ms || !ms->instance) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+    if (!txn) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+
+    OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+
+    Transaction* created = new Transaction(*session_str, fs);
+    fs->open_transactions.insert(created);
+    *txn = created;
+
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// stages one operation (a BatchOp of any type but BATCH_OP_STAT). It is
+// checked against the tree as changed by the transaction so far; new
+// content goes straight to blocks of its own, an edit rewrites the whole
+// file there. Nothing becomes visible before txn_commit.
+extern "C" int txn_add(void* txn, const BatchOp* op) {
+    OFSInstance* fs = SessionManager::getInstance();
+    if (!fs) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+
+    Transaction* transaction = (Transaction*)txn;
+    if (!op || !fs->open_transactions.count(transaction)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+
+    SessionRef ms = SessionManager::getSession(transaction->session_id);
+    if (!ms || ms->instance != fs) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+
+    if (!isValidPath(op->path) || strcmp(op->path, "/") == 0 || op->path[strlen(op->path) - 1] == '/') {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    }
+    string path = op->path;
+
+    switch (op->type) {
+        case BATCH_OP_FILE_CREATE:
+        case BATCH_OP_DIR_CREATE: {
+            TxnPath& parent = touchPath(transaction, parentOf(path));
+            if (parent.state != TXN_PATH_DIRECTORY) {
+                return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+            }
+
+            TxnPath& entry = touchPath(transaction, path);
+            if (entry.state != TXN_PATH_ABSENT) {
+                return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+            }
+
+            if (op->type == BATCH_OP_DIR_CREATE) {
+                entry.state = TXN_PATH_DIRECTORY;
+                return static_cast<int>(OFSErrorCodes::SUCCESS);
+            }
+
+            int result = stageContent(transaction, path, entry, op->data, op->size);
+            if (result == static_cast<int>(OFSErrorCodes::SUCCESS)) {
+                entry.state = TXN_PATH_FILE;
+            }
+            return result;
+        }
+
+        case BATCH_OP_FILE_EDIT: {
+            TxnPath& entry = touchPath(transaction, path);
+            if (entry.state != TXN_PATH_FILE) {
+                return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+            }
+
+            TreeNode* node = fs->file_tree->findNode(path);
+            if (entry.baseState == TXN_PATH_FILE && fs->config.require_auth && !isOwnerOrAdmin(ms.get(), node)) {
+                return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+            }
+
+            vector<char> content;
+            if (!stagedContent(transaction, path, entry, content)) {
+                return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+            }
+            if (op->index > content.size()) {
+                return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+            }
+
+            if (op->index + op->size > content.size()) {
+                content.resize(op->index + op->size);
+            }
+            if (op->size > 0) {
+                memcpy(content.data() + op->index, op->data, op->size);
+            }
+            return stageContent(transaction, path, entry, content.data(), content.size());
+        }
+
+        case BATCH_OP_FILE_DELETE: {
+            TxnPath& entry = touchPath(transaction, path);
+            if (entry.state != TXN_PATH_FILE) {
+                return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+            }
+
+            TreeNode* node = fs->file_tree->findNode(path);
+            if (entry.baseState == TXN_PATH_FILE && fs->config.require_auth && !isOwnerOrAdmin(ms.get(), node)) {
+                return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+            }
+
+            releaseStaged(fs, entry);
+            entry.state = TXN_PATH_ABSENT;
+            return static_cast<int>(OFSErrorCodes::SUCCESS);
+        }
+
+        case BATCH_OP_DIR_DELETE: {
+            TxnPath& entry = touchPath(transaction, path);
+            if (entry.state == TXN_PATH_ABSENT) {
+                return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+            }
+            if (entry.state != TXN_PATH_DIRECTORY) {
+                return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+            }
+
+            TreeNode* node = fs->file_tree->findNode(path);
+            if (entry.baseState == TXN_PATH_DIRECTORY && !isOwnerOrAdmin(ms.get(), node)) {
+                return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+            }
+            if (!leavesDirectoryEmpty(transaction, path)) {
+                return static_cast<int>(OFSErrorCodes::ERROR_DIRECTORY_NOT_EMPTY);
+            }
+
+            entry.state = TXN_PATH_ABSENT;
+            return static_cast<int>(OFSErrorCodes::SUCCESS);
+        }
+
+        default:
+            return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+}
+
+// applies everything staged, all or nothing, and returns once it is on
+// disk. If something the transaction read was changed meanwhile it fails
+// with ERROR_INVALID_OPERATION. Either way the handle is gone afterwards.
+// Commits finishing close together share one fdatasync, unless the
+// session runs in the strict durability mode.
+extern "C" int txn_commit(void* txn) {
+    OFSInstance* fs = SessionManager::getInstance();
+    if (!fs) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+
+    DurableOperation operation(fs, nullptr);
+
+    Transaction* transaction = (Transaction*)txn;
+    if (!fs->open_transactions.count(transaction)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+
+    SessionRef ms = SessionManager::getSession(transaction->session_id);
+    int result = static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    if (ms && ms->instance == fs) {
+        // a commit is durable whatever the mode; only strict skips sharing
+        operation.setMode(max(getDurability(fs, ms.get()), (uint32_t)DURABILITY_GROUP));
+        result = commitTransaction(fs, ms.get(), transaction);
+    }
+
+    discardTransaction(fs, transaction);
+    return result;
+}
+
+// drops a transaction, giving back the blocks it staged
+extern "C" int txn_abort(void* txn) {
+    OFSInstance* fs = SessionManager::getInstance();
+    if (!fs) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
+    }
+
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+
+    Transaction* transaction = (Transaction*)txn;
+    if (!fs->open_transactions.count(transaction)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+
+    discardTransaction(fs, transaction);
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
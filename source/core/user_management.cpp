@@ -2,6 +2,7 @@
 #include "../include/ofs_instance.h"
 #include "../include/session_manager.h"
 #include "../include/helper_functions.h"
+#include "../include/durability.h"
 #include <iostream>
 #include <ctime>
 #include <cstring>
@@ -15,6 +16,7 @@ extern "C" int user_login(void** session, const char* username, const char* pass
     if (!fs) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
     }
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     
     // seaarch for user in instance of file system
     UserInfo* user = fs->users.search(username);
@@ -53,20 +55,21 @@ extern "C" int user_logout(void* session) {
 // gets session info 
 extern "C" int get_session_info(void* session, SessionInfo* info) {
     string* session_str = (string*)session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
     }
     
     *info = ms->info;
+    info->last_activity = ms->last_activity;
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
 // creates a new user (only by admin)
 extern "C" int user_create(void* admin_session, const char* username, const char* password, UserRole role) {
     string* session_str = (string*)admin_session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
@@ -79,6 +82,7 @@ extern "C" int user_create(void* admin_session, const char* username, const char
     
 
     OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
     
     // checks for duplicate username
     if (fs->users.search(username) != nullptr) {
@@ -101,7 +105,7 @@ extern "C" int user_create(void* admin_session, const char* username, const char
         if (!existing.is_active || existing.username[0] == '\0') {
             fseek(fs->omni_file, slot_offset, SEEK_SET);
             fwrite(&new_user, sizeof(UserInfo), 1, fs->omni_file);
-            fflush(fs->omni_file);
+            commitMetadata(fs);
             
             cout << "User created: " << username << endl;
             return static_cast<int>(OFSErrorCodes::SUCCESS);
@@ -115,7 +119,7 @@ extern "C" int user_create(void* admin_session, const char* username, const char
 // deletes the user
 extern "C" int user_delete(void* admin_session, const char* username) {
     string* session_str = (string*)admin_session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
@@ -126,6 +130,7 @@ extern "C" int user_delete(void* admin_session, const char* username) {
     }
     
     OFSInstance* fs = ms->instance;
+    DurableOperation operation(fs, ms.get());
     
     // cannot delete itself
     if (strcmp(username, ms->info.user.username) == 0) {
@@ -149,7 +154,7 @@ extern "C" int user_delete(void* admin_session, const char* username) {
             existing.is_active = 0;
             fseek(fs->omni_file, slot_offset, SEEK_SET);
             fwrite(&existing, sizeof(UserInfo), 1, fs->omni_file);
-            fflush(fs->omni_file);
+            commitMetadata(fs);
             
             cout << "User deleted: " << username << endl;
             return static_cast<int>(OFSErrorCodes::SUCCESS);
@@ -162,7 +167,7 @@ extern "C" int user_delete(void* admin_session, const char* username) {
 // list all the valid users
 extern "C" int user_list(void* admin_session, UserInfo** users, int* count) {
     string* session_str = (string*)admin_session;
-    ManagedSession* ms = SessionManager::getSession(*session_str);
+    SessionRef ms = SessionManager::getSession(*session_str);
     
     if (!ms || !ms->instance) {
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION);
@@ -173,6 +178,7 @@ extern "C" int user_list(void* admin_session, UserInfo** users, int* count) {
     }
     
     OFSInstance* fs = ms->instance;
+    lock_guard<recursive_mutex> lock(fs->op_lock);
     vector<UserInfo> all_users = fs->users.getAllSorted();
     *count = all_users.size();
     
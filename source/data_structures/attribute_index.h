@@ -0,0 +1,138 @@
+#ifndef ATTRIBUTE_INDEX_H
+#define ATTRIBUTE_INDEX_H
+
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+
+using namespace std;
+
+// Secondary indexes over the entry table: owner -> entries and modification
+// time -> entries. They are keyed by entry index rather than by tree node,
+// so they cover every live entry whether or not its directory is loaded,
+// and lazy loading or eviction never has to touch them. Each entry also
+// keeps its parent's entry index, which is enough to find its node again.
+class AttributeIndex {
+private:
+    struct EntryAttributes {
+        uint64_t modifiedTime;
+        uint32_t parent;
+        uint16_t ownerId;
+        uint8_t live;
+
+        EntryAttributes() : modifiedTime(0), parent(0), ownerId(0), live(0) {}
+    };
+
+    vector<EntryAttributes> entries;                    // by entry index
+    unordered_map<uint16_t, set<uint32_t> > byOwner;
+    set<pair<uint64_t, uint32_t> > byTime;              // (modified time, entry)
+    size_t liveCount;
+
+public:
+    AttributeIndex() : liveCount(0) {}
+
+    void clear() {
+        entries.clear();
+        byOwner.clear();
+        byTime.clear();
+        liveCount = 0;
+    }
+
+    // adds an entry, or replaces everything known about it
+    void put(uint32_t entry, uint32_t parent, uint16_t ownerId, uint64_t modifiedTime) {
+        if (entry == 0) return;
+        erase(entry);
+        if (entry >= entries.size()) entries.resize(entry + 1);
+
+        EntryAttributes& attributes = entries[entry];
+        attributes.modifiedTime = modifiedTime;
+        attributes.parent = parent;
+        attributes.ownerId = ownerId;
+        attributes.live = 1;
+
+        byOwner[ownerId].insert(entry);
+        byTime.insert(make_pair(modifiedTime, entry));
+        liveCount++;
+    }
+
+    void erase(uint32_t entry) {
+        if (!contains(entry)) return;
+
+        EntryAttributes& attributes = entries[entry];
+        unordered_map<uint16_t, set<uint32_t> >::iterator owned = byOwner.find(attributes.ownerId);
+        if (owned != byOwner.end()) {
+            owned->second.erase(entry);
+            if (owned->second.empty()) byOwner.erase(owned);
+        }
+        byTime.erase(make_pair(attributes.modifiedTime, entry));
+
+        attributes = EntryAttributes();
+        liveCount--;
+    }
+
+    void setModifiedTime(uint32_t entry, uint64_t modifiedTime) {
+        if (!contains(entry) || entries[entry].modifiedTime == modifiedTime) return;
+
+        byTime.erase(make_pair(entries[entry].modifiedTime, entry));
+        entries[entry].modifiedTime = modifiedTime;
+        byTime.insert(make_pair(modifiedTime, entry));
+    }
+
+    void setParent(uint32_t entry, uint32_t parent) {
+        if (contains(entry)) entries[entry].parent = parent;
+    }
+
+    bool contains(uint32_t entry) const {
+        return entry < entries.size() && entries[entry].live;
+    }
+
+    uint32_t getParent(uint32_t entry) const { return contains(entry) ? entries[entry].parent : 0; }
+    uint16_t getOwnerId(uint32_t entry) const { return contains(entry) ? entries[entry].ownerId : 0; }
+    uint64_t getModifiedTime(uint32_t entry) const { return contains(entry) ? entries[entry].modifiedTime : 0; }
+    size_t getEntryCount() const { return liveCount; }
+
+    // up to limit entries of an owner with an index above after, in entry
+    // order; done is set when nothing is left past the last one returned
+    vector<uint32_t> ownedBy(uint16_t ownerId, uint32_t after, size_t limit, bool& done) const {
+        vector<uint32_t> found;
+        done = true;
+
+        unordered_map<uint16_t, set<uint32_t> >::const_iterator owned = byOwner.find(ownerId);
+        if (owned == byOwner.end()) return found;
+
+        set<uint32_t>::const_iterator it = owned->second.upper_bound(after);
+        for (; it != owned->second.end() && found.size() < limit; ++it) {
+            found.push_back(*it);
+        }
+        done = (it == owned->second.end());
+        return found;
+    }
+
+    size_t countOwnedBy(uint16_t ownerId) const {
+        unordered_map<uint16_t, set<uint32_t> >::const_iterator owned = byOwner.find(ownerId);
+        return owned == byOwner.end() ? 0 : owned->second.size();
+    }
+
+    // up to limit entries modified in [since, until], oldest first, that come
+    // after (afterTime, afterEntry); (0, 0) starts at the beginning
+    vector<pair<uint64_t, uint32_t> > modifiedBetween(uint64_t since, uint64_t until, uint64_t afterTime,
+                                                      uint32_t afterEntry, size_t limit, bool& done) const {
+        vector<pair<uint64_t, uint32_t> > found;
+
+        set<pair<uint64_t, uint32_t> >::const_iterator it = byTime.lower_bound(make_pair(since, 0u));
+        pair<uint64_t, uint32_t> after(afterTime, afterEntry);
+        if (after >= make_pair(since, 0u)) {
+            it = byTime.upper_bound(after);
+        }
+
+        for (; it != byTime.end() && it->first <= until && found.size() < limit; ++it) {
+            found.push_back(*it);
+        }
+        done = (it == byTime.end() || it->first > until);
+        return found;
+    }
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef CHILD_PAGE_INDEX_H
+#define CHILD_PAGE_INDEX_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+// directories whose page index is kept; past this the cache starts over
+#define CHILD_PAGE_CACHE_DIRS 1024
+
+// Where one directory's child list pages are and the first name on each,
+// so a create or delete reads and writes only the page its name sorts onto.
+// Built from the chain the first time the directory's list changes.
+struct ChildPages {
+    uint32_t headBlock;             // FileEntry.inode it was built for
+    uint32_t records;               // record count it was built for
+    vector<uint32_t> blocks;        // pages in chain order
+    vector<string> firstNames;      // name of the first record on each page
+
+    ChildPages() : headBlock(0), records(0) {}
+
+    // the last page starting at or before name
+    size_t pageFor(string_view name) const {
+        vector<string>::const_iterator it = upper_bound(
+            firstNames.begin(), firstNames.end(), name,
+            [](string_view value, const string& first) { return value < string_view(first); });
+        return it == firstNames.begin() ? 0 : (it - firstNames.begin()) - 1;
+    }
+};
+
+// Page indexes by directory entry index. An index is only handed out
+// while the directory's FileEntry still names the head block and record
+// count it was built for; slots are dropped when reused.
+class ChildPageCache {
+private:
+    unordered_map<uint32_t, ChildPages> dirs;
+
+public:
+    ChildPages* find(uint32_t dirIndex, uint32_t headBlock, uint32_t records) {
+        unordered_map<uint32_t, ChildPages>::iterator it = dirs.find(dirIndex);
+        if (it == dirs.end()) return nullptr;
+
+        if (it->second.headBlock != headBlock || it->second.records != records) {
+            dirs.erase(it);
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    // an empty index for the directory, replacing any old one
+    ChildPages& put(uint32_t dirIndex) {
+        if (dirs.size() >= CHILD_PAGE_CACHE_DIRS && dirs.find(dirIndex) == dirs.end()) {
+            dirs.clear();
+        }
+        ChildPages& pages = dirs[dirIndex];
+        pages = ChildPages();
+        return pages;
+    }
+
+    void erase(uint32_t dirIndex) {
+        dirs.erase(dirIndex);
+    }
+
+    void clear() {
+        dirs.clear();
+    }
+
+    size_t size() const {
+        return dirs.size();
+    }
+};
+
+#endif
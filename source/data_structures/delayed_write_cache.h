@@ -0,0 +1,128 @@
+#ifndef DELAYED_WRITE_CACHE_H
+#define DELAYED_WRITE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <ctime>
+#include <cstdint>
+#include "file_tree.h"
+
+using namespace std;
+
+// Content of a file that has no blocks yet
+struct DirtyFile {
+    TreeNode* node;
+    string data;
+    time_t dirtySince;          // when the first unflushed write happened
+    uint32_t reservedBlocks;    // blocks the flush will need
+
+    DirtyFile() : node(nullptr), dirtySince(0), reservedBlocks(0) {}
+};
+
+// Per-file write buffers for delayed allocation, keyed by entry index.
+// Blocks are only allocated when a buffer is flushed, so the allocator
+// sees the final size and can place the whole file in one extent.
+class DelayedWriteCache {
+private:
+    unordered_map<uint32_t, DirtyFile> files;
+    uint64_t bufferedBytes;
+    uint32_t reservedBlocks;
+
+public:
+    DelayedWriteCache() : bufferedBytes(0), reservedBlocks(0) {}
+
+    DirtyFile* find(uint32_t entryIndex) {
+        unordered_map<uint32_t, DirtyFile>::iterator it = files.find(entryIndex);
+        if (it == files.end()) return nullptr;
+        return &it->second;
+    }
+
+    bool contains(uint32_t entryIndex) const {
+        return files.count(entryIndex) > 0;
+    }
+
+    void insert(uint32_t entryIndex, TreeNode* node, const char* data, size_t size,
+                uint32_t blocksNeeded) {
+        DirtyFile& dirty = files[entryIndex];
+        dirty.node = node;
+        dirty.data.assign(data ? data : "", data ? size : 0);
+        dirty.data.resize(size, '\0');
+        dirty.dirtySince = time(nullptr);
+        dirty.reservedBlocks = blocksNeeded;
+
+        bufferedBytes += size;
+        reservedBlocks += blocksNeeded;
+    }
+
+    // writes into a buffered file, growing it if needed
+    void write(uint32_t entryIndex, uint64_t offset, const char* data, size_t size,
+               uint32_t blocksNeeded) {
+        DirtyFile* dirty = find(entryIndex);
+        if (!dirty) return;
+
+        size_t oldSize = dirty->data.size();
+        if (offset + size > oldSize) {
+            dirty->data.resize(offset + size, '\0');
+            bufferedBytes += dirty->data.size() - oldSize;
+        }
+        if (size > 0 && data) {
+            dirty->data.replace(offset, size, data, size);
+        }
+
+        reservedBlocks = reservedBlocks - dirty->reservedBlocks + blocksNeeded;
+        dirty->reservedBlocks = blocksNeeded;
+    }
+
+    void remove(uint32_t entryIndex) {
+        unordered_map<uint32_t, DirtyFile>::iterator it = files.find(entryIndex);
+        if (it == files.end()) return;
+
+        bufferedBytes -= it->second.data.size();
+        reservedBlocks -= it->second.reservedBlocks;
+        files.erase(it);
+    }
+
+    // entry indices of buffers dirty since before cutoff
+    vector<uint32_t> dirtySince(time_t cutoff) const {
+        vector<uint32_t> result;
+        for (unordered_map<uint32_t, DirtyFile>::const_iterator it = files.begin();
+             it != files.end(); ++it) {
+            if (it->second.dirtySince <= cutoff) {
+                result.push_back(it->first);
+            }
+        }
+        return result;
+    }
+
+    // all buffered entry indices, oldest write first
+    vector<uint32_t> oldestFirst() const {
+        vector<pair<time_t, uint32_t>> order;
+        for (unordered_map<uint32_t, DirtyFile>::const_iterator it = files.begin();
+             it != files.end(); ++it) {
+            order.push_back(make_pair(it->second.dirtySince, it->first));
+        }
+        sort(order.begin(), order.end());
+
+        vector<uint32_t> result;
+        for (size_t i = 0; i < order.size(); i++) {
+            result.push_back(order[i].second);
+        }
+        return result;
+    }
+
+    uint64_t getBufferedBytes() const {
+        return bufferedBytes;
+    }
+
+    uint32_t getReservedBlocks() const {
+        return reservedBlocks;
+    }
+
+    size_t size() const {
+        return files.size();
+    }
+};
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+struct TreeNode;
+
+// Cached result of resolving one path; node is nullptr for a path that
+// didn't exist (negative entry)
+struct DentryCacheEntry {
+    TreeNode* node;
+    uint64_t generation;
+    list<string>::iterator lru;     // position in the recency list
+
+    DentryCacheEntry() : node(nullptr), generation(0) {}
+};
+
+// Bounded path -> TreeNode* cache in front of FileTree::findNode, least
+// recently used entries go first. The map's keys view the paths held by
+// the recency list, so a lookup never builds a string. FileTree erases the
+// exact path when one node appears or disappears, and drops a directory's
+// whole subtree of paths (kept in order for that) when the directory is
+// renamed or deleted, so other cached paths survive. Entries are also only
+// trusted while their generation is current; the generation is bumped when
+// lazy loading evicts subtrees, which can touch many directories at once.
+class DentryCache {
+private:
+    unordered_map<string_view, DentryCacheEntry> entries;
+    list<string> recency;           // most recently used first
+    set<string_view> ordered;       // the same keys sorted, so a subtree is one range
+    size_t capacity;
+    uint64_t generation;
+
+    uint64_t hits;
+    uint64_t negativeHits;
+    uint64_t misses;
+    uint64_t invalidations;
+
+    void drop(unordered_map<string_view, DentryCacheEntry>::iterator it) {
+        ordered.erase(it->first);
+        recency.erase(it->second.lru);
+        entries.erase(it);
+    }
+
+    void dropLeastRecent() {
+        drop(entries.find(string_view(recency.back())));
+    }
+
+public:
+    DentryCache() : capacity(0), generation(1), hits(0), negativeHits(0), misses(0), invalidations(0) {}
+
+    // 0 turns the cache off
+    void setCapacity(size_t entryCount) {
+        capacity = entryCount;
+        while (entries.size() > capacity) {
+            dropLeastRecent();
+        }
+    }
+
+    // true with node filled in (possibly nullptr) when the path is cached
+    bool lookup(string_view path, TreeNode*& node) {
+        if (capacity == 0) return false;
+
+        unordered_map<string_view, DentryCacheEntry>::iterator it = entries.find(path);
+        if (it == entries.end()) {
+            misses++;
+            return false;
+        }
+
+        if (it->second.generation != generation) {
+            drop(it);
+            misses++;
+            return false;
+        }
+
+        recency.splice(recency.begin(), recency, it->second.lru);
+        node = it->second.node;
+        if (node) hits++;
+        else negativeHits++;
+        return true;
+    }
+
+    void insert(string_view path, TreeNode* node) {
+        if (capacity == 0) return;
+
+        unordered_map<string_view, DentryCacheEntry>::iterator it = entries.find(path);
+        if (it != entries.end()) {
+            recency.splice(recency.begin(), recency, it->second.lru);
+        } else {
+            if (entries.size() >= capacity) {
+                dropLeastRecent();
+            }
+            recency.push_front(string(path));
+            it = entries.insert(make_pair(string_view(recency.front()), DentryCacheEntry())).first;
+            it->second.lru = recency.begin();
+            ordered.insert(it->first);
+        }
+
+        it->second.node = node;
+        it->second.generation = generation;
+    }
+
+    void erase(string_view path) {
+        unordered_map<string_view, DentryCacheEntry>::iterator it = entries.find(path);
+        if (it == entries.end()) return;
+        drop(it);
+    }
+
+    // drops dir and every cached path below it, negative ones included
+    void eraseBelow(string_view dir) {
+        if (dir == "/") {
+            invalidateAll();
+            return;
+        }
+        invalidations++;
+        erase(dir);
+
+        string prefix(dir);
+        prefix += '/';
+        set<string_view>::iterator it = ordered.lower_bound(prefix);
+        while (it != ordered.end() && it->compare(0, prefix.size(), prefix) == 0) {
+            string_view path = *it;
+            ++it;
+            erase(path);
+        }
+    }
+
+    // every cached entry becomes stale; they are dropped as they are hit
+    void invalidateAll() {
+        generation++;
+        invalidations++;
+    }
+
+    size_t getSize() const { return entries.size(); }
+    size_t getCapacity() const { return capacity; }
+    uint64_t getHits() const { return hits; }
+    uint64_t getNegativeHits() const { return negativeHits; }
+    uint64_t getMisses() const { return misses; }
+    uint64_t getInvalidations() const { return invalidations; }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef ENTRY_SLOT_MAP_H
+#define ENTRY_SLOT_MAP_H
+
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// Tracks which FileEntry slots are taken. Built once by fs_init from the
+// entry table, then kept in step by create/delete so finding a slot never
+// touches the disk. Slots 0 (unused) and 1 (root) are always taken.
+class EntrySlotMap {
+private:
+    vector<bool> used;
+    vector<uint32_t> freeSlots;     // lowest index on top
+
+public:
+    EntrySlotMap() {}
+
+    // call markUsed for every taken slot, then finishBuild
+    void reset(uint32_t maxEntries) {
+        used.assign(maxEntries, false);
+        freeSlots.clear();
+
+        if (maxEntries > 0) used[0] = true;
+        if (maxEntries > 1) used[1] = true;
+    }
+
+    void markUsed(uint32_t index) {
+        if (index < used.size()) {
+            used[index] = true;
+        }
+    }
+
+    void finishBuild() {
+        freeSlots.clear();
+        for (uint32_t i = used.size(); i > 2; i--) {
+            if (!used[i - 1]) {
+                freeSlots.push_back(i - 1);
+            }
+        }
+    }
+
+    // takes a free slot, 0 when the table is full
+    uint32_t acquire() {
+        if (freeSlots.empty()) return 0;
+
+        uint32_t index = freeSlots.back();
+        freeSlots.pop_back();
+        used[index] = true;
+        return index;
+    }
+
+    void release(uint32_t index) {
+        if (index < 2 || index >= used.size() || !used[index]) return;
+
+        used[index] = false;
+        freeSlots.push_back(index);
+    }
+
+    bool isUsed(uint32_t index) const {
+        return index < used.size() && used[index];
+    }
+
+    uint32_t getFreeCount() const {
+        return freeSlots.size();
+    }
+
+    uint32_t getCapacity() const {
+        return used.size();
+    }
+
+    // one bit per slot, for the index snapshot
+    vector<uint8_t> toBitmap() const {
+        vector<uint8_t> bitmap((used.size() + 7) / 8, 0);
+        for (uint32_t i = 0; i < used.size(); i++) {
+            if (used[i]) {
+                bitmap[i / 8] |= (1 << (i % 8));
+            }
+        }
+        return bitmap;
+    }
+
+    void fromBitmap(const uint8_t* bitmap, uint32_t maxEntries) {
+        reset(maxEntries);
+        for (uint32_t i = 2; i < maxEntries; i++) {
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                used[i] = true;
+            }
+        }
+        finishBuild();
+    }
+};
+
+#endif
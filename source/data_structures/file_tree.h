@@ -2,30 +2,291 @@
 #define FILE_TREE_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstring>
+#include <cstdlib>
+#include <new>
 #include <ctime>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
 #include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
+#include "dentry_cache.h"
+#include "slab_pool.h"
+#include "node_strings.h"
+#include "name_index.h"
+#include "attribute_index.h"
 
 using namespace std;
 
-struct TreeNode {
-    string name;
-    bool isFile;
+// children a directory holds before its name lookups go through a hash index
+#define CHILD_HASH_THRESHOLD 64
+#define CHILD_POSITION_NONE UINT32_MAX
+
+// Path parsing works on views of the caller's buffer, so walking a path
+// copies nothing. Empty components (repeated or trailing slashes) are
+// skipped, which normalizes "/a//b/" to "/a/b" without rewriting it.
+
+// next component at or after pos; empty once the path is used up
+inline string_view nextPathComponent(string_view path, size_t& pos) {
+    while (pos < path.size() && path[pos] == '/') pos++;
+    size_t start = pos;
+    while (pos < path.size() && path[pos] != '/') pos++;
+    return path.substr(start, pos - start);
+}
+
+// "/" stays "/"
+inline string_view trimTrailingSlashes(string_view path) {
+    while (path.size() > 1 && path.back() == '/') {
+        path.remove_suffix(1);
+    }
+    return path;
+}
+
+// splits off the last component; the parent of a top level name is "/"
+inline void splitParentPath(string_view path, string_view& parent, string_view& name) {
+    path = trimTrailingSlashes(path);
+    size_t lastSlash = path.find_last_of('/');
+    if (lastSlash == string_view::npos) {
+        parent = string_view();
+        name = path;
+        return;
+    }
+    
+    name = path.substr(lastSlash + 1);
+    while (lastSlash > 0 && path[lastSlash - 1] == '/') {
+        lastSlash--;
+    }
+    parent = lastSlash == 0 ? string_view("/") : path.substr(0, lastSlash);
+}
+
+struct TreeNode;
+
+// Name index of a wide directory: an open addressing (linear probing) table
+// whose slots hold the child pointers themselves and each child's position
+// in the ChildList, so it costs at most two pointers and two positions per
+// child. Keys are the children's own names.
+class ChildNameIndex {
+private:
+    vector<TreeNode*> slots;        // nullptr when empty; size is a power of two
+    vector<uint32_t> positions;     // ChildList position of the child in the same slot
+    size_t used;
+    
+    size_t slotOf(const TreeNode* child) const;
+    
+    size_t homeSlot(string_view name) const {
+        return hash<string_view>()(name) & (slots.size() - 1);
+    }
+    
+    void rehash(size_t capacity);
+    
+public:
+    explicit ChildNameIndex(size_t expected) : used(0) {
+        size_t capacity = 16;
+        while (capacity < expected * 2) capacity *= 2;
+        slots.assign(capacity, nullptr);
+        positions.assign(capacity, 0);
+    }
+    
+    TreeNode* find(string_view name) const;
+    void insert(TreeNode* child, uint32_t position);
+    // the position the child had, CHILD_POSITION_NONE if it wasn't indexed
+    uint32_t erase(TreeNode* child);
+    void setPosition(TreeNode* child, uint32_t position);
+};
+
+// Sorted views of a directory's children for paged listing, one per
+// DIR_LIST_SORT_* order. Each is built the first time a page is asked for
+// in that order and kept in step by addChild, setSize and setModifiedTime
+// from then on. removeChild drops them all rather than erase from each
+// (a shift of the whole view per removal); the next page rebuilds its own.
+struct ChildOrders {
+    vector<TreeNode*> sorted[DIR_LIST_SORT_COUNT];
+    bool built[DIR_LIST_SORT_COUNT];
+    
+    ChildOrders() {
+        for (int i = 0; i < DIR_LIST_SORT_COUNT; i++) built[i] = false;
+    }
+};
+
+// What a directory holds below it, all the way down; the directory itself
+// isn't counted
+struct DirectoryUsage {
+    uint64_t bytes;             // Logical size of every file
+    uint64_t files;
+    uint64_t directories;
+    uint64_t blocks;            // Content blocks of those files
+    
+    DirectoryUsage() : bytes(0), files(0), directories(0), blocks(0) {}
+    
+    void add(const DirectoryUsage& other) {
+        bytes += other.bytes;
+        files += other.files;
+        directories += other.directories;
+        blocks += other.blocks;
+    }
+    
+    void subtract(const DirectoryUsage& other) {
+        bytes -= other.bytes;
+        files -= other.files;
+        directories -= other.directories;
+        blocks -= other.blocks;
+    }
+};
+
+// A child of a directory still on disk, as a name search sees it without
+// making a node for it
+struct DiskChild {
     uint32_t entryIndex;
-    uint32_t startBlockIndex;
+    string name;
+    bool isDirectory;
+    
+    DiskChild(uint32_t index, const string& n, bool directory)
+        : entryIndex(index), name(n), isDirectory(directory) {}
+};
+
+// A directory's children in listing order (creation order, except that a
+// removed child's place goes to the last child), with the hash index of a wide
+// directory, its sorted views, its usage rollup and its access stamp, all
+// in one block behind a single pointer. Files and empty directories only
+// carry the null pointer.
+class ChildList {
+private:
+    struct Header {
+        uint32_t count;
+        uint32_t capacity;
+        uint32_t lastAccess;
+        bool usageKnown;
+        DirectoryUsage usage;
+        ChildNameIndex* index;
+        ChildOrders* orders;
+    };
+    Header* block;
+
+    TreeNode** items() const {
+        return (TreeNode**)(block + 1);
+    }
+
+    void reserve(uint32_t capacity) {
+        Header* grown = (Header*)realloc(block, sizeof(Header) + capacity * sizeof(TreeNode*));
+        if (!grown) throw bad_alloc();
+        if (!block) {
+            grown->count = 0;
+            grown->lastAccess = 0;
+            grown->usageKnown = false;
+            grown->usage = DirectoryUsage();
+            grown->index = nullptr;
+            grown->orders = nullptr;
+        }
+        grown->capacity = capacity;
+        block = grown;
+    }
+
+public:
+    ChildList() : block(nullptr) {}
+    ~ChildList() { clear(); }
+
+    ChildList(const ChildList&) = delete;
+    ChildList& operator=(const ChildList&) = delete;
+
+    size_t size() const { return block ? block->count : 0; }
+    bool empty() const { return size() == 0; }
+    TreeNode* operator[](size_t i) const { return items()[i]; }
+    TreeNode* const* begin() const { return block ? items() : nullptr; }
+    TreeNode* const* end() const { return block ? items() + block->count : nullptr; }
+
+    void push_back(TreeNode* child) {
+        if (!block || block->count == block->capacity) {
+            reserve(block && block->capacity > 0 ? block->capacity * 2 : 4);
+        }
+        items()[block->count++] = child;
+    }
+
+    // the last child takes the place of the one removed
+    void swapErase(size_t position) {
+        TreeNode** list = items();
+        list[position] = list[block->count - 1];
+        block->count--;
+    }
+
+    // forgets the children (without deleting them), the index and the orders
+    void clear() {
+        if (!block) return;
+        delete block->index;
+        delete block->orders;
+        free(block);
+        block = nullptr;
+    }
+
+    ChildNameIndex* getIndex() const {
+        return block ? block->index : nullptr;
+    }
+
+    // only called once a child is in the list, so the block exists
+    void setIndex(ChildNameIndex* index) {
+        block->index = index;
+    }
+
+    ChildOrders* getOrders() const {
+        return block ? block->orders : nullptr;
+    }
+    
+    // like setIndex, only called once there are children
+    void setOrders(ChildOrders* orders) {
+        block->orders = orders;
+    }
+    
+    // a directory without a block only knows its usage if it is known to
+    // be empty (loaded)
+    bool getUsage(DirectoryUsage& usage, bool loaded) const {
+        if (!block) {
+            usage = DirectoryUsage();
+            return loaded;
+        }
+        usage = block->usage;
+        return block->usageKnown;
+    }
+    
+    void setUsage(const DirectoryUsage& usage) {
+        if (!block) reserve(0);
+        block->usage = usage;
+        block->usageKnown = true;
+    }
+    
+    void forgetUsage() {
+        if (block) block->usageKnown = false;
+    }
+    
+    // nothing below an empty directory can be evicted, so it keeps no stamp
+    uint32_t getLastAccess() const { return block ? block->lastAccess : 0; }
+    void setLastAccess(uint32_t clock) {
+        if (block) block->lastAccess = clock;
+    }
+};
+
+// 64 bytes on a 64-bit build: the name and owner live in the interned
+// heaps of node_strings.h and the nodes themselves in a slab pool
+struct TreeNode {
+    NodeName name;
+    ChildList children;         // listing order
+    TreeNode* parent;
     uint64_t size;
-    uint32_t permissions;
-    string owner;
     uint64_t created_time;
     uint64_t modified_time;
+    uint32_t entryIndex;
+    uint32_t startBlockIndex;
+    uint32_t permissions;
+    uint16_t ownerId;           // OwnerNames ID
+    bool isFile;
+    bool childrenLoaded;        // false for a directory whose children are still on disk
     
-    TreeNode* parent; 
-    vector<TreeNode*> children;
-    
-    TreeNode(const string& n, bool file = false) 
-        : name(n), isFile(file), entryIndex(0), startBlockIndex(0), 
-          size(0), permissions(0644), owner(""), created_time(0), modified_time(0), parent(nullptr) {}
+    TreeNode(string_view n, bool file = false) 
+        : name(n), parent(nullptr), size(0), created_time(0), modified_time(0),
+          entryIndex(0), startBlockIndex(0), permissions(0644), ownerId(0),
+          isFile(file), childrenLoaded(true) {}
     
     ~TreeNode() {
         for (size_t i = 0; i < children.size(); i++) {
@@ -33,7 +294,59 @@ struct TreeNode {
         }
     }
     
-    TreeNode* findChild(const string& childName) {
+    // process wide, and never destroyed, like the name heap
+    static SlabPool& nodePool() {
+        static SlabPool* pool = new SlabPool(sizeof(TreeNode), 1024);
+        return *pool;
+    }
+    
+    static void* operator new(size_t) {
+        return nodePool().allocate();
+    }
+    
+    static void operator delete(void* node) {
+        nodePool().release(node);
+    }
+    
+    const string& getOwner() const {
+        return OwnerNames::lookup(ownerId);
+    }
+    
+    void setOwner(string_view owner) {
+        ownerId = OwnerNames::intern(owner);
+    }
+    
+    // a lookup through a file warms the directory holding it
+    void touch(uint32_t clock) {
+        TreeNode* dir = isFile ? parent : this;
+        if (dir) dir->children.setLastAccess(clock);
+    }
+    
+    // size and modified_time place a node in its directory's sorted views,
+    // so once a node is in the tree they change through these
+    void setSize(uint64_t value) {
+        if (parent) parent->unorderChild(this);
+        size = value;
+        if (parent) parent->orderChild(this);
+    }
+    
+    void setModifiedTime(uint64_t value) {
+        if (parent) parent->unorderChild(this);
+        modified_time = value;
+        if (parent) parent->orderChild(this);
+    }
+    
+    // children sorted by a DIR_LIST_SORT_* order other than NONE
+    const vector<TreeNode*>& getChildOrder(uint32_t order);
+    void orderChild(TreeNode* child);
+    void unorderChild(TreeNode* child);
+    
+    TreeNode* findChild(string_view childName) {
+        ChildNameIndex* childIndex = children.getIndex();
+        if (childIndex) {
+            return childIndex->find(childName);
+        }
+        
         for (size_t i = 0; i < children.size(); i++) {
             if (children[i]->name == childName) {
                 return children[i];
@@ -45,33 +358,78 @@ struct TreeNode {
     void addChild(TreeNode* child) {
         child->parent = this;
         children.push_back(child);
+        orderChild(child);
+        
+        ChildNameIndex* childIndex = children.getIndex();
+        if (childIndex) {
+            childIndex->insert(child, children.size() - 1);
+        } else if (children.size() > CHILD_HASH_THRESHOLD) {
+            childIndex = new ChildNameIndex(children.size());
+            for (size_t i = 0; i < children.size(); i++) {
+                childIndex->insert(children[i], i);
+            }
+            children.setIndex(childIndex);
+        }
     }
     
-    bool removeChild(const string& childName) {
-        for (size_t i = 0; i < children.size(); i++) {
-            if (children[i]->name == childName) {
-                delete children[i];
-                children.erase(children.begin() + i);
-                return true;
-            }
+    bool removeChild(string_view childName) {
+        TreeNode* child = findChild(childName);
+        if (child && removeChild(child)) {
+            delete child;
+            return true;
         }
         return false;
     }
     
+    // detaches a child without deleting it, in constant time for a wide
+    // directory: the index knows its position and the last child moves
+    // into it. The sorted views are dropped, see ChildOrders.
     bool removeChild(TreeNode* child) {
-        for (size_t i = 0; i < children.size(); i++) {
-            if (children[i] == child) {
-                children.erase(children.begin() + i);
-                return true;
+        size_t position = CHILD_POSITION_NONE;
+        ChildNameIndex* childIndex = children.getIndex();
+        if (childIndex) {
+            position = childIndex->erase(child);
+        } else {
+            // at most CHILD_HASH_THRESHOLD children; recent ones are the
+            // likeliest to go, so search from the back
+            for (size_t i = children.size(); i > 0; i--) {
+                if (children[i - 1] == child) {
+                    position = i - 1;
+                    break;
+                }
             }
         }
-        return false;
+        if (position == CHILD_POSITION_NONE) return false;
+        
+        dropChildOrders();
+        TreeNode* last = children[children.size() - 1];
+        children.swapErase(position);
+        if (childIndex && last != child) {
+            childIndex->setPosition(last, position);
+        }
+        return true;
+    }
+    
+    void dropChildOrders() {
+        ChildOrders* orders = children.getOrders();
+        if (orders) {
+            delete orders;
+            children.setOrders(nullptr);
+        }
+    }
+    
+    // deletes every child (and so the whole subtree below)
+    void clearChildren() {
+        for (size_t i = 0; i < children.size(); i++) {
+            delete children[i];
+        }
+        children.clear();
     }
     
     string getFullPath() {
         if (parent == nullptr) return "/";
         
-        vector<string> pathParts;
+        vector<string_view> pathParts;
         TreeNode* current = this;
         
         while (current->parent != nullptr) {
@@ -81,59 +439,258 @@ struct TreeNode {
         
         string path = "";
         for (int i = pathParts.size() - 1; i >= 0; i--) {
-            path += "/" + pathParts[i];
+            path += '/';
+            path += pathParts[i];
         }
         
         return path.empty() ? "/" : path;
     }
 };
 
+static_assert(sizeof(TreeNode) == 64, "TreeNode should fill one 64 byte slab slot");
 
-class FileTree {
-private:
-    TreeNode* root;
+inline TreeNode* ChildNameIndex::find(string_view name) const {
+    size_t mask = slots.size() - 1;
+    for (size_t i = homeSlot(name); slots[i]; i = (i + 1) & mask) {
+        if (slots[i]->name == name) return slots[i];
+    }
+    return nullptr;
+}
+
+// the slot holding child, or slots.size() if it isn't indexed
+inline size_t ChildNameIndex::slotOf(const TreeNode* child) const {
+    size_t mask = slots.size() - 1;
+    size_t i = homeSlot(child->name);
+    while (slots[i] && slots[i] != child) i = (i + 1) & mask;
+    return slots[i] ? i : slots.size();
+}
+
+inline void ChildNameIndex::insert(TreeNode* child, uint32_t position) {
+    if ((used + 1) * 2 > slots.size()) {
+        rehash(slots.size() * 2);
+    }
     
-    vector<string> splitPath(const string& path) {
-        vector<string> parts;
-        
-        if (path.empty() || path == "/") {
-            return parts;
+    size_t mask = slots.size() - 1;
+    size_t i = homeSlot(child->name);
+    while (slots[i]) i = (i + 1) & mask;
+    slots[i] = child;
+    positions[i] = position;
+    used++;
+}
+
+// backward shift deletion, so lookups never need tombstones
+inline uint32_t ChildNameIndex::erase(TreeNode* child) {
+    size_t mask = slots.size() - 1;
+    size_t hole = slotOf(child);
+    if (hole == slots.size()) return CHILD_POSITION_NONE;
+    uint32_t position = positions[hole];
+    
+    for (size_t next = (hole + 1) & mask; slots[next]; next = (next + 1) & mask) {
+        // an entry can fill the hole unless its home lies cyclically in (hole, next]
+        size_t home = homeSlot(slots[next]->name);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            slots[hole] = slots[next];
+            positions[hole] = positions[next];
+            hole = next;
         }
+    }
+    slots[hole] = nullptr;
+    used--;
+    return position;
+}
+
+inline void ChildNameIndex::setPosition(TreeNode* child, uint32_t position) {
+    size_t slot = slotOf(child);
+    if (slot != slots.size()) positions[slot] = position;
+}
+
+inline void ChildNameIndex::rehash(size_t capacity) {
+    vector<TreeNode*> old;
+    vector<uint32_t> oldPositions;
+    old.swap(slots);
+    oldPositions.swap(positions);
+    slots.assign(capacity, nullptr);
+    positions.assign(capacity, 0);
+    used = 0;
+    
+    for (size_t i = 0; i < old.size(); i++) {
+        if (old[i]) insert(old[i], oldPositions[i]);
+    }
+}
+
+
+inline uint64_t getChildOrderKey(const TreeNode* node, uint32_t order) {
+    if (order == DIR_LIST_SORT_SIZE) return node->size;
+    if (order == DIR_LIST_SORT_MTIME) return node->modified_time;
+    return 0;
+}
+
+// (key, name); names are unique within a directory, so this is total
+inline bool childOrderLess(uint64_t keyA, string_view nameA, uint64_t keyB, string_view nameB) {
+    if (keyA != keyB) return keyA < keyB;
+    return nameA < nameB;
+}
+
+inline const vector<TreeNode*>& TreeNode::getChildOrder(uint32_t order) {
+    ChildOrders* orders = children.getOrders();
+    if (!orders) {
+        static const vector<TreeNode*> none;
+        if (children.empty()) return none;
+        orders = new ChildOrders();
+        children.setOrders(orders);
+    }
+    
+    vector<TreeNode*>& sorted = orders->sorted[order];
+    if (!orders->built[order]) {
+        sorted.assign(children.begin(), children.end());
+        sort(sorted.begin(), sorted.end(), [order](const TreeNode* a, const TreeNode* b) {
+            return childOrderLess(getChildOrderKey(a, order), a->name,
+                                  getChildOrderKey(b, order), b->name);
+        });
+        orders->built[order] = true;
+    }
+    return sorted;
+}
+
+inline void TreeNode::orderChild(TreeNode* child) {
+    ChildOrders* orders = children.getOrders();
+    if (!orders) return;
+    
+    for (uint32_t order = 1; order < DIR_LIST_SORT_COUNT; order++) {
+        if (!orders->built[order]) continue;
         
-        size_t start = 0;
-        size_t end = path.find('/');
+        vector<TreeNode*>& sorted = orders->sorted[order];
+        uint64_t key = getChildOrderKey(child, order);
+        vector<TreeNode*>::iterator it = upper_bound(sorted.begin(), sorted.end(), child,
+            [order, key](const TreeNode* value, const TreeNode* element) {
+                return childOrderLess(key, value->name,
+                                      getChildOrderKey(element, order), element->name);
+            });
+        sorted.insert(it, child);
+    }
+}
+
+inline void TreeNode::unorderChild(TreeNode* child) {
+    ChildOrders* orders = children.getOrders();
+    if (!orders) return;
+    
+    for (uint32_t order = 1; order < DIR_LIST_SORT_COUNT; order++) {
+        if (!orders->built[order]) continue;
         
-        if (end == 0) {
-            start = 1;
-            end = path.find('/', start);
+        vector<TreeNode*>& sorted = orders->sorted[order];
+        uint64_t key = getChildOrderKey(child, order);
+        vector<TreeNode*>::iterator it = lower_bound(sorted.begin(), sorted.end(), child,
+            [order, key](const TreeNode* element, const TreeNode* value) {
+                return childOrderLess(getChildOrderKey(element, order), element->name,
+                                      key, value->name);
+            });
+        if (it == sorted.end() || *it != child) {
+            // only reached if a key changed behind setSize/setModifiedTime
+            it = find(sorted.begin(), sorted.end(), child);
         }
-        
-        while (end != string::npos) {
-            if (end != start) {
-                parts.push_back(path.substr(start, end - start));
+        if (it != sorted.end()) sorted.erase(it);
+    }
+}
+
+
+inline void NameIndex::add(TreeNode* node) {
+    unordered_map<string_view, uint32_t>::iterator it = ids.find(node->name);
+    uint32_t id;
+    if (it == ids.end()) {
+        id = addName(node->name);
+    } else {
+        id = it->second;
+        if (slots[id].nodes.empty()) deadNames--;
+    }
+    slots[id].nodes.push_back(node);
+}
+
+inline void NameIndex::remove(TreeNode* node) {
+    unordered_map<string_view, uint32_t>::iterator it = ids.find(node->name);
+    if (it == ids.end()) return;
+    
+    vector<TreeNode*>& nodes = slots[it->second].nodes;
+    vector<TreeNode*>::iterator found = std::find(nodes.begin(), nodes.end(), node);
+    if (found == nodes.end()) return;
+    
+    *found = nodes.back();
+    nodes.pop_back();
+    
+    if (nodes.empty()) {
+        deadNames++;
+        if (deadNames >= NAME_INDEX_COMPACT_MIN && deadNames > slots.size() - deadNames) {
+            compact();
+        }
+    }
+}
+
+
+class FileTree {
+private:
+    TreeNode* root;
+    
+    // lazy loading: fills in the children of an unloaded directory, or
+    // lists the children of a directory entry without loading them
+    function<void(TreeNode*)> childLoader;
+    function<void(uint32_t, vector<DiskChild>&)> childLister;
+    uint32_t accessClock;
+    size_t nodeCount;
+    
+    DentryCache pathCache;
+    
+    // bytes per block less the next pointer, for the blocks in usage rollups
+    uint32_t usableBlockSize;
+    
+    // built by the first name search, kept in step with the loaded tree after
+    NameIndex* nameIndex;
+    size_t unloadedCount;       // loaded nodes that are directories with children still on disk
+    
+    // owner and modification time of every live entry, loaded or not
+    AttributeIndex attributes;
+    
+    // adds a change to (or takes it from) every directory from dir up
+    // whose usage is known; the others work it out when asked
+    void propagateUsage(TreeNode* dir, const DirectoryUsage& change, bool added) {
+        for (; dir; dir = dir->parent) {
+            DirectoryUsage usage;
+            if (!dir->children.getUsage(usage, dir->childrenLoaded)) continue;
+            
+            if (added) {
+                usage.add(change);
+            } else {
+                usage.subtract(change);
             }
-            start = end + 1;
-            end = path.find('/', start);
+            dir->children.setUsage(usage);
         }
-        
-        if (start < path.length()) {
-            parts.push_back(path.substr(start));
+    }
+    
+    void forgetUsage(TreeNode* dir) {
+        for (; dir; dir = dir->parent) {
+            dir->children.forgetUsage();
         }
-        
-        return parts;
+    }
+    
+    // only paths spelled one way are cached, so a node has a single key
+    // that can be erased when it goes away
+    static bool isCanonicalPath(string_view path) {
+        if (path.size() < 2 || path[0] != '/' || path.back() == '/') {
+            return false;
+        }
+        return path.find("//") == string_view::npos;
     }
     
 public:
-    FileTree() {
+    FileTree() : accessClock(0), nodeCount(1), usableBlockSize(0), nameIndex(nullptr), unloadedCount(0) {
         root = new TreeNode("/", false);
         root->entryIndex = 1;
-        root->owner = "admin";
+        root->setOwner("admin");
         root->permissions = 0755;
         root->created_time = time(nullptr);
         root->modified_time = root->created_time;
     }
     
     ~FileTree() {
+        delete nameIndex;
         delete root;
     }
     
@@ -141,39 +698,203 @@ public:
         return root;
     }
     
-    TreeNode* findNode(const string& path) {
+    void setChildLoader(function<void(TreeNode*)> loader) {
+        childLoader = loader;
+    }
+    
+    void setChildLister(function<void(uint32_t, vector<DiskChild>&)> lister) {
+        childLister = lister;
+    }
+    
+    // materializes a directory's children if they are still on disk
+    void loadChildren(TreeNode* node) {
+        if (node->isFile || node->childrenLoaded) return;
+        
+        node->childrenLoaded = true;
+        if (unloadedCount > 0) unloadedCount--;
+        
+        if (childLoader) {
+            size_t before = node->children.size();
+            childLoader(node);
+            nodeCount += node->children.size() - before;
+            
+            for (size_t i = before; i < node->children.size(); i++) {
+                TreeNode* child = node->children[i];
+                if (!child->isFile && !child->childrenLoaded) unloadedCount++;
+                if (nameIndex) nameIndex->add(child);
+            }
+        }
+    }
+    
+    // nodes currently in memory, root included
+    size_t getNodeCount() {
+        return nodeCount;
+    }
+    
+    void recountNodes() {
+        unloadedCount = 0;
+        nodeCount = countLoaded(root, unloadedCount);
+    }
+    
+    DentryCache& getPathCache() {
+        return pathCache;
+    }
+    
+    void setUsableBlockSize(uint32_t bytes) {
+        usableBlockSize = bytes;
+    }
+    
+    // a directory's rollup. Worked out the first time it is asked for
+    // (loading whatever is still on disk below it), then kept up to date by
+    // every create, delete, rename and size change under it.
+    DirectoryUsage getUsage(TreeNode* dir) {
+        DirectoryUsage usage;
+        if (dir->children.getUsage(usage, dir->childrenLoaded)) return usage;
+        
+        loadChildren(dir);
+        usage = DirectoryUsage();
+        for (size_t i = 0; i < dir->children.size(); i++) {
+            usage.add(getContribution(dir->children[i]));
+        }
+        dir->children.setUsage(usage);
+        return usage;
+    }
+    
+    // what a node adds to the usage of every directory above it
+    DirectoryUsage getContribution(TreeNode* node) {
+        DirectoryUsage usage;
+        if (node->isFile) {
+            usage.bytes = node->size;
+            usage.files = 1;
+            if (usableBlockSize > 0 && node->size > 0) {
+                usage.blocks = (node->size + usableBlockSize - 1) / usableBlockSize;
+            }
+        } else {
+            usage = getUsage(node);
+            usage.directories++;
+        }
+        return usage;
+    }
+    
+    void setFileSize(TreeNode* node, uint64_t size) {
+        propagateUsage(node->parent, getContribution(node), false);
+        node->setSize(size);
+        propagateUsage(node->parent, getContribution(node), true);
+    }
+    
+    void setModifiedTime(TreeNode* node, uint64_t value) {
+        node->setModifiedTime(value);
+        attributes.setModifiedTime(node->entryIndex, value);
+    }
+    
+    AttributeIndex& getAttributeIndex() {
+        return attributes;
+    }
+    
+    // records a node in the attribute index once it has its entry
+    void indexEntry(TreeNode* node) {
+        attributes.put(node->entryIndex, node->parent ? node->parent->entryIndex : 0,
+                       node->ownerId, node->modified_time);
+    }
+    
+    // indexes every loaded node afresh; only complete with the whole tree in memory
+    void rebuildAttributeIndex() {
+        attributes.clear();
+        
+        vector<TreeNode*> stack(1, root);
+        while (!stack.empty()) {
+            TreeNode* node = stack.back();
+            stack.pop_back();
+            
+            indexEntry(node);
+            for (size_t i = 0; i < node->children.size(); i++) {
+                stack.push_back(node->children[i]);
+            }
+        }
+    }
+    
+    // the nodes of indexed entries (nullptr where one can't be reached),
+    // loading the directories on the way down to them. Each directory's
+    // children are scanned once per call, however many entries are in it.
+    vector<TreeNode*> resolveEntries(const vector<uint32_t>& entries) {
+        vector<TreeNode*> nodes(entries.size(), nullptr);
+        unordered_map<uint32_t, TreeNode*> seen;
+        unordered_set<TreeNode*> scanned;
+        seen[root->entryIndex] = root;
+        
+        for (size_t i = 0; i < entries.size(); i++) {
+            // climb until a node already known, then come back down
+            vector<uint32_t> chain;
+            uint32_t entry = entries[i];
+            TreeNode* node = nullptr;
+            while (attributes.contains(entry) && chain.size() <= attributes.getEntryCount()) {
+                unordered_map<uint32_t, TreeNode*>::iterator known = seen.find(entry);
+                if (known != seen.end()) {
+                    node = known->second;
+                    break;
+                }
+                chain.push_back(entry);
+                entry = attributes.getParent(entry);
+            }
+            
+            for (size_t j = chain.size(); j > 0 && node; j--) {
+                if (node->isFile) {
+                    node = nullptr;
+                    break;
+                }
+                if (scanned.insert(node).second) {
+                    loadChildren(node);
+                    for (size_t k = 0; k < node->children.size(); k++) {
+                        seen[node->children[k]->entryIndex] = node->children[k];
+                    }
+                }
+                
+                unordered_map<uint32_t, TreeNode*>::iterator child = seen.find(chain[j - 1]);
+                node = (child != seen.end() && child->second->parent == node) ? child->second : nullptr;
+            }
+            
+            nodes[i] = node;
+        }
+        
+        return nodes;
+    }
+    
+    // allocates nothing unless the path is new to the path cache
+    TreeNode* findNode(string_view path) {
         if (path == "/" || path.empty()) {
             return root;
         }
         
-        vector<string> parts = splitPath(path);
+        accessClock++;
+        
+        bool cacheable = isCanonicalPath(path);
+        TreeNode* cached = nullptr;
+        if (cacheable && pathCache.lookup(path, cached)) {
+            if (cached) cached->touch(accessClock);
+            return cached;
+        }
+        
         TreeNode* current = root;
+        size_t pos = 0;
         
-        for (size_t i = 0; i < parts.size(); i++) {
-            if (parts[i].empty()) continue;
-            current = current->findChild(parts[i]);
-            if (current == nullptr) return nullptr;
+        for (string_view part = nextPathComponent(path, pos); !part.empty() && current;
+             part = nextPathComponent(path, pos)) {
+            loadChildren(current);
+            current->touch(accessClock);
+            current = current->findChild(part);
         }
         
+        if (current) current->touch(accessClock);
+        if (cacheable) pathCache.insert(path, current);
         return current;
     }
     
-    TreeNode* createNode(const string& path, bool isFile, const string& owner) {
-        if (path == "/") return nullptr; 
-        
-        size_t lastSlash = path.find_last_of('/');
-        string parentPath;
-        string name;
-        
-        if (lastSlash == 0) {
-            parentPath = "/";
-            name = path.substr(1);
-        } else {
-            parentPath = path.substr(0, lastSlash);
-            name = path.substr(lastSlash + 1);
-        }
+    TreeNode* createNode(string_view path, bool isFile, string_view owner) {
+        string_view parentPath;
+        string_view name;
+        splitParentPath(path, parentPath, name);
         
-        if (name.empty() || name.find('/') != string::npos) {
+        if (name.empty()) {
             return nullptr;
         }
         
@@ -181,10 +902,11 @@ public:
         if (parent == nullptr) return nullptr;
         if (parent->isFile) return nullptr;
         
+        loadChildren(parent);
         if (parent->findChild(name)) return nullptr;
         
         TreeNode* newNode = new TreeNode(name, isFile);
-        newNode->owner = owner;
+        newNode->setOwner(owner);
         newNode->created_time = time(nullptr);
         newNode->modified_time = newNode->created_time;
         
@@ -195,25 +917,37 @@ public:
         }
         
         parent->addChild(newNode);
-        parent->modified_time = time(nullptr);
+        setModifiedTime(parent, time(nullptr));
+        propagateUsage(parent, getContribution(newNode), true);
+        if (nameIndex) nameIndex->add(newNode);
+        nodeCount++;
+        pathCache.erase(newNode->getFullPath());
         
         return newNode;
     }
     
-    bool deleteNode(const string& path) {
-        if (path == "/") return false; 
-        
+    bool deleteNode(string_view path) {
         TreeNode* node = findNode(path);
-        if (node == nullptr) return false;
+        if (node == nullptr || node == root) return false;
         
+        loadChildren(node);
         if (!node->isFile && !node->children.empty()) {
             return false;
         }
         
         if (node->parent) {
-            bool removed = node->parent->removeChild(node);
+            // nothing below an empty directory is cached as existing
+            string cachedPath = node->getFullPath();
+            TreeNode* parent = node->parent;
+            DirectoryUsage contribution = getContribution(node);
+            bool removed = parent->removeChild(node);
             if (removed) {
+                propagateUsage(parent, contribution, false);
+                if (nameIndex) nameIndex->remove(node);
+                attributes.erase(node->entryIndex);
+                pathCache.erase(cachedPath);
                 delete node;
+                nodeCount--;
                 return true;
             }
         }
@@ -221,91 +955,224 @@ public:
         return false;
     }
     
-    vector<FileEntry> listDirectory(const string& path) {
+    // every node at and below node, parents before children, loading any
+    // directory still on disk
+    vector<TreeNode*> getSubtree(TreeNode* node) {
+        vector<TreeNode*> nodes;
+        vector<TreeNode*> stack(1, node);
+        
+        while (!stack.empty()) {
+            TreeNode* current = stack.back();
+            stack.pop_back();
+            nodes.push_back(current);
+            
+            loadChildren(current);
+            for (size_t i = current->children.size(); i > 0; i--) {
+                stack.push_back(current->children[i - 1]);
+            }
+        }
+        
+        return nodes;
+    }
+    
+    // unlinks a directory and frees it with everything below it; the caller
+    // has loaded the whole subtree (getSubtree) so nothing is left on disk
+    bool deleteTree(TreeNode* dir) {
+        if (dir == nullptr || dir == root || dir->isFile || !dir->parent) return false;
+        
+        TreeNode* parent = dir->parent;
+        DirectoryUsage contribution = getContribution(dir);
+        string cachedPath = dir->getFullPath();
+        if (!parent->removeChild(dir)) return false;
+        propagateUsage(parent, contribution, false);
+        
+        size_t unloadedBelow = 0;
+        size_t removed = countLoaded(dir, unloadedBelow);
+        if (nameIndex) {
+            unindexBelow(dir);
+            nameIndex->remove(dir);
+        }
+        
+        vector<TreeNode*> stack(1, dir);
+        while (!stack.empty()) {
+            TreeNode* node = stack.back();
+            stack.pop_back();
+            attributes.erase(node->entryIndex);
+            for (size_t i = 0; i < node->children.size(); i++) {
+                stack.push_back(node->children[i]);
+            }
+        }
+        
+        // every path below it may be cached
+        pathCache.eraseBelow(cachedPath);
+        nodeCount -= removed;
+        unloadedCount -= min(unloadedCount, unloadedBelow);
+        delete dir;
+        
+        return true;
+    }
+    
+    // the FileEntry a listing reports for a node
+    static void fillListEntry(const TreeNode* child, FileEntry& entry) {
+        memset(&entry, 0, sizeof(FileEntry));
+        
+        strncpy(entry.name, child->name.c_str(), sizeof(entry.name) - 1);
+        entry.name[sizeof(entry.name) - 1] = '\0';
+        
+        if (child->isFile) {
+            entry.setType(EntryType::FILE);
+        } else {
+            entry.setType(EntryType::DIRECTORY);
+        }
+        
+        entry.size = child->size;
+        entry.permissions = child->permissions;
+        entry.inode = child->entryIndex;
+        entry.created_time = child->created_time;
+        entry.modified_time = child->modified_time;
+        
+        strncpy(entry.owner, child->getOwner().c_str(), sizeof(entry.owner) - 1);
+        entry.owner[sizeof(entry.owner) - 1] = '\0';
+    }
+    
+    vector<FileEntry> listDirectory(string_view path) {
         vector<FileEntry> entries;
         
         TreeNode* dir = findNode(path);
         if (dir == nullptr || dir->isFile) return entries;
         
+        loadChildren(dir);
+        entries.resize(dir->children.size());
         for (size_t i = 0; i < dir->children.size(); i++) {
-            TreeNode* child = dir->children[i];
-            FileEntry entry;
-            
-            memset(&entry, 0, sizeof(FileEntry));
-            
-            strncpy(entry.name, child->name.c_str(), sizeof(entry.name) - 1);
-            entry.name[sizeof(entry.name) - 1] = '\0';
+            fillListEntry(dir->children[i], entries[i]);
+        }
+        
+        return entries;
+    }
+    
+    // fills up to limit entries following the cursor and advances it. The
+    // sorted orders resume after the cursor's last (key, name), so entries
+    // added or removed between pages don't shift the rest; listing order
+    // resumes by position.
+    uint32_t listPage(TreeNode* dir, DirListCursor& cursor, FileEntry* entries, uint32_t limit) {
+        loadChildren(dir);
+        uint32_t order = cursor.sort_key;
+        
+        const TreeNode* const* list = dir->children.begin();
+        size_t total = dir->children.size();
+        size_t start = min((size_t)cursor.position, total);
+        
+        if (order != DIR_LIST_SORT_NONE) {
+            const vector<TreeNode*>& sorted = dir->getChildOrder(order);
+            list = sorted.data();
+            total = sorted.size();
             
-            if (child->isFile) {
-                entry.setType(EntryType::FILE);
-            } else {
-                entry.setType(EntryType::DIRECTORY);
+            start = 0;
+            if (cursor.position > 0) {
+                uint64_t key = cursor.last_key;
+                string_view name(cursor.last_name, strnlen(cursor.last_name, sizeof(cursor.last_name)));
+                start = upper_bound(sorted.begin(), sorted.end(), nullptr,
+                    [order, key, name](const TreeNode*, const TreeNode* element) {
+                        return childOrderLess(key, name,
+                                              getChildOrderKey(element, order), element->name);
+                    }) - sorted.begin();
             }
-            
-            entry.size = child->size;
-            entry.permissions = child->permissions;
-            entry.inode = child->entryIndex;
-            entry.created_time = child->created_time;
-            entry.modified_time = child->modified_time;
-            
-            strncpy(entry.owner, child->owner.c_str(), sizeof(entry.owner) - 1);
-            entry.owner[sizeof(entry.owner) - 1] = '\0';
-            
-            entries.push_back(entry);
         }
         
-        return entries;
+        uint32_t count = 0;
+        while (count < limit && start + count < total) {
+            fillListEntry(list[start + count], entries[count]);
+            count++;
+        }
+        
+        if (count > 0) {
+            const TreeNode* last = list[start + count - 1];
+            cursor.last_key = getChildOrderKey(last, order);
+            memset(cursor.last_name, 0, sizeof(cursor.last_name));
+            strncpy(cursor.last_name, last->name.c_str(), sizeof(cursor.last_name) - 1);
+        }
+        cursor.position += count;
+        cursor.done = (start + count >= total) ? 1 : 0;
+        
+        return count;
     }
     
-    bool exists(const string& path) {
+    bool exists(string_view path) {
         return findNode(path) != nullptr;
     }
     
-    bool isFile(const string& path) {
+    bool isFile(string_view path) {
         TreeNode* node = findNode(path);
         return node != nullptr && node->isFile;
     }
     
-    bool isDirectory(const string& path) {
+    bool isDirectory(string_view path) {
         TreeNode* node = findNode(path);
         return node != nullptr && !node->isFile;
     }
     
-    bool rename(const string& oldPath, const string& newPath) {
+    bool rename(string_view oldPath, string_view newPath) {
         TreeNode* oldNode = findNode(oldPath);
-        if (oldNode == nullptr || oldPath == "/") return false;
+        if (oldNode == nullptr || oldNode == root) return false;
         
-        size_t lastSlash = newPath.find_last_of('/');
-        string newParentPath;
-        string newName;
+        string_view newParentPath;
+        string_view newName;
+        splitParentPath(newPath, newParentPath, newName);
         
-        if (lastSlash == 0) {
-            newParentPath = "/";
-            newName = newPath.substr(1);
-        } else {
-            newParentPath = newPath.substr(0, lastSlash);
-            newName = newPath.substr(lastSlash + 1);
-        }
-        
-        if (newName.empty() || newName.find('/') != string::npos) {
+        if (newName.empty()) {
             return false;
         }
         
         TreeNode* newParent = findNode(newParentPath);
         if (newParent == nullptr || newParent->isFile) return false;
         
+        loadChildren(newParent);
         if (newParent->findChild(newName)) return false;
         
+        // a moved directory takes every cached path below it along
+        if (oldNode->isFile) {
+            pathCache.erase(oldNode->getFullPath());
+        } else {
+            pathCache.eraseBelow(oldNode->getFullPath());
+        }
+        
+        // a directory whose usage was never worked out isn't loaded just to
+        // move it; the directories on both sides work theirs out again
+        DirectoryUsage contribution;
+        bool counted = oldNode->isFile || oldNode->children.getUsage(contribution, oldNode->childrenLoaded);
+        if (counted) {
+            contribution = getContribution(oldNode);
+        }
+        
         TreeNode* oldParent = oldNode->parent;
         if (oldParent) {
             oldParent->removeChild(oldNode);
-            oldParent->modified_time = time(nullptr);
+            setModifiedTime(oldParent, time(nullptr));
+            if (counted) {
+                propagateUsage(oldParent, contribution, false);
+            } else {
+                forgetUsage(oldParent);
+            }
         }
         
+        if (nameIndex) nameIndex->remove(oldNode);
         oldNode->name = newName;
+        if (nameIndex) nameIndex->add(oldNode);
         newParent->addChild(oldNode);
-        newParent->modified_time = time(nullptr);
-        oldNode->modified_time = time(nullptr);
+        attributes.setParent(oldNode->entryIndex, newParent->entryIndex);
+        if (counted) {
+            propagateUsage(newParent, contribution, true);
+        } else {
+            forgetUsage(newParent);
+        }
+        setModifiedTime(newParent, time(nullptr));
+        setModifiedTime(oldNode, time(nullptr));
+        // and paths below its new name may be cached as missing
+        if (oldNode->isFile) {
+            pathCache.erase(oldNode->getFullPath());
+        } else {
+            pathCache.eraseBelow(oldNode->getFullPath());
+        }
         
         return true;
     }
@@ -316,7 +1183,195 @@ public:
         countNodes(root, fileCount, dirCount);
     }
     
+    // nodes below dir whose names match the pattern (see nameMatches). The
+    // name index is built by the first search and covers the loaded tree;
+    // directories still on disk are searched through their child lists,
+    // and only the directories leading to a match are loaded.
+    vector<TreeNode*> findByName(TreeNode* dir, string_view pattern) {
+        // without a lister the subtree can only be searched loaded
+        if (unloadedCount > 0 && !childLister) {
+            vector<TreeNode*> stack(1, dir);
+            while (!stack.empty()) {
+                TreeNode* node = stack.back();
+                stack.pop_back();
+                if (node->isFile) continue;
+                
+                loadChildren(node);
+                for (size_t i = 0; i < node->children.size(); i++) {
+                    stack.push_back(node->children[i]);
+                }
+            }
+        }
+        
+        if (!nameIndex) {
+            nameIndex = new NameIndex();
+            indexBelow(root);
+        }
+        
+        vector<TreeNode*> matches = nameIndex->find(pattern);
+        vector<TreeNode*> below;
+        if (dir == root) {
+            below.swap(matches);
+        } else {
+            for (size_t i = 0; i < matches.size(); i++) {
+                for (TreeNode* up = matches[i]->parent; up; up = up->parent) {
+                    if (up == dir) {
+                        below.push_back(matches[i]);
+                        break;
+                    }
+                }
+            }
+        }
+        
+        if (unloadedCount > 0 && childLister) {
+            vector<uint32_t> onDisk = findUnloadedByName(dir, pattern);
+            vector<TreeNode*> nodes = resolveEntries(onDisk);
+            for (size_t i = 0; i < nodes.size(); i++) {
+                if (nodes[i]) below.push_back(nodes[i]);
+            }
+        }
+        return below;
+    }
+    
+    // entry indexes of matching names in the unloaded directories below
+    // dir, read through the child lister
+    vector<uint32_t> findUnloadedByName(TreeNode* dir, string_view pattern) {
+        vector<uint32_t> found;
+        vector<uint32_t> pending;
+        
+        vector<TreeNode*> stack(1, dir);
+        while (!stack.empty()) {
+            TreeNode* node = stack.back();
+            stack.pop_back();
+            if (node->isFile) continue;
+            
+            if (!node->childrenLoaded) {
+                pending.push_back(node->entryIndex);
+                continue;
+            }
+            for (size_t i = 0; i < node->children.size(); i++) {
+                stack.push_back(node->children[i]);
+            }
+        }
+        
+        // each directory at most once, even if a bad list loops back
+        unordered_set<uint32_t> visited(pending.begin(), pending.end());
+        vector<DiskChild> children;
+        while (!pending.empty()) {
+            uint32_t entry = pending.back();
+            pending.pop_back();
+            
+            children.clear();
+            childLister(entry, children);
+            for (size_t i = 0; i < children.size(); i++) {
+                if (nameMatches(pattern, children[i].name)) {
+                    found.push_back(children[i].entryIndex);
+                }
+                if (children[i].isDirectory && visited.insert(children[i].entryIndex).second) {
+                    pending.push_back(children[i].entryIndex);
+                }
+            }
+        }
+        
+        return found;
+    }
+    
+    // drops the children of the least recently used directories until at
+    // most target nodes are loaded; pinned directories (and so everything
+    // above them) are kept. Returns the number of nodes dropped.
+    size_t evictColdDirectories(size_t target, const unordered_set<TreeNode*>& pinned) {
+        if (nodeCount <= target) return 0;
+        
+        // a directory is as warm as the most recent access anywhere below it
+        vector<ColdCandidate> candidates;
+        collectCandidates(root, 0, candidates);
+        
+        // colder first, and deeper first among equals so a directory is
+        // never visited after an ancestor that already freed it
+        sort(candidates.begin(), candidates.end(),
+             [](const ColdCandidate& a, const ColdCandidate& b) {
+                 if (a.lastAccess != b.lastAccess) return a.lastAccess < b.lastAccess;
+                 return a.depth > b.depth;
+             });
+        
+        size_t dropped = 0;
+        for (size_t i = 0; i < candidates.size() && nodeCount > target; i++) {
+            TreeNode* dir = candidates[i].node;
+            if (dir == root || pinned.count(dir) || !dir->childrenLoaded) continue;
+            
+            size_t unloadedBelow = 0;
+            size_t freed = countLoaded(dir, unloadedBelow) - 1;
+            if (nameIndex) unindexBelow(dir);
+            DirectoryUsage usage;
+            bool usageKnown = dir->children.getUsage(usage, true);
+            dir->clearChildren();
+            if (usageKnown) {
+                dir->children.setUsage(usage);
+            }
+            dir->childrenLoaded = false;
+            
+            unloadedCount = unloadedCount - unloadedBelow + 1;
+            nodeCount -= freed;
+            dropped += freed;
+        }
+        
+        if (dropped > 0) {
+            pathCache.invalidateAll();
+        }
+        
+        return dropped;
+    }
+    
 private:
+    struct ColdCandidate {
+        TreeNode* node;
+        uint32_t lastAccess;
+        uint32_t depth;
+    };
+    
+    // returns the most recent access in the subtree
+    uint32_t collectCandidates(TreeNode* node, uint32_t depth, vector<ColdCandidate>& candidates) {
+        if (node->isFile) return 0;
+        uint32_t latest = node->children.getLastAccess();
+        
+        for (size_t i = 0; i < node->children.size(); i++) {
+            latest = max(latest, collectCandidates(node->children[i], depth + 1, candidates));
+        }
+        
+        if (!node->children.empty()) {
+            ColdCandidate candidate;
+            candidate.node = node;
+            candidate.lastAccess = latest;
+            candidate.depth = depth;
+            candidates.push_back(candidate);
+        }
+        return latest;
+    }
+    
+    size_t countLoaded(TreeNode* node, size_t& unloaded) {
+        if (!node->isFile && !node->childrenLoaded) unloaded++;
+        
+        size_t count = 1;
+        for (size_t i = 0; i < node->children.size(); i++) {
+            count += countLoaded(node->children[i], unloaded);
+        }
+        return count;
+    }
+    
+    void indexBelow(TreeNode* dir) {
+        for (size_t i = 0; i < dir->children.size(); i++) {
+            nameIndex->add(dir->children[i]);
+            indexBelow(dir->children[i]);
+        }
+    }
+    
+    void unindexBelow(TreeNode* dir) {
+        for (size_t i = 0; i < dir->children.size(); i++) {
+            unindexBelow(dir->children[i]);
+            nameIndex->remove(dir->children[i]);
+        }
+    }
+    
     void countNodes(TreeNode* node, uint32_t& fileCount, uint32_t& dirCount) {
         if (node == nullptr) return;
         
@@ -5,9 +5,30 @@
 #include <cstdint>
 #include <algorithm>
 #include <iostream>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "../include/checksum.h"
 
 using namespace std;
 
+#define FREE_SPACE_SNAPSHOT_MAGIC "OFSM"
+#define FREE_SPACE_SNAPSHOT_VERSION 2
+#define DEFAULT_ALLOCATION_GROUP_BLOCKS 8192
+
+// Header of the free space snapshot stored after the content block area
+struct FreeSpaceSnapshotHeader {
+    char magic[4];              // "OFSM"
+    uint32_t version;           // FREE_SPACE_SNAPSHOT_VERSION
+    uint32_t totalBlocks;
+    uint32_t freeBlocks;
+    uint32_t segmentCount;
+    uint32_t payloadSize;       // Bytes of varint data following the header
+    uint32_t payloadChecksum;   // CRC-32 of the payload
+    uint32_t headerChecksum;    // CRC-32 of this header with this field zeroed
+};  // Total: 32 bytes
+
 struct FreeSegment {
     uint32_t startBlock;
     uint32_t blockCount;
@@ -26,101 +47,448 @@ struct FreeSegment {
     }
 };
 
+// A fixed range of the content area with its own sorted free segment list
+// and lock, so allocations in different groups never wait on each other
+struct AllocationGroup {
+    uint32_t firstBlock;
+    uint32_t blockCount;
+    uint32_t freeBlocks;
+    vector<FreeSegment> segments;   // sorted by startBlock, never adjacent
+    mutex lock;
+
+    AllocationGroup(uint32_t first, uint32_t count)
+        : firstBlock(first), blockCount(count), freeBlocks(0) {}
+
+    // first fit inside this group, caller holds the lock
+    bool takeContiguous(uint32_t count, vector<uint32_t>& out) {
+        for (size_t i = 0; i < segments.size(); i++) {
+            FreeSegment& segment = segments[i];
+            if (segment.blockCount < count) continue;
+
+            for (uint32_t b = 0; b < count; b++) {
+                out.push_back(segment.startBlock + b);
+            }
+
+            if (segment.blockCount == count) {
+                segments.erase(segments.begin() + i);
+            } else {
+                segment.startBlock += count;
+                segment.blockCount -= count;
+            }
+            freeBlocks -= count;
+            return true;
+        }
+        return false;
+    }
+
+    // takes up to count blocks from the front segments, caller holds the lock
+    uint32_t takeAny(uint32_t count, vector<uint32_t>& out) {
+        uint32_t taken = 0;
+        while (taken < count && !segments.empty()) {
+            FreeSegment& segment = segments.front();
+            uint32_t use = min(count - taken, segment.blockCount);
+
+            for (uint32_t b = 0; b < use; b++) {
+                out.push_back(segment.startBlock + b);
+            }
+
+            if (use == segment.blockCount) {
+                segments.erase(segments.begin());
+            } else {
+                segment.startBlock += use;
+                segment.blockCount -= use;
+            }
+            taken += use;
+        }
+        freeBlocks -= taken;
+        return taken;
+    }
+
+    // inserts a run that lies entirely inside this group, merging with
+    // its neighbours; caller holds the lock
+    void insertRun(uint32_t start, uint32_t count) {
+        vector<FreeSegment>::iterator next = lower_bound(
+            segments.begin(), segments.end(), start,
+            [](const FreeSegment& seg, uint32_t value) { return seg.startBlock < value; });
+
+        bool mergeLeft = next != segments.begin() &&
+                         (next - 1)->endBlock() + 1 == start;
+        bool mergeRight = next != segments.end() &&
+                          start + count == next->startBlock;
+
+        if (mergeLeft && mergeRight) {
+            (next - 1)->blockCount += count + next->blockCount;
+            segments.erase(next);
+        } else if (mergeLeft) {
+            (next - 1)->blockCount += count;
+        } else if (mergeRight) {
+            next->startBlock = start;
+            next->blockCount += count;
+        } else {
+            segments.insert(next, FreeSegment(start, count));
+        }
+        freeBlocks += count;
+    }
+
+    // removes count blocks from the front of the segment starting at start,
+    // caller holds the lock
+    void takeFromSegmentStart(uint32_t start, uint32_t count) {
+        for (size_t i = 0; i < segments.size(); i++) {
+            if (segments[i].startBlock != start) continue;
+
+            if (segments[i].blockCount == count) {
+                segments.erase(segments.begin() + i);
+            } else {
+                segments[i].startBlock += count;
+                segments[i].blockCount -= count;
+            }
+            freeBlocks -= count;
+            return;
+        }
+    }
+
+    // the segment holding all of start..start+count-1, or end(); caller
+    // holds the lock
+    vector<FreeSegment>::iterator segmentHolding(uint32_t start, uint32_t count) {
+        vector<FreeSegment>::iterator it = upper_bound(
+            segments.begin(), segments.end(), start,
+            [](uint32_t value, const FreeSegment& seg) { return value < seg.startBlock; });
+        if (it == segments.begin()) return segments.end();
+        --it;
+        if (start + count - 1 > it->endBlock()) return segments.end();
+        return it;
+    }
+
+    // takes start..start+count-1, which segmentHolding has found free,
+    // splitting its segment; caller holds the lock
+    void takeRange(uint32_t start, uint32_t count) {
+        vector<FreeSegment>::iterator it = segmentHolding(start, count);
+        if (it == segments.end()) return;
+
+        FreeSegment after(start + count, it->endBlock() - (start + count - 1));
+        if (start == it->startBlock) {
+            it = segments.erase(it);
+        } else {
+            it->blockCount = start - it->startBlock;
+            ++it;
+        }
+        if (after.blockCount > 0) {
+            segments.insert(it, after);
+        }
+        freeBlocks -= count;
+    }
+
+    bool contains(uint32_t blockIndex) const {
+        vector<FreeSegment>::const_iterator it = upper_bound(
+            segments.begin(), segments.end(), blockIndex,
+            [](uint32_t value, const FreeSegment& seg) { return value < seg.startBlock; });
+        if (it == segments.begin()) return false;
+        --it;
+        return blockIndex <= it->endBlock();
+    }
+};
+
 class FreeSpaceManager {
 private:
-    vector<FreeSegment> freeSegments;
+    vector<unique_ptr<AllocationGroup>> groups;
     uint32_t totalBlocks;
-    uint32_t freeBlocks;
+    uint32_t blocksPerGroup;
+    atomic<uint32_t> freeBlocks;
+
+    void buildGroups() {
+        groups.clear();
+        for (uint32_t first = 0; first < totalBlocks; first += blocksPerGroup) {
+            uint32_t count = min(blocksPerGroup, totalBlocks - first);
+            groups.push_back(unique_ptr<AllocationGroup>(new AllocationGroup(first, count)));
+        }
+    }
 
-    static bool compareSegments(const FreeSegment& a, const FreeSegment& b) {
-    return a.startBlock < b.startBlock;
+    uint32_t groupOf(uint32_t blockIndex) const {
+        return blockIndex / blocksPerGroup;
     }
 
-    void sortSegments() {
-        sort(freeSegments.begin(), freeSegments.end(), compareSegments);
+    // adds a free run that may span several groups
+    void addFreeRange(uint32_t start, uint32_t count) {
+        while (count > 0) {
+            AllocationGroup& group = *groups[groupOf(start)];
+            uint32_t groupEnd = group.firstBlock + group.blockCount;
+            uint32_t part = min(count, groupEnd - start);
+
+            lock_guard<mutex> guard(group.lock);
+            group.insertRun(start, part);
+            freeBlocks += part;
+
+            start += part;
+            count -= part;
+        }
     }
 
+    // contiguous run crossing group boundaries, for requests larger than
+    // any single group can hold; locks every group in order
+    bool takeSpanning(uint32_t count, vector<uint32_t>& out) {
+        vector<unique_lock<mutex>> locks;
+        for (size_t g = 0; g < groups.size(); g++) {
+            locks.push_back(unique_lock<mutex>(groups[g]->lock));
+        }
 
-    void mergeAdjacentSegments() {
-        if (freeSegments.size() <= 1) return;
+        uint32_t runStart = 0;
+        uint32_t runLength = 0;
+        bool found = false;
+
+        for (size_t g = 0; g < groups.size() && !found; g++) {
+            const vector<FreeSegment>& segments = groups[g]->segments;
+            for (size_t i = 0; i < segments.size(); i++) {
+                if (runLength > 0 && runStart + runLength == segments[i].startBlock) {
+                    runLength += segments[i].blockCount;
+                } else {
+                    runStart = segments[i].startBlock;
+                    runLength = segments[i].blockCount;
+                }
+
+                if (runLength >= count) {
+                    found = true;
+                    break;
+                }
+            }
+        }
 
-        sortSegments();
+        if (!found) return false;
 
-        vector<FreeSegment> merged;
-        merged.push_back(freeSegments[0]);
+        uint32_t block = runStart;
+        uint32_t remaining = count;
+        while (remaining > 0) {
+            AllocationGroup& group = *groups[groupOf(block)];
+            uint32_t part = min(remaining, group.firstBlock + group.blockCount - block);
 
-        for (size_t i = 1; i < freeSegments.size(); i++) {
-            FreeSegment& last = merged.back();
-            FreeSegment& current = freeSegments[i];
+            group.takeFromSegmentStart(block, part);
+            for (uint32_t b = 0; b < part; b++) {
+                out.push_back(block + b);
+            }
 
-            if (last.endBlock() + 1 == current.startBlock) {
-                last.blockCount += current.blockCount;
-            } else {
-                merged.push_back(current);
+            block += part;
+            remaining -= part;
+        }
+
+        freeBlocks -= count;
+        return true;
+    }
+
+    // all free segments in block order, merged across group boundaries
+    vector<FreeSegment> collectSegments() {
+        vector<FreeSegment> all;
+        for (size_t g = 0; g < groups.size(); g++) {
+            lock_guard<mutex> guard(groups[g]->lock);
+            const vector<FreeSegment>& segments = groups[g]->segments;
+            for (size_t i = 0; i < segments.size(); i++) {
+                if (!all.empty() && all.back().endBlock() + 1 == segments[i].startBlock) {
+                    all.back().blockCount += segments[i].blockCount;
+                } else {
+                    all.push_back(segments[i]);
+                }
             }
         }
+        return all;
+    }
 
-        freeSegments = merged;
+    static void appendVarint(vector<uint8_t>& out, uint32_t value) {
+        while (value >= 0x80) {
+            out.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((uint8_t)value);
     }
 
-    int findSegmentForAllocation(uint32_t blocksNeeded) {
-        for (size_t i = 0; i < freeSegments.size(); i++) {
-            if (freeSegments[i].blockCount >= blocksNeeded) {
-                return i;
+    static bool readVarint(const uint8_t* data, size_t size, size_t& offset, uint32_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (offset >= size) return false;
+            uint8_t byte = data[offset++];
+            value |= (uint32_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false;
+    }
+
+    // Pre-snapshot format: 12 byte big-endian header followed by
+    // 8 bytes per segment. Still accepted so old containers keep mounting.
+    static FreeSpaceManager* deserializeLegacy(const vector<uint8_t>& data, uint32_t groupBlocks) {
+        if (data.size() < 12) return nullptr;
+
+        uint32_t totalBlocks = ((uint32_t)data[0] << 24) |
+                               ((uint32_t)data[1] << 16) |
+                               ((uint32_t)data[2] << 8) |
+                               (uint32_t)data[3];
+
+        uint32_t segCount = ((uint32_t)data[8] << 24) |
+                            ((uint32_t)data[9] << 16) |
+                            ((uint32_t)data[10] << 8) |
+                            (uint32_t)data[11];
+
+        FreeSpaceManager* manager = new FreeSpaceManager(totalBlocks, groupBlocks);
+        manager->clearGroups();
+
+        size_t offset = 12;
+        for (size_t i = 0; i < segCount; i++) {
+            if (offset + 8 > data.size()) break;
+
+            uint32_t startBlock = ((uint32_t)data[offset] << 24) |
+                                  ((uint32_t)data[offset + 1] << 16) |
+                                  ((uint32_t)data[offset + 2] << 8) |
+                                  (uint32_t)data[offset + 3];
+
+            uint32_t blockCount = ((uint32_t)data[offset + 4] << 24) |
+                                  ((uint32_t)data[offset + 5] << 16) |
+                                  ((uint32_t)data[offset + 6] << 8) |
+                                  (uint32_t)data[offset + 7];
+
+            if (startBlock != 0 && blockCount != 0 &&
+                (uint64_t)startBlock + blockCount <= totalBlocks) {
+                manager->addFreeRange(startBlock, blockCount);
             }
+            offset += 8;
+        }
+
+        return manager;
+    }
+
+    void clearGroups() {
+        for (size_t g = 0; g < groups.size(); g++) {
+            lock_guard<mutex> guard(groups[g]->lock);
+            groups[g]->segments.clear();
+            groups[g]->freeBlocks = 0;
         }
-        return -1;
+        freeBlocks = 0;
     }
 
 public:
-    FreeSpaceManager(uint32_t numBlocks)
-        : totalBlocks(numBlocks), freeBlocks(numBlocks - 1) {
+    FreeSpaceManager(uint32_t numBlocks, uint32_t groupBlocks = DEFAULT_ALLOCATION_GROUP_BLOCKS)
+        : totalBlocks(numBlocks),
+          blocksPerGroup(groupBlocks > 0 ? groupBlocks : DEFAULT_ALLOCATION_GROUP_BLOCKS),
+          freeBlocks(0) {
+        buildGroups();
+        clear();
+    }
 
-        if (numBlocks > 1) {
-            freeSegments.push_back(FreeSegment(1, numBlocks - 1));
+    // Builds a manager from a per-block usage map (true = used)
+    static FreeSpaceManager* fromUsageMap(const vector<bool>& used,
+                                          uint32_t groupBlocks = DEFAULT_ALLOCATION_GROUP_BLOCKS) {
+        FreeSpaceManager* manager = new FreeSpaceManager(used.size(), groupBlocks);
+        manager->clearGroups();
+
+        uint32_t block = 1;
+        while (block < used.size()) {
+            if (used[block]) {
+                block++;
+                continue;
+            }
+
+            uint32_t start = block;
+            while (block < used.size() && !used[block]) {
+                block++;
+            }
+            manager->addFreeRange(start, block - start);
         }
+
+        return manager;
+    }
+
+    uint32_t getGroupCount() const {
+        return groups.size();
     }
 
-    vector<uint32_t> allocateBlocks(uint32_t count) {
+    // Home group for files created inside the directory with this entry index,
+    // so siblings end up near each other on disk
+    uint32_t groupForDirectory(uint32_t dirEntryIndex) const {
+        if (groups.empty()) return 0;
+        return dirEntryIndex % groups.size();
+    }
+
+    // Contiguous allocation, trying the preferred group first
+    vector<uint32_t> allocateBlocks(uint32_t count, uint32_t preferredGroup = 0) {
         vector<uint32_t> allocatedBlocks;
 
-        if (count == 0 || count > freeBlocks) {
+        if (count == 0 || count > freeBlocks || groups.empty()) {
             return allocatedBlocks;
         }
 
-        int segmentIndex = findSegmentForAllocation(count);
+        allocatedBlocks.reserve(count);
+        for (size_t attempt = 0; attempt < groups.size(); attempt++) {
+            AllocationGroup& group = *groups[(preferredGroup + attempt) % groups.size()];
 
-        if (segmentIndex == -1) {
-            mergeAdjacentSegments();
-            segmentIndex = findSegmentForAllocation(count);
+            lock_guard<mutex> guard(group.lock);
+            if (group.freeBlocks < count) continue;
 
-            if (segmentIndex == -1) {
+            if (group.takeContiguous(count, allocatedBlocks)) {
+                freeBlocks -= count;
                 return allocatedBlocks;
             }
         }
 
-        FreeSegment& segment = freeSegments[segmentIndex];
+        takeSpanning(count, allocatedBlocks);
+        return allocatedBlocks;
+    }
+
+    // Gathers count blocks as a few runs when no single extent is large enough
+    vector<uint32_t> allocateRuns(uint32_t count, uint32_t preferredGroup = 0) {
+        vector<uint32_t> allocatedBlocks;
+
+        if (count == 0 || count > freeBlocks || groups.empty()) {
+            return allocatedBlocks;
+        }
+
+        allocatedBlocks.reserve(count);
+        for (size_t attempt = 0; attempt < groups.size() && allocatedBlocks.size() < count; attempt++) {
+            AllocationGroup& group = *groups[(preferredGroup + attempt) % groups.size()];
 
-        for (uint32_t i = 0; i < count; i++) {
-        uint32_t blockNum = segment.startBlock + i;
-        if (blockNum == 0) {
-            if (!allocatedBlocks.empty()) {
-                freeBlockSegments(allocatedBlocks);
-            }
-            return vector<uint32_t>(); 
+            lock_guard<mutex> guard(group.lock);
+            uint32_t taken = group.takeAny(count - allocatedBlocks.size(), allocatedBlocks);
+            freeBlocks -= taken;
+        }
+
+        if (allocatedBlocks.size() < count) {
+            freeBlockSegments(allocatedBlocks);
+            return vector<uint32_t>();
         }
-        allocatedBlocks.push_back(blockNum);
+
+        return allocatedBlocks;
     }
 
-        if (segment.blockCount == count) {
-            freeSegments.erase(freeSegments.begin() + segmentIndex);
-        } else {
-            segment.startBlock += count;
-            segment.blockCount -= count;
+    // exactly the blocks start..start+count-1, when every one is free, so a
+    // run can grow in place; empty otherwise
+    vector<uint32_t> allocateAt(uint32_t start, uint32_t count) {
+        vector<uint32_t> allocatedBlocks;
+
+        if (count == 0 || start == 0 || start >= totalBlocks || count > totalBlocks - start) {
+            return allocatedBlocks;
         }
 
-        freeBlocks -= count;
+        uint32_t end = start + count;
+        vector<unique_lock<mutex>> locks;
+        for (uint32_t g = groupOf(start); g <= groupOf(end - 1); g++) {
+            locks.push_back(unique_lock<mutex>(groups[g]->lock));
+        }
 
+        for (uint32_t block = start; block < end; ) {
+            AllocationGroup& group = *groups[groupOf(block)];
+            uint32_t part = min(end - block, group.firstBlock + group.blockCount - block);
+            if (group.segmentHolding(block, part) == group.segments.end()) {
+                return allocatedBlocks;
+            }
+            block += part;
+        }
+
+        allocatedBlocks.reserve(count);
+        for (uint32_t block = start; block < end; ) {
+            AllocationGroup& group = *groups[groupOf(block)];
+            uint32_t part = min(end - block, group.firstBlock + group.blockCount - block);
+            group.takeRange(block, part);
+            for (uint32_t b = 0; b < part; b++) {
+                allocatedBlocks.push_back(block + b);
+            }
+            block += part;
+        }
+
+        freeBlocks -= count;
         return allocatedBlocks;
     }
 
@@ -130,7 +498,7 @@ public:
             cerr << "WARNING: Attempt to free reserved block 0" << endl;
             return;
         }
-        
+
         vector<uint32_t> blocks = {blockIndex};
         freeBlockSegments(blocks);
     }
@@ -140,50 +508,50 @@ public:
 
         vector<uint32_t> sortedBlocks = blocks;
         sort(sortedBlocks.begin(), sortedBlocks.end());
+        sortedBlocks.erase(unique(sortedBlocks.begin(), sortedBlocks.end()), sortedBlocks.end());
 
         // Remove block 0 if accidentally included
         if (!sortedBlocks.empty() && sortedBlocks[0] == 0) {
             cerr << "WARNING: Removing reserved block 0 from free list" << endl;
             sortedBlocks.erase(sortedBlocks.begin());
         }
-        
+
+        while (!sortedBlocks.empty() && sortedBlocks.back() >= totalBlocks) {
+            sortedBlocks.pop_back();
+        }
+
+        // Ignore blocks that are already free so a repeated free can't
+        // inflate the counters
+        sortedBlocks.erase(remove_if(sortedBlocks.begin(), sortedBlocks.end(),
+                                     [this](uint32_t block) { return isFree(block); }),
+                           sortedBlocks.end());
+
         if (sortedBlocks.empty()) return;
 
-        vector<FreeSegment> newSegments;
         uint32_t segStart = sortedBlocks[0];
         uint32_t segCount = 1;
 
-        for (size_t i = 1; i < sortedBlocks.size(); i++) {
-            if (sortedBlocks[i] == sortedBlocks[i - 1] + 1) {
+        for (size_t i = 1; i <= sortedBlocks.size(); i++) {
+            if (i < sortedBlocks.size() && sortedBlocks[i] == sortedBlocks[i - 1] + 1) {
                 segCount++;
-            } else {
-                newSegments.push_back(FreeSegment(segStart, segCount));
+                continue;
+            }
+
+            addFreeRange(segStart, segCount);
+
+            if (i < sortedBlocks.size()) {
                 segStart = sortedBlocks[i];
                 segCount = 1;
             }
         }
-        newSegments.push_back(FreeSegment(segStart, segCount));
-
-        for (size_t i = 0; i < newSegments.size(); i++) {
-            freeSegments.push_back(newSegments[i]);
-        }
-
-        freeBlocks += sortedBlocks.size();
-
-        mergeAdjacentSegments();
     }
 
     bool isFree(uint32_t blockIndex) const {
-        if (blockIndex == 0) return false;
-        
-        for (size_t i = 0; i < freeSegments.size(); i++) {
-            const FreeSegment& seg = freeSegments[i];
-            if (blockIndex >= seg.startBlock &&
-                blockIndex <= seg.endBlock()) {
-                return true;
-            }
-        }
-        return false;
+        if (blockIndex == 0 || blockIndex >= totalBlocks) return false;
+
+        AllocationGroup& group = *groups[groupOf(blockIndex)];
+        lock_guard<mutex> guard(group.lock);
+        return group.contains(blockIndex);
     }
 
     bool isUsed(uint32_t blockIndex) const {
@@ -203,8 +571,25 @@ public:
         return totalBlocks - freeBlocks;
     }
 
+    // Number of free extents; a run split only by a group boundary counts once
     size_t getSegmentCount() const {
-        return freeSegments.size();
+        size_t count = 0;
+        bool previousEndsAtBoundary = false;
+
+        for (size_t g = 0; g < groups.size(); g++) {
+            lock_guard<mutex> guard(groups[g]->lock);
+            const AllocationGroup& group = *groups[g];
+
+            count += group.segments.size();
+            if (!group.segments.empty() && previousEndsAtBoundary &&
+                group.segments.front().startBlock == group.firstBlock) {
+                count--;
+            }
+
+            previousEndsAtBoundary = !group.segments.empty() &&
+                group.segments.back().endBlock() + 1 == group.firstBlock + group.blockCount;
+        }
+        return count;
     }
 
     double getFragmentation() const {
@@ -218,113 +603,138 @@ public:
 
     uint32_t getLargestContiguousBlock() const {
         uint32_t largest = 0;
-        for (size_t i = 0; i < freeSegments.size(); i++) {
-            const FreeSegment& seg = freeSegments[i];
-            if (seg.blockCount > largest) {
-                largest = seg.blockCount;
+        for (size_t g = 0; g < groups.size(); g++) {
+            lock_guard<mutex> guard(groups[g]->lock);
+            const vector<FreeSegment>& segments = groups[g]->segments;
+            for (size_t i = 0; i < segments.size(); i++) {
+                if (segments[i].blockCount > largest) {
+                    largest = segments[i].blockCount;
+                }
             }
         }
         return largest;
     }
 
-    vector<uint8_t> serialize() const {
-        vector<uint8_t> data;
-
-        data.push_back((totalBlocks >> 24) & 0xFF);
-        data.push_back((totalBlocks >> 16) & 0xFF);
-        data.push_back((totalBlocks >> 8) & 0xFF);
-        data.push_back(totalBlocks & 0xFF);
+    // Snapshot layout: FreeSpaceSnapshotHeader followed by one
+    // (gap, count) varint pair per segment, gap measured from the end of
+    // the previous segment. The whole payload is read in one go at fs_init.
+    vector<uint8_t> serialize() {
+        vector<FreeSegment> freeSegments = collectSegments();
 
-        data.push_back((freeBlocks >> 24) & 0xFF);
-        data.push_back((freeBlocks >> 16) & 0xFF);
-        data.push_back((freeBlocks >> 8) & 0xFF);
-        data.push_back(freeBlocks & 0xFF);
-
-        uint32_t segCount = freeSegments.size();
-        data.push_back((segCount >> 24) & 0xFF);
-        data.push_back((segCount >> 16) & 0xFF);
-        data.push_back((segCount >> 8) & 0xFF);
-        data.push_back(segCount & 0xFF);
+        vector<uint8_t> payload;
+        payload.reserve(freeSegments.size() * 4);
 
+        uint32_t previousEnd = 0;
         for (size_t i = 0; i < freeSegments.size(); i++) {
             const FreeSegment& seg = freeSegments[i];
-
-            data.push_back((seg.startBlock >> 24) & 0xFF);
-            data.push_back((seg.startBlock >> 16) & 0xFF);
-            data.push_back((seg.startBlock >> 8) & 0xFF);
-            data.push_back(seg.startBlock & 0xFF);
-
-            data.push_back((seg.blockCount >> 24) & 0xFF);
-            data.push_back((seg.blockCount >> 16) & 0xFF);
-            data.push_back((seg.blockCount >> 8) & 0xFF);
-            data.push_back(seg.blockCount & 0xFF);
+            appendVarint(payload, seg.startBlock - previousEnd);
+            appendVarint(payload, seg.blockCount);
+            previousEnd = seg.startBlock + seg.blockCount;
         }
 
+        FreeSpaceSnapshotHeader header;
+        memcpy(header.magic, FREE_SPACE_SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = FREE_SPACE_SNAPSHOT_VERSION;
+        header.totalBlocks = totalBlocks;
+        header.freeBlocks = freeBlocks;
+        header.segmentCount = freeSegments.size();
+        header.payloadSize = payload.size();
+        header.payloadChecksum = crc32(payload.data(), payload.size());
+        header.headerChecksum = 0;
+        header.headerChecksum = crc32(&header, sizeof(header));
+
+        vector<uint8_t> data(sizeof(header) + payload.size());
+        memcpy(data.data(), &header, sizeof(header));
+        if (!payload.empty()) {
+            memcpy(data.data() + sizeof(header), payload.data(), payload.size());
+        }
         return data;
     }
 
-    static FreeSpaceManager* deserialize(const vector<uint8_t>& data) {
-        if (data.size() < 12) return nullptr;
+    // Validates a snapshot header and returns the payload size that follows it.
+    // Returns false if the bytes are not a current-format snapshot header.
+    static bool readSnapshotHeader(const uint8_t* data, size_t size, FreeSpaceSnapshotHeader& header) {
+        if (size < sizeof(FreeSpaceSnapshotHeader)) return false;
 
-        uint32_t totalBlocks = ((uint32_t)data[0] << 24) |
-                               ((uint32_t)data[1] << 16) |
-                               ((uint32_t)data[2] << 8) |
-                               (uint32_t)data[3];
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, FREE_SPACE_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            return false;
+        }
+        if (header.version != FREE_SPACE_SNAPSHOT_VERSION) return false;
 
-        uint32_t freeBlocks = ((uint32_t)data[4] << 24) |
-                              ((uint32_t)data[5] << 16) |
-                              ((uint32_t)data[6] << 8) |
-                              (uint32_t)data[7];
+        FreeSpaceSnapshotHeader check = header;
+        check.headerChecksum = 0;
+        return crc32(&check, sizeof(check)) == header.headerChecksum;
+    }
 
-        uint32_t segCount = ((uint32_t)data[8] << 24) |
-                            ((uint32_t)data[9] << 16) |
-                            ((uint32_t)data[10] << 8) |
-                            (uint32_t)data[11];
+    static FreeSpaceManager* deserialize(const vector<uint8_t>& data,
+                                         uint32_t groupBlocks = DEFAULT_ALLOCATION_GROUP_BLOCKS) {
+        FreeSpaceSnapshotHeader header;
+        if (!readSnapshotHeader(data.data(), data.size(), header)) {
+            return deserializeLegacy(data, groupBlocks);
+        }
 
-        FreeSpaceManager* manager = new FreeSpaceManager(totalBlocks);
-        manager->freeBlocks = freeBlocks;
-        manager->freeSegments.clear();
+        if (data.size() < sizeof(header) + header.payloadSize) return nullptr;
 
-        size_t offset = 12;
-        for (size_t i = 0; i < segCount; i++) {
-            if (offset + 8 > data.size()) break;
+        const uint8_t* payload = data.data() + sizeof(header);
+        if (crc32(payload, header.payloadSize) != header.payloadChecksum) {
+            return nullptr;
+        }
 
-            uint32_t startBlock = ((uint32_t)data[offset] << 24) |
-                                  ((uint32_t)data[offset + 1] << 16) |
-                                  ((uint32_t)data[offset + 2] << 8) |
-                                  (uint32_t)data[offset + 3];
+        FreeSpaceManager* manager = new FreeSpaceManager(header.totalBlocks, groupBlocks);
+        manager->clearGroups();
+
+        size_t offset = 0;
+        uint64_t previousEnd = 0;
+        for (uint32_t i = 0; i < header.segmentCount; i++) {
+            uint32_t gap, count;
+            if (!readVarint(payload, header.payloadSize, offset, gap) ||
+                !readVarint(payload, header.payloadSize, offset, count)) {
+                delete manager;
+                return nullptr;
+            }
 
-            uint32_t blockCount = ((uint32_t)data[offset + 4] << 24) |
-                                  ((uint32_t)data[offset + 5] << 16) |
-                                  ((uint32_t)data[offset + 6] << 8) |
-                                  (uint32_t)data[offset + 7];
+            uint64_t start = previousEnd + gap;
+            if (count == 0 || start == 0 || start + count > header.totalBlocks) {
+                delete manager;
+                return nullptr;
+            }
 
-            manager->freeSegments.push_back(FreeSegment(startBlock, blockCount));
-            offset += 8;
+            manager->addFreeRange(start, count);
+            previousEnd = start + count;
+        }
+
+        if (manager->freeBlocks != header.freeBlocks) {
+            delete manager;
+            return nullptr;
         }
 
         return manager;
     }
 
     void clear() {
-        freeSegments.clear();
+        clearGroups();
         // Start from block 1 (block 0 is reserved)
         if (totalBlocks > 1) {
-            freeSegments.push_back(FreeSegment(1, totalBlocks - 1));
-            freeBlocks = totalBlocks - 1;
-        } else {
-            freeBlocks = 0;
+            addFreeRange(1, totalBlocks - 1);
         }
     }
 
     void printSegments() const {
         cout << "\n=== Free Space Segments ===\n";
         cout << "Block 0: RESERVED (not shown)\n";
-        for (size_t i = 0; i < freeSegments.size(); i++) {
-            cout << "Start: " << freeSegments[i].startBlock
-                 << ", Count: " << freeSegments[i].blockCount << endl;
+        for (size_t g = 0; g < groups.size(); g++) {
+            lock_guard<mutex> guard(groups[g]->lock);
+            cout << "Group " << g << " (blocks " << groups[g]->firstBlock
+                 << "-" << groups[g]->firstBlock + groups[g]->blockCount - 1
+                 << ", " << groups[g]->freeBlocks << " free)" << endl;
+            const vector<FreeSegment>& segments = groups[g]->segments;
+            for (size_t i = 0; i < segments.size(); i++) {
+                cout << "  Start: " << segments[i].startBlock
+                     << ", Count: " << segments[i].blockCount << endl;
+            }
         }
     }
 };
 
-#endif
\ No newline at end of file
+#endif
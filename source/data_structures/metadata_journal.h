@@ -0,0 +1,122 @@
+#ifndef METADATA_JOURNAL_H
+#define METADATA_JOURNAL_H
+
+#include <map>
+#include <cstdint>
+#include "../include/odf_types.hpp"
+
+using namespace std;
+
+// In-memory side of the metadata journal. FileEntry writes are staged
+// here instead of going to the entry table; a flush appends the staged
+// images to the journal region as one record, after which they wait in
+// the journaled map until a checkpoint writes them home. Reads of the
+// entry table look here first, so the table on disk may lag behind.
+class MetadataJournal {
+private:
+    uint32_t startBlock;                // first block of the region, 0 = no journal
+    uint32_t blocks;
+    uint64_t capacity;                  // region size in bytes
+    uint64_t head;                      // where the next record goes
+    uint64_t sequence;                  // sequence number of the next record
+    map<uint32_t, FileEntry> staged;    // written since the last record
+    map<uint32_t, FileEntry> journaled; // in a record, not yet at home
+    uint64_t records;
+    uint64_t checkpoints;
+
+public:
+    MetadataJournal() : startBlock(0), blocks(0), capacity(0), head(0), sequence(0),
+                        records(0), checkpoints(0) {}
+
+    // starts journaling into an empty region; next is the sequence number
+    // its first record gets
+    void attach(uint32_t start, uint32_t count, uint64_t bytes, uint64_t next) {
+        startBlock = start;
+        blocks = count;
+        capacity = bytes;
+        head = 0;
+        sequence = next;
+    }
+
+    bool isEnabled() const {
+        return startBlock != 0;
+    }
+
+    const FileEntry* find(uint32_t entryIndex) const {
+        map<uint32_t, FileEntry>::const_iterator it = staged.find(entryIndex);
+        if (it != staged.end()) return &it->second;
+
+        it = journaled.find(entryIndex);
+        if (it != journaled.end()) return &it->second;
+        return nullptr;
+    }
+
+    void stage(uint32_t entryIndex, const FileEntry& entry) {
+        staged[entryIndex] = entry;
+    }
+
+    const map<uint32_t, FileEntry>& getStaged() const {
+        return staged;
+    }
+
+    const map<uint32_t, FileEntry>& getJournaled() const {
+        return journaled;
+    }
+
+    // the staged images went out as a record of size bytes at offset
+    void appended(uint64_t offset, uint64_t size) {
+        for (map<uint32_t, FileEntry>::iterator it = staged.begin(); it != staged.end(); ++it) {
+            journaled[it->first] = it->second;
+        }
+        staged.clear();
+        head = offset + size;
+        sequence++;
+        records++;
+    }
+
+    // everything journaled is at home; the region starts over
+    void checkpointed() {
+        journaled.clear();
+        head = 0;
+        checkpoints++;
+    }
+
+    // staged images that won't fit the region join the journaled ones and
+    // go home with the next checkpoint
+    void unstage() {
+        for (map<uint32_t, FileEntry>::iterator it = staged.begin(); it != staged.end(); ++it) {
+            journaled[it->first] = it->second;
+        }
+        staged.clear();
+    }
+
+    uint32_t getStartBlock() const {
+        return startBlock;
+    }
+
+    uint32_t getBlocks() const {
+        return blocks;
+    }
+
+    uint64_t getCapacity() const {
+        return capacity;
+    }
+
+    uint64_t getHead() const {
+        return head;
+    }
+
+    uint64_t getSequence() const {
+        return sequence;
+    }
+
+    uint64_t getRecordCount() const {
+        return records;
+    }
+
+    uint64_t getCheckpointCount() const {
+        return checkpoints;
+    }
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+struct TreeNode;
+
+// a dead name is only dropped from the posting lists by a rebuild, once
+// there are at least this many and more dead than live names
+#define NAME_INDEX_COMPACT_MIN 1024
+
+// '*' matches any run of characters, '?' any one character
+inline bool globMatch(string_view pattern, string_view name) {
+    size_t p = 0, n = 0;
+    size_t star = string_view::npos, resume = 0;
+
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (star != string_view::npos) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+inline bool isGlobPattern(string_view pattern) {
+    return pattern.find_first_of("*?") != string_view::npos;
+}
+
+// A pattern without '*' or '?' matches names containing it
+inline bool nameMatches(string_view pattern, string_view name) {
+    if (isGlobPattern(pattern)) return globMatch(pattern, name);
+    return name.find(pattern) != string_view::npos;
+}
+
+// Trigram index over the distinct names in the tree. Every distinct name
+// gets an ID and the list of nodes carrying it; every trigram of a name
+// lists the IDs of the names containing it, in increasing order since IDs
+// are only ever appended. A query intersects the lists for the trigrams of
+// its literal parts and only checks the names that survive.
+class NameIndex {
+private:
+    struct NameSlot {
+        string name;
+        vector<TreeNode*> nodes;    // empty once the name is dead
+    };
+
+    deque<NameSlot> slots;                              // by ID; names stay put
+    unordered_map<string_view, uint32_t> ids;           // views of slot names
+    unordered_map<uint32_t, vector<uint32_t> > postings;
+    size_t deadNames;
+
+    static uint32_t trigramKey(string_view text, size_t at) {
+        return ((uint32_t)(uint8_t)text[at] << 16) | ((uint32_t)(uint8_t)text[at + 1] << 8) |
+               (uint32_t)(uint8_t)text[at + 2];
+    }
+
+    static void collectTrigrams(string_view text, vector<uint32_t>& keys) {
+        for (size_t i = 0; i + 3 <= text.size(); i++) {
+            keys.push_back(trigramKey(text, i));
+        }
+    }
+
+    uint32_t addName(string_view name) {
+        uint32_t id = slots.size();
+        slots.push_back(NameSlot());
+        slots.back().name = string(name);
+        ids.insert(make_pair(string_view(slots.back().name), id));
+
+        vector<uint32_t> keys;
+        collectTrigrams(name, keys);
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        for (size_t i = 0; i < keys.size(); i++) {
+            postings[keys[i]].push_back(id);
+        }
+        return id;
+    }
+
+    // drops dead names by starting over with the live nodes
+    void compact() {
+        vector<TreeNode*> live;
+        for (size_t i = 0; i < slots.size(); i++) {
+            live.insert(live.end(), slots[i].nodes.begin(), slots[i].nodes.end());
+        }
+
+        clear();
+        for (size_t i = 0; i < live.size(); i++) {
+            add(live[i]);
+        }
+    }
+
+public:
+    NameIndex() : deadNames(0) {}
+
+    void clear() {
+        slots.clear();
+        ids.clear();
+        postings.clear();
+        deadNames = 0;
+    }
+
+    void add(TreeNode* node);
+    void remove(TreeNode* node);
+
+    // every indexed node whose name matches the pattern (see nameMatches)
+    vector<TreeNode*> find(string_view pattern) const {
+        vector<uint32_t> keys;
+        size_t start = 0;
+        while (start <= pattern.size()) {
+            size_t end = pattern.find_first_of("*?", start);
+            if (end == string_view::npos) end = pattern.size();
+            collectTrigrams(pattern.substr(start, end - start), keys);
+            start = end + 1;
+        }
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+        // smallest posting list first, the others only narrow it down
+        vector<const vector<uint32_t>*> lists;
+        for (size_t i = 0; i < keys.size(); i++) {
+            unordered_map<uint32_t, vector<uint32_t> >::const_iterator it = postings.find(keys[i]);
+            if (it == postings.end()) return vector<TreeNode*>();
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(),
+             [](const vector<uint32_t>* a, const vector<uint32_t>* b) { return a->size() < b->size(); });
+
+        vector<uint32_t> candidates;
+        if (lists.empty()) {
+            // too short to narrow down: every name gets checked
+            for (uint32_t id = 0; id < slots.size(); id++) candidates.push_back(id);
+        } else {
+            candidates = *lists[0];
+            for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+                vector<uint32_t> kept;
+                set_intersection(candidates.begin(), candidates.end(),
+                                 lists[i]->begin(), lists[i]->end(), back_inserter(kept));
+                candidates.swap(kept);
+            }
+        }
+
+        vector<TreeNode*> matches;
+        for (size_t i = 0; i < candidates.size(); i++) {
+            const NameSlot& slot = slots[candidates[i]];
+            if (!slot.nodes.empty() && nameMatches(pattern, slot.name)) {
+                matches.insert(matches.end(), slot.nodes.begin(), slot.nodes.end());
+            }
+        }
+        return matches;
+    }
+
+    size_t getNameCount() const { return slots.size() - deadNames; }
+};
+
+#endif
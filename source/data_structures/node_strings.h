@@ -0,0 +1,180 @@
+#ifndef NODE_STRINGS_H
+#define NODE_STRINGS_H
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <cstring>
+#include <cstdint>
+#include "slab_pool.h"
+
+using namespace std;
+
+// names up to this many bytes (length prefix and terminator included) come
+// from the name heap's size classes, longer ones from the general heap
+#define NAME_HEAP_CLASS_BYTES 16
+#define NAME_HEAP_MAX_BYTES 256
+
+// Size-classed storage for tree node names: one slab pool per 16 byte
+// class, so a name costs its own bytes rounded up instead of a std::string
+// plus a separate allocation once it outgrows the inline buffer.
+class NameHeap {
+private:
+    // never destroyed: nodes of a leaked instance may be freed after static
+    // destructors have run
+    static SlabPool& classPool(size_t bytes) {
+        static SlabPool** pools = []() {
+            SlabPool** created = new SlabPool*[NAME_HEAP_MAX_BYTES / NAME_HEAP_CLASS_BYTES];
+            for (size_t i = 0; i < NAME_HEAP_MAX_BYTES / NAME_HEAP_CLASS_BYTES; i++) {
+                created[i] = new SlabPool((i + 1) * NAME_HEAP_CLASS_BYTES, 4096 / (i + 1));
+            }
+            return created;
+        }();
+        return *pools[(bytes - 1) / NAME_HEAP_CLASS_BYTES];
+    }
+
+public:
+    static char* allocate(size_t bytes) {
+        if (bytes > NAME_HEAP_MAX_BYTES) return new char[bytes];
+        return (char*)classPool(bytes).allocate();
+    }
+
+    static void release(char* data, size_t bytes) {
+        if (!data) return;
+        if (bytes > NAME_HEAP_MAX_BYTES) {
+            delete[] data;
+            return;
+        }
+        classPool(bytes).release(data);
+    }
+};
+
+// A node's name: one pointer to [uint16_t length][bytes]['\0'] in the name
+// heap, nullptr for an empty name.
+class NodeName {
+private:
+    char* data;
+
+    static size_t storageSize(size_t length) {
+        return sizeof(uint16_t) + length + 1;
+    }
+
+    uint16_t length() const {
+        uint16_t value = 0;
+        if (data) memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    void assign(string_view text) {
+        if (text.size() > UINT16_MAX) text = text.substr(0, UINT16_MAX);
+        if (text.empty()) {
+            data = nullptr;
+            return;
+        }
+
+        uint16_t value = text.size();
+        data = NameHeap::allocate(storageSize(value));
+        memcpy(data, &value, sizeof(value));
+        memcpy(data + sizeof(value), text.data(), value);
+        data[sizeof(value) + value] = '\0';
+    }
+
+    void release() {
+        if (data) NameHeap::release(data, storageSize(length()));
+        data = nullptr;
+    }
+
+public:
+    NodeName() : data(nullptr) {}
+    NodeName(string_view text) : data(nullptr) { assign(text); }
+    ~NodeName() { release(); }
+
+    NodeName(const NodeName&) = delete;
+
+    NodeName& operator=(string_view text) {
+        // text may view the name being replaced
+        char* old = data;
+        size_t oldSize = storageSize(length());
+        assign(text);
+        if (old) NameHeap::release(old, oldSize);
+        return *this;
+    }
+
+    NodeName& operator=(const NodeName& other) { return *this = other.view(); }
+
+    string_view view() const {
+        return data ? string_view(data + sizeof(uint16_t), length()) : string_view();
+    }
+    operator string_view() const { return view(); }
+
+    const char* c_str() const { return data ? data + sizeof(uint16_t) : ""; }
+    size_t size() const { return length(); }
+    bool empty() const { return data == nullptr; }
+    const char* begin() const { return c_str(); }
+    const char* end() const { return c_str() + length(); }
+
+    bool operator==(string_view other) const { return view() == other; }
+    bool operator!=(string_view other) const { return view() != other; }
+    bool operator<(string_view other) const { return view() < other; }
+};
+
+// Owner names are interned: a node keeps a 16 bit ID and the name itself
+// is stored once per process. ID 0 is the empty owner; past 65535 distinct
+// owners new ones also map to it.
+class OwnerNames {
+private:
+    deque<string> names;                            // references stay valid as it grows
+    unordered_map<string_view, uint16_t> ids;       // views of names
+    mutex lock;
+
+    OwnerNames() { names.push_back(""); }
+
+    // never destroyed, like the name heap
+    static OwnerNames& instance() {
+        static OwnerNames* table = new OwnerNames();
+        return *table;
+    }
+
+public:
+    static uint16_t intern(string_view name) {
+        if (name.empty()) return 0;
+
+        OwnerNames& table = instance();
+        lock_guard<mutex> guard(table.lock);
+
+        unordered_map<string_view, uint16_t>::iterator it = table.ids.find(name);
+        if (it != table.ids.end()) return it->second;
+        if (table.names.size() > UINT16_MAX) return 0;
+
+        uint16_t id = table.names.size();
+        table.names.push_back(string(name));
+        table.ids.insert(make_pair(string_view(table.names.back()), id));
+        return id;
+    }
+
+    // the ID of a name already interned, without adding it
+    static bool find(string_view name, uint16_t& id) {
+        if (name.empty()) {
+            id = 0;
+            return true;
+        }
+
+        OwnerNames& table = instance();
+        lock_guard<mutex> guard(table.lock);
+
+        unordered_map<string_view, uint16_t>::iterator it = table.ids.find(name);
+        if (it == table.ids.end()) return false;
+        id = it->second;
+        return true;
+    }
+
+    static const string& lookup(uint16_t id) {
+        OwnerNames& table = instance();
+        lock_guard<mutex> guard(table.lock);
+        return id < table.names.size() ? table.names[id] : table.names[0];
+    }
+};
+
+#endif
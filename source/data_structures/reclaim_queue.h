@@ -0,0 +1,86 @@
+#ifndef RECLAIM_QUEUE_H
+#define RECLAIM_QUEUE_H
+
+#include <deque>
+#include <cstdint>
+
+using namespace std;
+
+// Block chain of a deleted file that hasn't been given back yet
+struct PendingReclaim {
+    uint32_t entryIndex;        // FileEntry holding the pending flag
+    uint32_t nextBlock;         // first block of the chain still in use
+    uint32_t pendingBlocks;     // blocks expected to be left in the chain
+
+    PendingReclaim() : entryIndex(0), nextBlock(0), pendingBlocks(0) {}
+    PendingReclaim(uint32_t entry, uint32_t block, uint32_t blocks)
+        : entryIndex(entry), nextBlock(block), pendingBlocks(blocks) {}
+};
+
+// FIFO of deleted files whose blocks the maintenance worker frees in
+// batches. The on-disk FileEntry keeps the pending flag and the current
+// chain head, so the queue is rebuilt by fs_init after a crash.
+class ReclaimQueue {
+private:
+    deque<PendingReclaim> items;
+    uint64_t pendingBlocks;
+    uint64_t reclaimedFiles;
+    uint64_t reclaimedBlocks;
+
+public:
+    ReclaimQueue() : pendingBlocks(0), reclaimedFiles(0), reclaimedBlocks(0) {}
+
+    void push(uint32_t entryIndex, uint32_t startBlock, uint32_t blocks) {
+        items.push_back(PendingReclaim(entryIndex, startBlock, blocks));
+        pendingBlocks += blocks;
+    }
+
+    PendingReclaim* front() {
+        if (items.empty()) return nullptr;
+        return &items.front();
+    }
+
+    // records a freed batch of the front chain; nextBlock 0 completes it
+    void advance(uint32_t nextBlock, uint32_t freed) {
+        if (items.empty()) return;
+
+        PendingReclaim& item = items.front();
+        uint32_t accounted = freed < item.pendingBlocks ? freed : item.pendingBlocks;
+        item.pendingBlocks -= accounted;
+        pendingBlocks -= accounted;
+        reclaimedBlocks += freed;
+
+        item.nextBlock = nextBlock;
+        if (nextBlock == 0) {
+            pendingBlocks -= item.pendingBlocks;
+            reclaimedFiles++;
+            items.pop_front();
+        }
+    }
+
+    const deque<PendingReclaim>& getItems() const {
+        return items;
+    }
+
+    bool empty() const {
+        return items.empty();
+    }
+
+    uint32_t size() const {
+        return items.size();
+    }
+
+    uint64_t getPendingBlocks() const {
+        return pendingBlocks;
+    }
+
+    uint64_t getReclaimedFiles() const {
+        return reclaimedFiles;
+    }
+
+    uint64_t getReclaimedBlocks() const {
+        return reclaimedBlocks;
+    }
+};
+
+#endif
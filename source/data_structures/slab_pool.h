@@ -0,0 +1,168 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// objects a SlabCacheScope takes from a pool under one lock
+#define SLAB_CACHE_BATCH 256
+
+class SlabCacheScope;
+
+// Fixed-size object pool. Memory is taken in slabs of objectsPerSlab
+// objects laid out back to back, and freed objects are threaded on a free
+// list for reuse, so a large tree costs one allocation per slab instead of
+// one per node and its nodes sit next to each other. An object keeps its
+// address for its whole lifetime. Slabs are only given back when the pool
+// itself goes away.
+class SlabPool {
+private:
+    size_t objectSize;
+    size_t objectsPerSlab;
+    vector<char*> slabs;
+    void* freeList;                 // first word of a free object links to the next
+    size_t bumpNext;                // objects of the newest slab never handed out
+    size_t inUse;
+    size_t id;                      // slot in a SlabCacheScope
+    mutex lock;
+
+    static size_t nextId() {
+        static atomic<size_t> count(0);
+        return count++;
+    }
+
+    void* take() {
+        inUse++;
+
+        if (freeList) {
+            void* object = freeList;
+            freeList = *(void**)object;
+            return object;
+        }
+
+        if (bumpNext == objectsPerSlab) {
+            slabs.push_back(new char[objectSize * objectsPerSlab]);
+            bumpNext = 0;
+        }
+        return slabs.back() + objectSize * bumpNext++;
+    }
+
+public:
+    SlabPool(size_t size, size_t perSlab)
+        : objectSize(size < sizeof(void*) ? sizeof(void*) : size),
+          objectsPerSlab(perSlab), freeList(nullptr), bumpNext(perSlab), inUse(0), id(nextId()) {
+        // keep every object pointer aligned
+        objectSize = (objectSize + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+    }
+
+    ~SlabPool() {
+        for (size_t i = 0; i < slabs.size(); i++) {
+            delete[] slabs[i];
+        }
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    // from the calling thread's SlabCacheScope when it has one
+    inline void* allocate();
+
+    // count objects under one hold of the lock
+    void allocateBatch(size_t count, vector<void*>& objects) {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < count; i++) {
+            objects.push_back(take());
+        }
+    }
+
+    void release(void* object) {
+        if (!object) return;
+
+        lock_guard<mutex> guard(lock);
+        *(void**)object = freeList;
+        freeList = object;
+        inUse--;
+    }
+
+    void releaseBatch(const vector<void*>& objects) {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < objects.size(); i++) {
+            *(void**)objects[i] = freeList;
+            freeList = objects[i];
+        }
+        inUse -= objects.size();
+    }
+
+    size_t getObjectSize() const { return objectSize; }
+    size_t getInUse() const { return inUse; }
+    size_t getReservedBytes() const { return slabs.size() * objectSize * objectsPerSlab; }
+    size_t getId() const { return id; }
+};
+
+// Gives the thread that creates it a private batch of objects from every
+// pool it allocates from, refilled SLAB_CACHE_BATCH at a time, so threads
+// building nodes side by side (the entry table scan) don't take a pool's
+// lock once per object. Objects freed meanwhile go straight back to their
+// pool; whatever is left unused goes back when the scope ends.
+class SlabCacheScope {
+private:
+    vector<vector<void*> > cached;      // by pool ID
+    vector<SlabPool*> pools;
+    SlabCacheScope* outer;
+
+    static SlabCacheScope*& current() {
+        static thread_local SlabCacheScope* scope = nullptr;
+        return scope;
+    }
+
+public:
+    SlabCacheScope() : outer(current()) {
+        current() = this;
+    }
+
+    ~SlabCacheScope() {
+        for (size_t i = 0; i < pools.size(); i++) {
+            if (pools[i]) pools[i]->releaseBatch(cached[i]);
+        }
+        current() = outer;
+    }
+
+    SlabCacheScope(const SlabCacheScope&) = delete;
+    SlabCacheScope& operator=(const SlabCacheScope&) = delete;
+
+    static SlabCacheScope* active() {
+        return current();
+    }
+
+    void* allocate(SlabPool& pool) {
+        size_t id = pool.getId();
+        if (id >= cached.size()) {
+            cached.resize(id + 1);
+            pools.resize(id + 1, nullptr);
+        }
+        pools[id] = &pool;
+
+        vector<void*>& objects = cached[id];
+        if (objects.empty()) {
+            pool.allocateBatch(SLAB_CACHE_BATCH, objects);
+        }
+        void* object = objects.back();
+        objects.pop_back();
+        return object;
+    }
+};
+
+inline void* SlabPool::allocate() {
+    SlabCacheScope* scope = SlabCacheScope::active();
+    if (scope) return scope->allocate(*this);
+
+    lock_guard<mutex> guard(lock);
+    return take();
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef>
+
+struct CRC32Table {
+    uint32_t entries[256];
+
+    CRC32Table() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+// CRC-32 (IEEE 802.3), used to validate on-disk snapshots before fs_init trusts them
+inline uint32_t crc32Update(uint32_t crc, const void* data, size_t length) {
+    static const CRC32Table table;
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table.entries[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+inline uint32_t crc32(const void* data, size_t length) {
+    return crc32Update(0, data, length);
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include "odf_ext_types.hpp"
 
 using namespace std;
 
@@ -15,6 +16,19 @@ struct FileSystemConfig {
     uint64_t block_size;
     uint32_t max_files;
     uint32_t max_filename_length;
+    uint32_t allocation_group_blocks;
+    bool delayed_allocation;
+    uint64_t delayed_flush_bytes;
+    uint32_t delayed_flush_seconds;
+    uint32_t reclaim_batch_blocks;
+    uint32_t init_threads;
+    bool lazy_load;
+    uint32_t lazy_max_nodes;
+    uint32_t path_cache_entries;
+    uint32_t group_commit_window_us;
+    uint32_t journal_blocks;
+    uint32_t durability;
+    uint32_t durability_interval_ms;
     
     uint32_t max_users;
     string admin_username;
@@ -31,6 +45,19 @@ struct FileSystemConfig {
           block_size(4096),
           max_files(1000),
           max_filename_length(255),
+          allocation_group_blocks(8192),
+          delayed_allocation(false),
+          delayed_flush_bytes(8388608),
+          delayed_flush_seconds(5),
+          reclaim_batch_blocks(1024),
+          init_threads(1),
+          lazy_load(false),
+          lazy_max_nodes(100000),
+          path_cache_entries(4096),
+          group_commit_window_us(0),
+          journal_blocks(256),
+          durability(DURABILITY_NONE),
+          durability_interval_ms(1000),
           max_users(50),
           admin_username("admin"),
           admin_password("admin123"),
@@ -66,6 +93,24 @@ private:
         return (lower == "true" || lower == "1" || lower == "yes");
     }
     
+    static uint32_t parseDurability(const string& str) {
+        string lower = str;
+        transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (lower == "strict") return DURABILITY_STRICT;
+        if (lower == "group") return DURABILITY_GROUP;
+        if (lower == "periodic") return DURABILITY_PERIODIC;
+        return DURABILITY_NONE;
+    }
+    
+    static const char* durabilityName(uint32_t mode) {
+        switch (mode) {
+            case DURABILITY_STRICT: return "strict";
+            case DURABILITY_GROUP: return "group";
+            case DURABILITY_PERIODIC: return "periodic";
+            default: return "none";
+        }
+    }
+    
 public:
     static FileSystemConfig parse(const char* config_path) {
         FileSystemConfig config;
@@ -114,6 +159,19 @@ public:
                 else if (key == "block_size") config.block_size = stoull(value);
                 else if (key == "max_files") config.max_files = stoul(value);
                 else if (key == "max_filename_length") config.max_filename_length = stoul(value);
+                else if (key == "allocation_group_blocks") config.allocation_group_blocks = stoul(value);
+                else if (key == "delayed_allocation") config.delayed_allocation = parseBool(value);
+                else if (key == "delayed_flush_bytes") config.delayed_flush_bytes = stoull(value);
+                else if (key == "delayed_flush_seconds") config.delayed_flush_seconds = stoul(value);
+                else if (key == "reclaim_batch_blocks") config.reclaim_batch_blocks = stoul(value);
+                else if (key == "init_threads") config.init_threads = stoul(value);
+                else if (key == "lazy_load") config.lazy_load = parseBool(value);
+                else if (key == "lazy_max_nodes") config.lazy_max_nodes = stoul(value);
+                else if (key == "path_cache_entries") config.path_cache_entries = stoul(value);
+                else if (key == "group_commit_window_us") config.group_commit_window_us = stoul(value);
+                else if (key == "journal_blocks") config.journal_blocks = stoul(value);
+                else if (key == "durability") config.durability = parseDurability(removeQuotes(value));
+                else if (key == "durability_interval_ms") config.durability_interval_ms = stoul(value);
             }
             else if (current_section == "security") {
                 if (key == "max_users") config.max_users = stoul(value);
@@ -139,6 +197,19 @@ public:
         cout << "  block_size: " << config.block_size << endl;
         cout << "  max_files: " << config.max_files << endl;
         cout << "  max_filename_length: " << config.max_filename_length << endl;
+        cout << "  allocation_group_blocks: " << config.allocation_group_blocks << endl;
+        cout << "  delayed_allocation: " << config.delayed_allocation << endl;
+        cout << "  delayed_flush_bytes: " << config.delayed_flush_bytes << endl;
+        cout << "  delayed_flush_seconds: " << config.delayed_flush_seconds << endl;
+        cout << "  reclaim_batch_blocks: " << config.reclaim_batch_blocks << endl;
+        cout << "  init_threads: " << config.init_threads << endl;
+        cout << "  lazy_load: " << config.lazy_load << endl;
+        cout << "  lazy_max_nodes: " << config.lazy_max_nodes << endl;
+        cout << "  path_cache_entries: " << config.path_cache_entries << endl;
+        cout << "  group_commit_window_us: " << config.group_commit_window_us << endl;
+        cout << "  journal_blocks: " << config.journal_blocks << endl;
+        cout << "  durability: " << durabilityName(config.durability) << endl;
+        cout << "  durability_interval_ms: " << config.durability_interval_ms << endl;
         
         cout << "[security]" << endl;
         cout << "  max_users: " << config.max_users << endl;
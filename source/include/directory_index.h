@@ -0,0 +1,514 @@
+#ifndef DIRECTORY_INDEX_H
+#define DIRECTORY_INDEX_H
+
+#include "odf_types.hpp"
+#include "odf_ext_types.hpp"
+#include "ofs_instance.h"
+#include "helper_functions.h"
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// Every directory keeps a list of its children in a block chain headed by
+// its FileEntry.inode (ENTRY_FLAG_CHILD_INDEX set). Each block is a page:
+// next block (uint32_t), bytes of records on the page (uint32_t), then
+// records sorted by name across the whole chain: entry index (uint32_t),
+// name length (uint8_t), name. A record never straddles two pages. The
+// record and page counts are kept in the entry's reserved bytes. Listing or
+// loading one directory reads only its own chain and the entries it names,
+// never the whole table; adding or removing a child reads and writes only
+// the page its name sorts onto (see ChildPageCache).
+
+// longest name a record holds. Longer names (dir_create keeps the whole
+// name) are cut here, so the length byte, the record size and every
+// comparison against a stored name agree.
+#define CHILD_RECORD_NAME_MAX 255
+
+inline string_view childRecordName(string_view name) {
+    return name.substr(0, CHILD_RECORD_NAME_MAX);
+}
+
+struct ChildRecord {
+    uint32_t entryIndex;
+    string name;
+
+    ChildRecord() : entryIndex(0) {}
+    ChildRecord(uint32_t index, string_view n) : entryIndex(index), name(childRecordName(n)) {}
+};
+
+inline uint32_t getEntryField(const FileEntry& entry, size_t offset) {
+    uint32_t value;
+    memcpy(&value, entry.reserved + offset, sizeof(value));
+    return value;
+}
+
+inline void setEntryField(FileEntry& entry, size_t offset, uint32_t value) {
+    memcpy(entry.reserved + offset, &value, sizeof(value));
+}
+
+inline bool hasChildIndex(const FileEntry& entry) {
+    return entry.getType() == EntryType::DIRECTORY && (entry.reserved[0] & ENTRY_FLAG_CHILD_INDEX);
+}
+
+inline size_t getChildRecordSize(const ChildRecord& record) {
+    return sizeof(uint32_t) + 1 + record.name.size();
+}
+
+inline uint64_t getBlockOffset(OFSInstance* fs, uint32_t block) {
+    return calculateContentOffset(fs->header, fs->config.max_files) + ((uint64_t)block * fs->header.block_size);
+}
+
+// detached tree node carrying an entry's metadata; owner_id is the entry's
+// owner already interned
+inline TreeNode* createNodeFromEntry(const FileEntry& entry, uint32_t entry_index, uint16_t owner_id) {
+    bool is_file = (entry.getType() == EntryType::FILE);
+
+    TreeNode* node = new TreeNode(entry.name, is_file);
+    node->entryIndex = entry_index;
+    node->ownerId = owner_id;
+    node->size = entry.size;
+    node->permissions = entry.permissions;
+    node->created_time = entry.created_time;
+    node->modified_time = entry.modified_time;
+    // a directory's inode only means something once it heads a child list
+    node->startBlockIndex = (is_file || hasChildIndex(entry)) ? entry.inode : 0;
+
+    return node;
+}
+
+inline TreeNode* createNodeFromEntry(const FileEntry& entry, uint32_t entry_index) {
+    return createNodeFromEntry(entry, entry_index, OwnerNames::intern(entry.owner));
+}
+
+// bytes of a page before its records: next block, record bytes
+#define CHILD_PAGE_HEADER_SIZE 8
+
+inline uint32_t getChildPageCapacity(OFSInstance* fs) {
+    return fs->header.block_size - CHILD_PAGE_HEADER_SIZE;
+}
+
+// decodes the records of one page read into page
+inline void parseChildPage(const vector<uint8_t>& page, vector<ChildRecord>& records) {
+    uint32_t used;
+    memcpy(&used, page.data() + sizeof(uint32_t), sizeof(used));
+    size_t end = min((size_t)used + CHILD_PAGE_HEADER_SIZE, page.size());
+
+    size_t position = CHILD_PAGE_HEADER_SIZE;
+    while (position + sizeof(uint32_t) + 1 <= end) {
+        ChildRecord record;
+        memcpy(&record.entryIndex, page.data() + position, sizeof(uint32_t));
+        uint8_t length = page[position + sizeof(uint32_t)];
+        position += sizeof(uint32_t) + 1;
+
+        if (position + length > end) break;
+        record.name.assign((const char*)page.data() + position, length);
+        position += length;
+
+        records.push_back(record);
+    }
+}
+
+// appends one page (block_size - 4 bytes, as writeBlockChain lays them
+// after the next link) holding records to out
+inline void encodeChildPage(OFSInstance* fs, const ChildRecord* records, size_t count,
+                            vector<uint8_t>& out) {
+    size_t start = out.size();
+    out.resize(start + getUsableBlockSize(fs), 0);
+
+    size_t position = start + sizeof(uint32_t);
+    for (size_t i = 0; i < count; i++) {
+        const string& name = records[i].name;
+        memcpy(out.data() + position, &records[i].entryIndex, sizeof(uint32_t));
+        out[position + sizeof(uint32_t)] = (uint8_t)name.size();
+        memcpy(out.data() + position + sizeof(uint32_t) + 1, name.data(), name.size());
+        position += getChildRecordSize(records[i]);
+    }
+
+    uint32_t used = position - start - sizeof(uint32_t);
+    memcpy(out.data() + start, &used, sizeof(used));
+}
+
+inline bool readChildPage(OFSInstance* fs, uint32_t block, vector<uint8_t>& page) {
+    page.resize(fs->header.block_size);
+    fseek(fs->omni_file, getBlockOffset(fs, block), SEEK_SET);
+    return fread(page.data(), 1, page.size(), fs->omni_file) == page.size();
+}
+
+inline void writeChildPage(OFSInstance* fs, uint32_t block, uint32_t next,
+                           const vector<ChildRecord>& records, size_t first, size_t count) {
+    vector<uint8_t> page(sizeof(uint32_t));
+    memcpy(page.data(), &next, sizeof(next));
+    encodeChildPage(fs, records.data() + first, count, page);
+
+    fseek(fs->omni_file, getBlockOffset(fs, block), SEEK_SET);
+    fwrite(page.data(), 1, page.size(), fs->omni_file);
+}
+
+// relinks the page in block to a new next page without rewriting it
+inline void setChildPageNext(OFSInstance* fs, uint32_t block, uint32_t next) {
+    fseek(fs->omni_file, getBlockOffset(fs, block), SEEK_SET);
+    fwrite(&next, 1, sizeof(next), fs->omni_file);
+}
+
+// a directory's child records in name order; blocks receives the chain
+inline vector<ChildRecord> readChildList(OFSInstance* fs, const FileEntry& dir_entry,
+                                         vector<uint32_t>* blocks = nullptr) {
+    vector<ChildRecord> children;
+    if (!hasChildIndex(dir_entry)) return children;
+
+    uint32_t count = getEntryField(dir_entry, ENTRY_CHILD_COUNT_OFFSET);
+    uint32_t pages = getEntryField(dir_entry, ENTRY_CHILD_BLOCKS_OFFSET);
+    uint32_t total_blocks = fs->free_manager ? fs->free_manager->getTotalBlocks() : UINT32_MAX;
+
+    vector<uint8_t> page;
+    uint32_t current_block = dir_entry.inode;
+
+    for (uint32_t i = 0; i < pages && current_block != 0 && current_block < total_blocks; i++) {
+        if (!readChildPage(fs, current_block, page)) break;
+        if (blocks) blocks->push_back(current_block);
+
+        parseChildPage(page, children);
+        memcpy(&current_block, page.data(), sizeof(uint32_t));
+    }
+
+    if (children.size() > count) children.resize(count);
+    return children;
+}
+
+// the page index of a directory, read from its chain (first record of each
+// page only) when the cache has none matching dir_entry
+inline ChildPages& getChildPages(OFSInstance* fs, uint32_t dir_index, const FileEntry& dir_entry) {
+    uint32_t count = getEntryField(dir_entry, ENTRY_CHILD_COUNT_OFFSET);
+    ChildPages* cached = fs->child_pages.find(dir_index, dir_entry.inode, count);
+    if (cached) return *cached;
+
+    ChildPages& pages = fs->child_pages.put(dir_index);
+    pages.headBlock = dir_entry.inode;
+    pages.records = count;
+
+    uint32_t page_count = getEntryField(dir_entry, ENTRY_CHILD_BLOCKS_OFFSET);
+    uint32_t total_blocks = fs->free_manager->getTotalBlocks();
+    size_t head_size = min((size_t)fs->header.block_size,
+                           (size_t)CHILD_PAGE_HEADER_SIZE + sizeof(uint32_t) + 1 + CHILD_RECORD_NAME_MAX);
+    vector<uint8_t> head(head_size);
+    uint32_t current_block = dir_entry.inode;
+
+    for (uint32_t i = 0; i < page_count && current_block != 0 && current_block < total_blocks; i++) {
+        fseek(fs->omni_file, getBlockOffset(fs, current_block), SEEK_SET);
+        if (fread(head.data(), 1, head.size(), fs->omni_file) != head.size()) break;
+
+        vector<ChildRecord> first;
+        parseChildPage(head, first);
+        pages.blocks.push_back(current_block);
+        pages.firstNames.push_back(first.empty() ? string() : first[0].name);
+
+        memcpy(&current_block, head.data(), sizeof(uint32_t));
+    }
+
+    return pages;
+}
+
+// points the directory's entry at its pages and commits it
+inline void updateChildListEntry(OFSInstance* fs, TreeNode* dir, FileEntry& dir_entry,
+                                 ChildPages& pages, uint32_t count) {
+    dir_entry.reserved[0] |= ENTRY_FLAG_CHILD_INDEX;
+    dir_entry.inode = pages.blocks.empty() ? 0 : pages.blocks[0];
+    setEntryField(dir_entry, ENTRY_CHILD_COUNT_OFFSET, count);
+    setEntryField(dir_entry, ENTRY_CHILD_BLOCKS_OFFSET, pages.blocks.size());
+    writeFileEntry(fs, dir->entryIndex, dir_entry);
+    flushMetadata(fs);
+
+    pages.headBlock = dir_entry.inode;
+    pages.records = count;
+    dir->startBlockIndex = dir_entry.inode;
+}
+
+// writes a complete child list for a directory into fresh blocks. Its old
+// chain, if any, is left alone: the callers have none, or one the free map
+// never counted. false when no block could be had.
+inline bool writeChildList(OFSInstance* fs, TreeNode* dir, FileEntry& dir_entry,
+                           const vector<ChildRecord>& children) {
+    uint32_t capacity = getChildPageCapacity(fs);
+
+    // pages filled in name order; starts[i] is the first record of page i
+    vector<size_t> starts;
+    size_t used = capacity;
+    for (size_t i = 0; i < children.size(); i++) {
+        size_t size = getChildRecordSize(children[i]);
+        if (size > capacity) return false;
+        if (used + size > capacity) {
+            starts.push_back(i);
+            used = 0;
+        }
+        used += size;
+    }
+
+    vector<uint32_t> blocks;
+    if (!starts.empty()) {
+        // blocks promised to buffered files can't be handed out again
+        if (fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + starts.size()) {
+            return false;
+        }
+        blocks = allocateFileBlocks(fs->free_manager, starts.size(), getHomeGroup(fs, dir->entryIndex));
+        if (blocks.empty()) return false;
+    }
+
+    ChildPages& pages = fs->child_pages.put(dir->entryIndex);
+    vector<uint8_t> stream;
+    for (size_t i = 0; i < starts.size(); i++) {
+        size_t end = i + 1 < starts.size() ? starts[i + 1] : children.size();
+        encodeChildPage(fs, children.data() + starts[i], end - starts[i], stream);
+        pages.blocks.push_back(blocks[i]);
+        pages.firstNames.push_back(children[starts[i]].name);
+    }
+    if (!blocks.empty()) {
+        writeBlockChain(fs, blocks, (const char*)stream.data(), stream.size());
+    }
+
+    updateChildListEntry(fs, dir, dir_entry, pages, children.size());
+    return true;
+}
+
+// records a new child in name order; false when no block could be had for it
+inline bool addChildEntry(OFSInstance* fs, TreeNode* dir, uint32_t child_index, string_view name) {
+    FileEntry dir_entry;
+    if (!readFileEntry(fs, dir->entryIndex, dir_entry)) return false;
+
+    // a directory without a list yet starts an empty one
+    if (!hasChildIndex(dir_entry)) {
+        dir_entry.inode = 0;
+        setEntryField(dir_entry, ENTRY_CHILD_COUNT_OFFSET, 0);
+        setEntryField(dir_entry, ENTRY_CHILD_BLOCKS_OFFSET, 0);
+    }
+
+    ChildRecord record(child_index, name);
+    uint32_t capacity = getChildPageCapacity(fs);
+    if (getChildRecordSize(record) > capacity) return false;
+
+    ChildPages& pages = getChildPages(fs, dir->entryIndex, dir_entry);
+    uint32_t count = getEntryField(dir_entry, ENTRY_CHILD_COUNT_OFFSET);
+    uint32_t home_group = getHomeGroup(fs, dir->entryIndex);
+
+    if (pages.blocks.empty()) {
+        if (fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + 1) return false;
+        vector<uint32_t> block = allocateFileBlocks(fs->free_manager, 1, home_group);
+        if (block.empty()) return false;
+
+        writeChildPage(fs, block[0], 0, vector<ChildRecord>(1, record), 0, 1);
+        pages.blocks.push_back(block[0]);
+        pages.firstNames.push_back(record.name);
+        updateChildListEntry(fs, dir, dir_entry, pages, count + 1);
+        return true;
+    }
+
+    size_t p = pages.pageFor(record.name);
+    vector<uint8_t> page;
+    if (!readChildPage(fs, pages.blocks[p], page)) return false;
+
+    vector<ChildRecord> records;
+    parseChildPage(page, records);
+    size_t position = 0;
+    size_t used = 0;
+    while (position < records.size() && records[position].name < record.name) {
+        used += getChildRecordSize(records[position]);
+        position++;
+    }
+    for (size_t i = position; i < records.size(); i++) {
+        used += getChildRecordSize(records[i]);
+    }
+    records.insert(records.begin() + position, record);
+    used += getChildRecordSize(record);
+
+    uint32_t next = p + 1 < pages.blocks.size() ? pages.blocks[p + 1] : 0;
+    if (used <= capacity) {
+        writeChildPage(fs, pages.blocks[p], next, records, 0, records.size());
+        pages.firstNames[p] = records[0].name;
+        updateChildListEntry(fs, dir, dir_entry, pages, count + 1);
+        return true;
+    }
+
+    // the page is full: split it in two. A name past the end of the last
+    // page (names created in order) gets a page of its own instead, so
+    // appending leaves full pages behind
+    size_t split = records.size() - 1;
+    if (p + 1 < pages.blocks.size() || position + 1 < records.size()) {
+        size_t left = 0;
+        split = 0;
+        while (split < records.size() - 1 && left + getChildRecordSize(records[split]) <= used / 2) {
+            left += getChildRecordSize(records[split]);
+            split++;
+        }
+        if (split == 0) split = 1;
+        while (split < records.size() - 1 && used - left > capacity) {
+            left += getChildRecordSize(records[split]);
+            split++;
+        }
+    }
+
+    if (fs->free_manager->getFreeBlocks() < fs->delayed_writes.getReservedBlocks() + 1) return false;
+    vector<uint32_t> block = allocateFileBlocks(fs->free_manager, 1, home_group);
+    if (block.empty()) return false;
+
+    // the new page is complete before the old one links to it
+    writeChildPage(fs, block[0], next, records, split, records.size() - split);
+    writeChildPage(fs, pages.blocks[p], block[0], records, 0, split);
+
+    pages.blocks.insert(pages.blocks.begin() + p + 1, block[0]);
+    pages.firstNames[p] = records[0].name;
+    pages.firstNames.insert(pages.firstNames.begin() + p + 1, records[split].name);
+    updateChildListEntry(fs, dir, dir_entry, pages, count + 1);
+    return true;
+}
+
+// forgets a child's record under the given name
+inline void removeChildEntry(OFSInstance* fs, TreeNode* dir, uint32_t child_index, string_view name) {
+    FileEntry dir_entry;
+    if (!readFileEntry(fs, dir->entryIndex, dir_entry) || !hasChildIndex(dir_entry)) return;
+
+    ChildPages& pages = getChildPages(fs, dir->entryIndex, dir_entry);
+    if (pages.blocks.empty()) return;
+
+    string_view key = childRecordName(name);
+    size_t home = pages.pageFor(key);
+    size_t p = home;
+    vector<uint8_t> page;
+    vector<ChildRecord> records;
+    size_t found = 0;
+
+    // the page the name sorts onto holds it, unless a repeated name (only
+    // possible after a crash) runs over a page boundary
+    for (size_t attempt = 0; attempt <= pages.blocks.size(); attempt++) {
+        if (attempt > 0) {
+            if (attempt - 1 == home) continue;
+            p = attempt - 1;
+        }
+        records.clear();
+        if (!readChildPage(fs, pages.blocks[p], page)) continue;
+        parseChildPage(page, records);
+
+        for (found = 0; found < records.size(); found++) {
+            if (records[found].entryIndex == child_index && records[found].name == key) break;
+        }
+        if (found < records.size()) break;
+    }
+    if (found >= records.size()) return;
+
+    records.erase(records.begin() + found);
+    uint32_t count = getEntryField(dir_entry, ENTRY_CHILD_COUNT_OFFSET);
+    uint32_t next = p + 1 < pages.blocks.size() ? pages.blocks[p + 1] : 0;
+
+    if (!records.empty()) {
+        writeChildPage(fs, pages.blocks[p], next, records, 0, records.size());
+        pages.firstNames[p] = records[0].name;
+        updateChildListEntry(fs, dir, dir_entry, pages, count - 1);
+        return;
+    }
+
+    // an emptied page leaves the chain; the first one's successor becomes
+    // the head when the entry is written
+    uint32_t emptied = pages.blocks[p];
+    if (p > 0) setChildPageNext(fs, pages.blocks[p - 1], next);
+    pages.blocks.erase(pages.blocks.begin() + p);
+    pages.firstNames.erase(pages.firstNames.begin() + p);
+    updateChildListEntry(fs, dir, dir_entry, pages, count - 1);
+
+    // the list stops pointing at the page before it is given back; under a
+    // held flush that waits for its end, which is safe as child lists are
+    // rebuilt from the entry table after a crash
+    fs->free_manager->freeBlockSegments(vector<uint32_t>(1, emptied));
+}
+
+// writes a fresh child list for every directory of a fully loaded tree.
+// Old chains are overwritten, not freed: this only runs against a free map
+// that never counted them (a legacy image or one rebuilt after a crash).
+inline bool buildChildLists(OFSInstance* fs) {
+    vector<TreeNode*> stack;
+    stack.push_back(fs->file_tree->getRoot());
+
+    while (!stack.empty()) {
+        TreeNode* dir = stack.back();
+        stack.pop_back();
+
+        vector<ChildRecord> children;
+        for (size_t i = 0; i < dir->children.size(); i++) {
+            children.push_back(ChildRecord(dir->children[i]->entryIndex, dir->children[i]->name));
+            if (!dir->children[i]->isFile) {
+                stack.push_back(dir->children[i]);
+            }
+        }
+        sort(children.begin(), children.end(),
+             [](const ChildRecord& a, const ChildRecord& b) { return a.name < b.name; });
+
+        FileEntry dir_entry;
+        readFileEntry(fs, dir->entryIndex, dir_entry);
+        if (!writeChildList(fs, dir, dir_entry, children)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// a directory's children as named by its child list, read from the entry
+// table in table order (also the order a full load lists them in); visit
+// gets each live entry that names the directory as its parent
+template <typename Visit>
+inline void readChildEntries(OFSInstance* fs, uint32_t dir_index, Visit visit) {
+    FileEntry dir_entry;
+    if (!readFileEntry(fs, dir_index, dir_entry)) return;
+
+    vector<ChildRecord> records = readChildList(fs, dir_entry);
+
+    vector<uint32_t> children;
+    for (size_t i = 0; i < records.size(); i++) {
+        children.push_back(records[i].entryIndex);
+    }
+    sort(children.begin(), children.end());
+
+    for (size_t i = 0; i < children.size(); i++) {
+        uint32_t child_index = children[i];
+        if (child_index < 2 || child_index >= fs->config.max_files) continue;
+
+        FileEntry entry;
+        if (!readFileEntry(fs, child_index, entry) || !entry.isValid() || entry.name[0] == '\0') {
+            continue;
+        }
+
+        // parent 0 has always been read as the root
+        uint32_t parent_idx = entry.parent_index == 0 ? 1 : entry.parent_index;
+        if (parent_idx != dir_index) continue;
+
+        visit(child_index, entry);
+    }
+}
+
+// FileTree child loader: reads a directory's child list and the entries
+// it names. Subdirectories come back unloaded.
+inline void loadDirectoryChildren(OFSInstance* fs, TreeNode* dir) {
+    readChildEntries(fs, dir->entryIndex, [&](uint32_t child_index, const FileEntry& entry) {
+        // a name cut to max_filename_length can repeat; the first keeps it,
+        // as in loadEntryTable
+        if (dir->findChild(entry.name)) return;
+
+        TreeNode* node = createNodeFromEntry(entry, child_index);
+        if (!node->isFile) {
+            node->childrenLoaded = false;
+        }
+        dir->addChild(node);
+    });
+}
+
+// FileTree child lister: the names a search sees in a directory that is
+// still on disk, without making nodes for them
+inline void listDirectoryChildren(OFSInstance* fs, uint32_t dir_index, vector<DiskChild>& children) {
+    readChildEntries(fs, dir_index, [&](uint32_t child_index, const FileEntry& entry) {
+        children.push_back(DiskChild(child_index, entry.name,
+                                     entry.getType() == EntryType::DIRECTORY));
+    });
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+#include "odf_ext_types.hpp"
+#include "ofs_instance.h"
+#include "session_manager.h"
+#include <unistd.h>
+
+using namespace std;
+
+// the durability mode calls from this session run with
+inline uint32_t getDurability(OFSInstance* fs, ManagedSession* ms) {
+    if (ms && ms->durability != DURABILITY_DEFAULT) return ms->durability;
+    return fs->config.durability;
+}
+
+// strict and group calls are durable once they return, so what they
+// write can't be left in the delayed write cache
+inline bool buffersContent(uint32_t mode) {
+    return mode == DURABILITY_NONE || mode == DURABILITY_PERIODIC;
+}
+
+// Takes the operation lock for a mutating API call and, once the call is
+// done, makes what it committed as durable as the mode asks. Nested calls
+// (a batch, a transaction commit) only lock; the outermost one syncs. The
+// sync runs after the lock is released, so other sessions keep working
+// and, in the group mode, can share it.
+class DurableOperation {
+private:
+    OFSInstance* fs;
+    uint32_t mode;
+    bool outermost;
+
+public:
+    DurableOperation(OFSInstance* instance, ManagedSession* ms)
+        : fs(instance), mode(getDurability(instance, ms)) {
+        fs->group_commit.enter();
+        fs->op_lock.lock();
+        outermost = fs->op_depth++ == 0;
+        if (outermost) fs->op_flushes = 0;
+    }
+
+    // for calls that learn the session only once they hold the lock
+    void setMode(uint32_t durability) {
+        mode = durability;
+    }
+
+    bool buffersContent() const {
+        return ::buffersContent(mode);
+    }
+
+    ~DurableOperation() {
+        fs->op_depth--;
+        uint64_t ticket = 0;
+        if (outermost && fs->op_flushes > 0 && mode != DURABILITY_NONE) {
+            ticket = fs->group_commit.ticket();
+        }
+        int fd = fileno(fs->omni_file);
+        uint32_t window_us = fs->config.group_commit_window_us;
+        GroupCommit& group_commit = fs->group_commit;
+        group_commit.leave();
+        fs->op_lock.unlock();
+
+        // periodic leaves the ticket to the background thread
+        if (ticket == 0 || mode == DURABILITY_PERIODIC) return;
+        if (mode == DURABILITY_STRICT) {
+            group_commit.syncAlone([fd]() { fdatasync(fd); });
+        } else {
+            group_commit.waitDurable(ticket, window_us, [fd]() { fdatasync(fd); });
+        }
+    }
+
+    DurableOperation(const DurableOperation&) = delete;
+    DurableOperation& operator=(const DurableOperation&) = delete;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include "odf_ext_types.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+
+// Lets commits that finish close together share one sync. A committer
+// takes a ticket once its writes have been handed to the OS, then waits
+// for a sync that started after that. The first waiter finding no sync
+// running leads: while other calls are still on their way to a ticket it
+// waits for them, up to the window, then syncs once and wakes every
+// waiter whose ticket that sync covered. A leader with nobody behind it
+// syncs straight away, so a lone committer pays no window. Waiting
+// happens outside the operation lock, so other sessions keep committing
+// (and joining the next sync) meanwhile. Every sync the durability modes
+// issue goes through here, so it also keeps their counters.
+class GroupCommit {
+private:
+    mutex lock;
+    condition_variable synced;
+    condition_variable settled;     // inFlight dropped to zero
+    uint32_t inFlight;              // calls entered that have not left
+    uint64_t issued;                // tickets handed out
+    uint64_t durable;               // every ticket up to this one is synced
+    bool syncing;
+    uint64_t syncs;                 // syncs run
+    uint64_t commits;               // tickets those syncs covered
+    uint64_t periodicSyncs;
+    uint64_t syncTimeUs;
+    uint64_t syncLatency[DURABILITY_HISTOGRAM_BUCKETS];
+    uint64_t waitLatency[DURABILITY_HISTOGRAM_BUCKETS];
+
+    static size_t bucketOf(uint64_t us) {
+        size_t bucket = 0;
+        while (us >= 2 && bucket + 1 < DURABILITY_HISTOGRAM_BUCKETS) {
+            us >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    static uint64_t elapsedUs(chrono::steady_clock::time_point since) {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - since).count();
+    }
+
+    // syncs with the lock released; covers every ticket handed out before
+    // it started, since those writes are already in the OS's hands
+    void runSync(unique_lock<mutex>& guard, const function<void()>& sync, bool periodic) {
+        uint64_t covered = issued;
+        guard.unlock();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        sync();
+        uint64_t us = elapsedUs(start);
+        guard.lock();
+
+        syncs++;
+        if (periodic) periodicSyncs++;
+        syncTimeUs += us;
+        syncLatency[bucketOf(us)]++;
+        if (covered > durable) {
+            commits += covered - durable;
+            durable = covered;
+        }
+        synced.notify_all();
+    }
+
+public:
+    GroupCommit() : inFlight(0), issued(0), durable(0), syncing(false), syncs(0), commits(0),
+                    periodicSyncs(0), syncTimeUs(0) {
+        for (size_t i = 0; i < DURABILITY_HISTOGRAM_BUCKETS; i++) {
+            syncLatency[i] = 0;
+            waitLatency[i] = 0;
+        }
+    }
+
+    // a mutating call is under way (or waiting for the operation lock)
+    // and may yet take a ticket
+    void enter() {
+        lock_guard<mutex> guard(lock);
+        inFlight++;
+    }
+
+    void leave() {
+        lock_guard<mutex> guard(lock);
+        if (--inFlight == 0) settled.notify_all();
+    }
+
+    uint64_t ticket() {
+        lock_guard<mutex> guard(lock);
+        return ++issued;
+    }
+
+    // returns once a sync covering the ticket has finished
+    void waitDurable(uint64_t ticket, uint32_t window_us, const function<void()>& sync) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        unique_lock<mutex> guard(lock);
+        while (durable < ticket) {
+            if (syncing) {
+                synced.wait(guard);
+                continue;
+            }
+
+            syncing = true;
+            if (window_us > 0 && inFlight > 0) {
+                settled.wait_for(guard, chrono::microseconds(window_us), [this]() { return inFlight == 0; });
+            }
+
+            runSync(guard, sync, false);
+            syncing = false;
+        }
+        waitLatency[bucketOf(elapsedUs(start))]++;
+    }
+
+    // a sync of the caller's own, whatever else is running (strict mode)
+    void syncAlone(const function<void()>& sync) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        unique_lock<mutex> guard(lock);
+        runSync(guard, sync, false);
+        waitLatency[bucketOf(elapsedUs(start))]++;
+    }
+
+    // syncs if a ticket is still waiting for one and no sync is running
+    // (periodic mode's background thread)
+    void syncPending(const function<void()>& sync) {
+        unique_lock<mutex> guard(lock);
+        if (syncing || durable >= issued) return;
+
+        syncing = true;
+        runSync(guard, sync, true);
+        syncing = false;
+    }
+
+    uint64_t getSyncCount() {
+        lock_guard<mutex> guard(lock);
+        return syncs;
+    }
+
+    uint64_t getCommitCount() {
+        lock_guard<mutex> guard(lock);
+        return commits;
+    }
+
+    void getStats(DurabilityStats& stats) {
+        lock_guard<mutex> guard(lock);
+        stats.syncs = syncs;
+        stats.periodic_syncs = periodicSyncs;
+        stats.synced_operations = commits;
+        stats.sync_time_us = syncTimeUs;
+        for (size_t i = 0; i < DURABILITY_HISTOGRAM_BUCKETS; i++) {
+            stats.sync_latency[i] = syncLatency[i];
+            stats.wait_latency[i] = waitLatency[i];
+        }
+    }
+};
+
+#endif
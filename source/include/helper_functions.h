@@ -3,29 +3,59 @@
 
 #include "../include/odf_types.hpp"
 #include "ofs_instance.h"
+#include "journal.h"
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <algorithm>
+#include <ctime>
+#include <unordered_set>
+#include <functional>
 
 using namespace std;
 
-inline uint32_t findFreeEntryIndex(OFSInstance* fs, uint32_t max_files = 1000) {
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo));
-    
-    for (uint32_t i = 2; i < max_files; i++) {
-        uint64_t offset = file_entry_offset + (i * sizeof(FileEntry));
-        fseek(fs->omni_file, offset, SEEK_SET);
-        
-        FileEntry entry;
-        if (fread(&entry, sizeof(FileEntry), 1, fs->omni_file) == 1) {
-            if (entry.name[0] == '\0' || !entry.isValid()) { 
-                return i;
-            }
-        }
-    }
-    
-    return 0; 
+// FileEntry slots apart two batched entry updates can be and still share
+// one read and one write (16 entries: about 6.5KB)
+#define ENTRY_BATCH_GAP 16
+
+// most blocks readChainData asks for in one read
+#define CHAIN_READ_RUN_BLOCKS 256
+
+inline uint64_t calculateContentOffset(const OMNIHeader& header, uint32_t max_files) {
+    uint64_t file_entry_offset = header.user_table_offset + 
+                                (header.max_users * sizeof(UserInfo));
+    return file_entry_offset + (max_files * sizeof(FileEntry));
+}
+
+inline uint32_t calculateTotalBlocks(uint64_t total_size, uint64_t content_offset, uint64_t block_size) {
+    uint64_t remaining_space = total_size - content_offset;
+    return remaining_space / block_size;
+}
+
+// flush after a metadata update, unless a batch is holding flushes back
+// to do a single one at its end; the entries written since the last flush
+// go to the journal as one record
+inline void flushMetadata(OFSInstance* fs) {
+    if (fs->flush_hold == 0) commitMetadata(fs);
+}
+
+// deleted file whose block chain is still queued for the reclaimer
+inline bool isPendingReclaim(const FileEntry& entry) {
+    return !entry.isValid() && (entry.reserved[0] & ENTRY_FLAG_PENDING_RECLAIM);
+}
+
+// takes a free FileEntry slot from the in-memory map, 0 when the table is full
+// a slot changing hands takes its directory's page index with it
+inline uint32_t allocateEntryIndex(OFSInstance* fs) {
+    uint32_t entry_index = fs->entry_slots.acquire();
+    fs->child_pages.erase(entry_index);
+    return entry_index;
+}
+
+inline void releaseEntryIndex(OFSInstance* fs, uint32_t entry_index) {
+    fs->entry_slots.release(entry_index);
+    fs->child_pages.erase(entry_index);
 }
 
 inline string simple_hash(const string& password) {
@@ -73,29 +103,22 @@ inline uint32_t calculateBlocksNeeded(uint64_t size, uint32_t usable_block_size)
     return (size + usable_block_size - 1) / usable_block_size;
 }
 
-inline vector<uint32_t> allocateFileBlocks(FreeSpaceManager* free_manager, uint32_t blocks_needed) {
-    vector<uint32_t> blocks;
+inline vector<uint32_t> allocateFileBlocks(FreeSpaceManager* free_manager, uint32_t blocks_needed,
+                                           uint32_t preferred_group = 0) {
+    if (blocks_needed == 0) return vector<uint32_t>();
     
-    if (blocks_needed == 0) return blocks;
-    
-    vector<uint32_t> contiguous_blocks = free_manager->allocateBlocks(blocks_needed);
+    vector<uint32_t> contiguous_blocks = free_manager->allocateBlocks(blocks_needed, preferred_group);
     if (!contiguous_blocks.empty()) {
         return contiguous_blocks;
     }
     
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        vector<uint32_t> single_block = free_manager->allocateBlocks(1);
-        if (!single_block.empty()) {
-            blocks.push_back(single_block[0]);
-        } else {
-            if (!blocks.empty()) {
-                free_manager->freeBlockSegments(blocks);
-            }
-            return vector<uint32_t>();
-        }
-    }
-    
-    return blocks;
+    // no single extent is big enough, take the blocks as a few shorter runs
+    return free_manager->allocateRuns(blocks_needed, preferred_group);
+}
+
+// allocation group new blocks for a file should come from: its parent directory's
+inline uint32_t getHomeGroup(OFSInstance* fs, uint32_t parent_index) {
+    return fs->free_manager->groupForDirectory(parent_index);
 }
 
 inline vector<uint32_t> getBlockChain(OFSInstance* fs, uint32_t startBlock) {
@@ -104,9 +127,7 @@ inline vector<uint32_t> getBlockChain(OFSInstance* fs, uint32_t startBlock) {
     
     if (startBlock == 0) return blocks;
     
-    uint64_t content_offset = fs->header.user_table_offset + 
-                             (fs->header.max_users * sizeof(UserInfo)) +
-                             (1000 * sizeof(FileEntry));
+    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
     
     while (current_block != 0) {
         blocks.push_back(current_block);
@@ -124,62 +145,338 @@ inline vector<uint32_t> getBlockChain(OFSInstance* fs, uint32_t startBlock) {
     return blocks;
 }
 
-inline string reconstructPath(OFSInstance* fs, uint32_t entry_index) {
-    if (entry_index == 0) {
-        return "";
+inline uint64_t getFileEntryOffset(OFSInstance* fs, uint32_t entry_index) {
+    return fs->header.user_table_offset + 
+           (fs->header.max_users * sizeof(UserInfo)) +
+           ((uint64_t)entry_index * sizeof(FileEntry));
+}
+
+// with the journal on, the latest image of an entry may not be home yet
+inline bool readFileEntry(OFSInstance* fs, uint32_t entry_index, FileEntry& entry) {
+    if (const FileEntry* image = fs->journal.find(entry_index)) {
+        entry = *image;
+        return true;
+    }
+    fseek(fs->omni_file, getFileEntryOffset(fs, entry_index), SEEK_SET);
+    return fread(&entry, sizeof(FileEntry), 1, fs->omni_file) == 1;
+}
+
+inline bool writeFileEntry(OFSInstance* fs, uint32_t entry_index, const FileEntry& entry) {
+    if (fs->journal.isEnabled()) {
+        fs->journal.stage(entry_index, entry);
+        return true;
     }
+    fseek(fs->omni_file, getFileEntryOffset(fs, entry_index), SEEK_SET);
+    return fwrite(&entry, sizeof(FileEntry), 1, fs->omni_file) == 1;
+}
+
+// read-modify-writes many FileEntries with few large I/Os: sorted indexes
+// at most ENTRY_BATCH_GAP slots apart share one read and one write of the
+// slots between them. update gets each index's position and its entry.
+inline bool updateFileEntries(OFSInstance* fs, const vector<uint32_t>& indexes,
+                              const function<void(size_t, FileEntry&)>& update) {
+    bool ok = true;
+    vector<FileEntry> span;
     
-    if (entry_index == 1) {
-        return "/";
+    size_t first = 0;
+    while (first < indexes.size()) {
+        size_t last = first;
+        while (last + 1 < indexes.size() && indexes[last + 1] - indexes[last] <= ENTRY_BATCH_GAP) {
+            last++;
+        }
+        
+        uint32_t base = indexes[first];
+        span.resize(indexes[last] - base + 1);
+        fseek(fs->omni_file, getFileEntryOffset(fs, base), SEEK_SET);
+        if (fread(span.data(), sizeof(FileEntry), span.size(), fs->omni_file) != span.size()) {
+            ok = false;
+        } else {
+            for (size_t i = first; i <= last; i++) {
+                FileEntry& entry = span[indexes[i] - base];
+                if (const FileEntry* image = fs->journal.find(indexes[i])) entry = *image;
+                update(i, entry);
+                if (fs->journal.isEnabled()) fs->journal.stage(indexes[i], entry);
+            }
+            if (!fs->journal.isEnabled()) {
+                fseek(fs->omni_file, getFileEntryOffset(fs, base), SEEK_SET);
+                ok = fwrite(span.data(), sizeof(FileEntry), span.size(), fs->omni_file) == span.size() && ok;
+            }
+        }
+        
+        first = last + 1;
     }
     
-    const int MAX_DEPTH = 100;
-    string path_components[MAX_DEPTH];
-    int component_count = 0;
-    uint32_t current_index = entry_index;
+    return ok;
+}
+
+// writes data across a freshly allocated chain, linking the blocks and
+// zero filling the tail; each contiguous run goes out in a single write
+inline void writeBlockChain(OFSInstance* fs, const vector<uint32_t>& blocks, const char* data, size_t size) {
+    uint64_t block_size = fs->header.block_size;
+    uint32_t usable_block_size = getUsableBlockSize(fs);
+    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
     
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo));
+    size_t written = 0;
+    size_t run_start = 0;
     
-    while (current_index != 0 && current_index != 1 && component_count < MAX_DEPTH) {
-        uint64_t offset = file_entry_offset + (current_index * sizeof(FileEntry));
-        fseek(fs->omni_file, offset, SEEK_SET);
+    while (run_start < blocks.size()) {
+        size_t run_end = run_start + 1;
+        while (run_end < blocks.size() && blocks[run_end] == blocks[run_end - 1] + 1) {
+            run_end++;
+        }
         
-        FileEntry entry;
-        if (fread(&entry, sizeof(FileEntry), 1, fs->omni_file) != 1) {
-            return "";
+        vector<char> buffer((run_end - run_start) * block_size, 0);
+        for (size_t i = run_start; i < run_end; i++) {
+            char* block = buffer.data() + ((i - run_start) * block_size);
+            
+            uint32_t next_block = (i < blocks.size() - 1) ? blocks[i + 1] : 0;
+            memcpy(block, &next_block, sizeof(uint32_t));
+            
+            size_t to_write = min(size - written, (size_t)usable_block_size);
+            if (to_write > 0 && data) {
+                memcpy(block + 4, data + written, to_write);
+            }
+            written += to_write;
         }
         
-        if (!entry.isValid()) {
-            return "";
+        fseek(fs->omni_file, content_offset + ((uint64_t)blocks[run_start] * block_size), SEEK_SET);
+        fwrite(buffer.data(), 1, buffer.size(), fs->omni_file);
+        
+        run_start = run_end;
+    }
+}
+
+// reads size bytes of content through a chain; while the chain runs through
+// consecutive blocks they come in up to CHAIN_READ_RUN_BLOCKS per read
+inline bool readChainData(OFSInstance* fs, uint32_t start_block, uint64_t size, vector<char>& data) {
+    uint64_t block_size = fs->header.block_size;
+    uint32_t usable_block_size = getUsableBlockSize(fs);
+    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
+    uint32_t total_blocks = fs->free_manager->getTotalBlocks();
+    
+    data.assign(size, 0);
+    vector<char> buffer;
+    size_t done = 0;
+    uint32_t current_block = start_block;
+    
+    while (done < size) {
+        if (current_block == 0 || current_block >= total_blocks) {
+            return false;
         }
         
-        path_components[component_count] = string(entry.name);
-        component_count++;
+        uint64_t blocks_left = (size - done + usable_block_size - 1) / usable_block_size;
+        size_t window = min(min(blocks_left, (uint64_t)CHAIN_READ_RUN_BLOCKS),
+                            (uint64_t)(total_blocks - current_block));
+        buffer.resize(window * block_size);
         
-        current_index = entry.parent_index;
+        fseek(fs->omni_file, content_offset + ((uint64_t)current_block * block_size), SEEK_SET);
+        if (fread(buffer.data(), 1, buffer.size(), fs->omni_file) != buffer.size()) {
+            return false;
+        }
+        
+        // take blocks from the window for as long as the chain stays in it
+        uint32_t next_block = 0;
+        for (size_t i = 0; i < window && done < size; i++) {
+            const char* block = buffer.data() + (i * block_size);
+            memcpy(&next_block, block, sizeof(uint32_t));
+            
+            size_t to_read = min(size - done, (size_t)usable_block_size);
+            memcpy(data.data() + done, block + 4, to_read);
+            done += to_read;
+            
+            if (next_block != current_block + i + 1) break;
+        }
+        current_block = next_block;
     }
     
-    if (component_count == 0) {
-        return "";
+    return true;
+}
+
+// allocates blocks for a buffered file now that its size is known and writes it out
+inline int flushDelayedFile(OFSInstance* fs, uint32_t entry_index) {
+    DirtyFile* dirty = fs->delayed_writes.find(entry_index);
+    if (!dirty) {
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+    
+    TreeNode* node = dirty->node;
+    uint32_t parent_idx = node->parent ? node->parent->entryIndex : 1;
+    uint32_t blocks_needed = calculateBlocksNeeded(dirty->data.size(), getUsableBlockSize(fs));
+    
+    vector<uint32_t> blocks = allocateFileBlocks(fs->free_manager, blocks_needed,
+                                                 getHomeGroup(fs, parent_idx));
+    if (blocks.empty()) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    
+    writeBlockChain(fs, blocks, dirty->data.data(), dirty->data.size());
+    
+    FileEntry file_entry;
+    readFileEntry(fs, entry_index, file_entry);
+    file_entry.size = dirty->data.size();
+    file_entry.inode = blocks[0];
+    file_entry.modified_time = node->modified_time;
+    writeFileEntry(fs, entry_index, file_entry);
+    flushMetadata(fs);
+    
+    node->startBlockIndex = blocks[0];
+    fs->file_tree->setFileSize(node, dirty->data.size());
+    fs->delayed_writes.remove(entry_index);
+    
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// flushes every buffer dirty since before cutoff (pass time(nullptr) for all)
+inline int flushDelayedWrites(OFSInstance* fs, time_t cutoff) {
+    int result = static_cast<int>(OFSErrorCodes::SUCCESS);
+    
+    vector<uint32_t> entries = fs->delayed_writes.dirtySince(cutoff);
+    for (size_t i = 0; i < entries.size(); i++) {
+        int flushed = flushDelayedFile(fs, entries[i]);
+        if (flushed != static_cast<int>(OFSErrorCodes::SUCCESS)) {
+            result = flushed;
+        }
+    }
+    
+    return result;
+}
+
+// memory pressure: flush the oldest buffers until under delayed_flush_bytes
+inline void enforceDelayedWriteLimit(OFSInstance* fs) {
+    if (fs->delayed_writes.getBufferedBytes() <= fs->config.delayed_flush_bytes) {
+        return;
+    }
+    
+    vector<uint32_t> entries = fs->delayed_writes.oldestFirst();
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (fs->delayed_writes.getBufferedBytes() <= fs->config.delayed_flush_bytes) {
+            break;
+        }
+        flushDelayedFile(fs, entries[i]);
+    }
+}
+
+// frees up to max_blocks blocks of the oldest deleted file; the FileEntry is
+// moved past the batch before the blocks are released, so a crash never
+// leaves it pointing into blocks another file may have reused.
+// returns true while the queue still has work
+inline bool reclaimBatch(OFSInstance* fs, uint32_t max_blocks) {
+    PendingReclaim* item = fs->reclaim_queue.front();
+    if (!item) {
+        return false;
+    }
+    
+    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
+    uint32_t total_blocks = fs->free_manager->getTotalBlocks();
+    
+    vector<uint32_t> batch;
+    uint32_t current_block = item->nextBlock;
+    
+    while (current_block != 0 && current_block < total_blocks && batch.size() < max_blocks) {
+        batch.push_back(current_block);
+        
+        fseek(fs->omni_file, content_offset + ((uint64_t)current_block * fs->header.block_size), SEEK_SET);
+        uint32_t next_block;
+        if (fread(&next_block, sizeof(uint32_t), 1, fs->omni_file) != 1) {
+            next_block = 0;
+        }
+        current_block = next_block;
+    }
+    
+    if (current_block >= total_blocks) {
+        current_block = 0;
+    }
+    
+    FileEntry entry;
+    readFileEntry(fs, item->entryIndex, entry);
+    if (current_block == 0) {
+        entry.reserved[0] &= ~ENTRY_FLAG_PENDING_RECLAIM;
+        entry.inode = 0;
+        entry.size = 0;
+        releaseEntryIndex(fs, item->entryIndex);
+    } else {
+        entry.inode = current_block;
+        uint64_t freed_bytes = (uint64_t)batch.size() * getUsableBlockSize(fs);
+        entry.size = entry.size > freed_bytes ? entry.size - freed_bytes : 0;
     }
+    writeFileEntry(fs, item->entryIndex, entry);
+    commitMetadata(fs);
+    
+    fs->free_manager->freeBlockSegments(batch);
+    fs->reclaim_queue.advance(current_block, batch.size());
     
-    if (component_count >= MAX_DEPTH) {
-        return "";
+    return !fs->reclaim_queue.empty();
+}
+
+inline void drainReclaimQueue(OFSInstance* fs) {
+    while (reclaimBatch(fs, fs->config.reclaim_batch_blocks)) {}
+}
+
+// lazy loading: drops cold directories once more than lazy_max_nodes nodes
+// are loaded, down to three quarters of it. Directories above a buffered
+// file stay, the delayed write cache points into them.
+inline void trimLoadedTree(OFSInstance* fs) {
+    if (fs->file_tree->getNodeCount() <= fs->config.lazy_max_nodes) {
+        return;
     }
     
-    string path = "/";
-    for (int i = component_count - 1; i >= 0; i--) {
-        path += path_components[i];
-        if (i > 0) {
-            path += "/";
+    unordered_set<TreeNode*> pinned;
+    vector<uint32_t> dirty = fs->delayed_writes.oldestFirst();
+    for (size_t i = 0; i < dirty.size(); i++) {
+        DirtyFile* file = fs->delayed_writes.find(dirty[i]);
+        for (TreeNode* dir = file ? file->node->parent : nullptr; dir; dir = dir->parent) {
+            if (!pinned.insert(dir).second) break;
         }
     }
     
-    return path;
+    fs->file_tree->evictColdDirectories(fs->config.lazy_max_nodes / 4 * 3, pinned);
 }
 
-inline uint32_t getParentIndexFromPath(OFSInstance* fs, const string& path) {
+// one tick of the maintenance thread; every task runs under op_lock so it
+// only ever happens between API calls
+inline void runMaintenanceTasks(OFSInstance* fs) {
+    if (fs->config.delayed_allocation) {
+        lock_guard<recursive_mutex> lock(fs->op_lock);
+        flushDelayedWrites(fs, time(nullptr) - fs->config.delayed_flush_seconds);
+    }
+    
+    if (fs->config.lazy_load) {
+        lock_guard<recursive_mutex> lock(fs->op_lock);
+        trimLoadedTree(fs);
+    }
+    
+    // one batch per lock hold, so a huge delete doesn't stall callers
+    bool more = true;
+    while (more) {
+        lock_guard<recursive_mutex> lock(fs->op_lock);
+        more = reclaimBatch(fs, fs->config.reclaim_batch_blocks);
+    }
+}
+
+// get_metadata's view of a node; a directory reports everything below it
+inline void fillMetadata(OFSInstance* fs, TreeNode* node, string_view path, FileMetadata* meta) {
+    size_t path_length = min(path.size(), sizeof(meta->path) - 1);
+    memcpy(meta->path, path.data(), path_length);
+    meta->path[path_length] = '\0';
+    
+    FileTree::fillListEntry(node, meta->entry);
+    
+    uint32_t usable_block_size = fs->header.block_size - 4;
+    if (node->isFile && node->size > 0) {
+        meta->blocks_used = (node->size + usable_block_size - 1) / usable_block_size;
+        meta->actual_size = meta->blocks_used * fs->header.block_size;
+    } else if (!node->isFile) {
+        DirectoryUsage usage = fs->file_tree->getUsage(node);
+        meta->entry.size = usage.bytes;
+        meta->blocks_used = usage.blocks;
+        meta->actual_size = usage.blocks * fs->header.block_size;
+    } else {
+        meta->blocks_used = 0;
+        meta->actual_size = 0;
+    }
+}
+
+inline uint32_t getParentIndexFromPath(OFSInstance* fs, string_view path) {
     if (path == "/" || path.empty()) {
         return 0;
     }
@@ -189,9 +486,7 @@ inline uint32_t getParentIndexFromPath(OFSInstance* fs, const string& path) {
         return 1;
     }
     
-    string parent_path = path.substr(0, last_slash);
-    
-    TreeNode* parent_node = fs->file_tree->findNode(parent_path);
+    TreeNode* parent_node = fs->file_tree->findNode(path.substr(0, last_slash));
     if (parent_node) {
         return parent_node->entryIndex;
     }
@@ -199,17 +494,32 @@ inline uint32_t getParentIndexFromPath(OFSInstance* fs, const string& path) {
     return 0;
 }
 
-inline string extractFilename(const string& path) {
+// directory a path would live in, nullptr if it doesn't exist
+inline TreeNode* getParentNodeFromPath(OFSInstance* fs, string_view path) {
+    size_t last_slash = path.find_last_of('/');
+    if (last_slash == string_view::npos || path == "/") {
+        return nullptr;
+    }
+    
+    TreeNode* parent_node = last_slash == 0 ? fs->file_tree->getRoot()
+                                            : fs->file_tree->findNode(path.substr(0, last_slash));
+    if (!parent_node || parent_node->isFile) {
+        return nullptr;
+    }
+    return parent_node;
+}
+
+inline string extractFilename(string_view path) {
     if (path == "/") {
         return "/";
     }
     
     size_t last_slash = path.find_last_of('/');
-    if (last_slash == string::npos) {
-        return path;
+    if (last_slash == string_view::npos) {
+        return string(path);
     }
     
-    return path.substr(last_slash + 1);
+    return string(path.substr(last_slash + 1));
 }
 
 inline bool validateParentChain(OFSInstance* fs, uint32_t entry_index) {
@@ -218,16 +528,11 @@ inline bool validateParentChain(OFSInstance* fs, uint32_t entry_index) {
     }
     
     uint32_t current_index = entry_index;
-    uint64_t file_entry_offset = fs->header.user_table_offset + 
-                                (fs->header.max_users * sizeof(UserInfo));
     
     int depth = 0;
     while (current_index != 1 && current_index != 0) {
-        uint64_t offset = file_entry_offset + (current_index * sizeof(FileEntry));
-        fseek(fs->omni_file, offset, SEEK_SET);
-        
         FileEntry entry;
-        if (fread(&entry, sizeof(FileEntry), 1, fs->omni_file) != 1) {
+        if (!readFileEntry(fs, current_index, entry)) {
             return false;
         }
         
@@ -246,15 +551,4 @@ inline bool validateParentChain(OFSInstance* fs, uint32_t entry_index) {
     return current_index == 1;
 }
 
-inline uint64_t calculateContentOffset(const OMNIHeader& header, uint32_t max_files) {
-    uint64_t file_entry_offset = header.user_table_offset + 
-                                (header.max_users * sizeof(UserInfo));
-    return file_entry_offset + (max_files * sizeof(FileEntry));
-}
-
-inline uint32_t calculateTotalBlocks(uint64_t total_size, uint64_t content_offset, uint64_t block_size) {
-    uint64_t remaining_space = total_size - content_offset;
-    return remaining_space / block_size;
-}
-
 #endif
\ No newline at end of file
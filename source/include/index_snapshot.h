@@ -0,0 +1,338 @@
+#ifndef INDEX_SNAPSHOT_H
+#define INDEX_SNAPSHOT_H
+
+#include "odf_types.hpp"
+#include "odf_ext_types.hpp"
+#include "ofs_instance.h"
+#include "checksum.h"
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstring>
+
+using namespace std;
+
+#define INDEX_SNAPSHOT_MAGIC "OFSI"
+#define INDEX_SNAPSHOT_VERSION 3
+
+// IndexSnapshotHeader.flags
+#define INDEX_SNAPSHOT_PARTIAL 0x01     // some directories were saved unloaded
+
+// IndexSnapshotNode.flags
+#define INDEX_NODE_UNLOADED 0x01        // directory whose children weren't in memory
+
+// Header of the index snapshot fs_shutdown writes after the free space
+// snapshot. fs_init only trusts it when its generation matches the one in
+// the header extension, i.e. nothing has been mounted since it was written.
+// With lazy loading only the loaded part of the tree is saved; the slot
+// bitmap, counts and attribute index cover the whole table either way.
+struct IndexSnapshotHeader {
+    char magic[4];              // "OFSI"
+    uint32_t version;           // INDEX_SNAPSHOT_VERSION
+    uint64_t generation;        // Header extension generation it belongs to
+    uint32_t maxFiles;          // Entry table size it was taken with
+    uint32_t nodeCount;         // Tree nodes, root first
+    uint32_t userCount;         // UserInfo records
+    uint32_t nameHeapSize;      // Bytes of names and owners
+    uint32_t slotBitmapSize;    // Bytes of the entry slot bitmap
+    uint32_t fileCount;         // Files in the whole tree
+    uint32_t directoryCount;    // Directories in the whole tree, root included
+    uint32_t flags;             // INDEX_SNAPSHOT_* flags
+    uint32_t payloadSize;       // Bytes following the header
+    uint32_t payloadChecksum;   // CRC-32 of the payload
+    uint32_t headerChecksum;    // CRC-32 of this header with this field zeroed
+    uint32_t attributeCount;    // IndexSnapshotAttribute records
+};  // Total: 64 bytes
+
+// One tree node; nodes are stored parents first, so a node's parent is
+// always already built when it is read back. startBlock of a directory is
+// the head of its child list.
+struct IndexSnapshotNode {
+    uint32_t entryIndex;
+    uint32_t parent;            // Position of the parent node (root: 0, itself)
+    uint32_t startBlock;
+    uint32_t permissions;
+    uint64_t size;
+    uint64_t createdTime;
+    uint64_t modifiedTime;
+    uint32_t nameOffset;        // Into the name heap
+    uint32_t ownerOffset;       // Into the name heap, owners are stored once
+    uint16_t nameLength;
+    uint8_t ownerLength;
+    uint8_t isFile;
+    uint32_t flags;             // INDEX_NODE_* flags
+};  // Total: 56 bytes
+
+// One entry of the owner / modification time index; owners are stored in
+// the name heap like the nodes'.
+struct IndexSnapshotAttribute {
+    uint32_t entryIndex;
+    uint32_t parent;            // Entry index of the parent directory
+    uint64_t modifiedTime;
+    uint32_t ownerOffset;       // Into the name heap
+    uint8_t ownerLength;
+    uint8_t padding[3];
+};  // Total: 24 bytes
+
+inline OMNIHeaderExt readHeaderExt(const OMNIHeader& header) {
+    OMNIHeaderExt ext;
+    memcpy(&ext, header.reserved, sizeof(ext));
+    return ext;
+}
+
+inline void storeHeaderExt(OMNIHeader& header, const OMNIHeaderExt& ext) {
+    memcpy(header.reserved, &ext, sizeof(ext));
+}
+
+// rewrites the on-disk header with the instance's header extension
+inline bool writeHeader(OFSInstance* fs) {
+    storeHeaderExt(fs->header, fs->header_ext);
+    fseek(fs->omni_file, 0, SEEK_SET);
+    bool ok = fwrite(&fs->header, sizeof(OMNIHeader), 1, fs->omni_file) == 1;
+    fflush(fs->omni_file);
+    return ok;
+}
+
+// heap offset of an owner name, adding it the first time it is seen
+inline uint32_t snapshotOwnerOffset(uint16_t owner_id, vector<char>& heap,
+                                    unordered_map<uint16_t, uint32_t>& owners) {
+    unordered_map<uint16_t, uint32_t>::iterator owner = owners.find(owner_id);
+    if (owner == owners.end()) {
+        const string& owner_name = OwnerNames::lookup(owner_id);
+        owner = owners.insert(make_pair(owner_id, (uint32_t)heap.size())).first;
+        heap.insert(heap.end(), owner_name.begin(), owner_name.end());
+    }
+    return owner->second;
+}
+
+// flattens the loaded tree (preorder), the user index, the slot map and
+// the attribute index into one buffer
+inline vector<uint8_t> serializeIndexSnapshot(OFSInstance* fs, uint64_t generation) {
+    vector<IndexSnapshotNode> nodes;
+    vector<IndexSnapshotAttribute> attributes;
+    vector<char> heap;
+    unordered_map<uint16_t, uint32_t> owners;     // owner ID -> heap offset
+    bool partial = false;
+
+    vector<pair<TreeNode*, uint32_t> > stack;
+    stack.push_back(make_pair(fs->file_tree->getRoot(), 0u));
+
+    while (!stack.empty()) {
+        TreeNode* node = stack.back().first;
+        uint32_t parent = stack.back().second;
+        stack.pop_back();
+
+        IndexSnapshotNode record;
+        memset(&record, 0, sizeof(record));
+        record.entryIndex = node->entryIndex;
+        record.parent = parent;
+        record.startBlock = node->startBlockIndex;
+        record.permissions = node->permissions;
+        record.size = node->size;
+        record.createdTime = node->created_time;
+        record.modifiedTime = node->modified_time;
+        record.isFile = node->isFile ? 1 : 0;
+        if (!node->isFile && !node->childrenLoaded) {
+            record.flags |= INDEX_NODE_UNLOADED;
+            partial = true;
+        }
+
+        record.nameOffset = heap.size();
+        record.nameLength = node->name.size();
+        heap.insert(heap.end(), node->name.begin(), node->name.end());
+
+        record.ownerOffset = snapshotOwnerOffset(node->ownerId, heap, owners);
+        record.ownerLength = node->getOwner().size();
+
+        uint32_t position = nodes.size();
+        nodes.push_back(record);
+
+        // pushed in reverse so children come back out in listing order
+        for (size_t i = node->children.size(); i > 0; i--) {
+            stack.push_back(make_pair(node->children[i - 1], position));
+        }
+    }
+
+    const AttributeIndex& index = fs->file_tree->getAttributeIndex();
+    for (uint32_t entry = 1; entry < fs->config.max_files; entry++) {
+        if (!index.contains(entry)) continue;
+
+        IndexSnapshotAttribute record;
+        memset(&record, 0, sizeof(record));
+        record.entryIndex = entry;
+        record.parent = index.getParent(entry);
+        record.modifiedTime = index.getModifiedTime(entry);
+        record.ownerOffset = snapshotOwnerOffset(index.getOwnerId(entry), heap, owners);
+        record.ownerLength = OwnerNames::lookup(index.getOwnerId(entry)).size();
+        attributes.push_back(record);
+    }
+
+    vector<UserInfo> users = fs->users.getAllSorted();
+    vector<uint8_t> slots = fs->entry_slots.toBitmap();
+
+    size_t nodes_size = nodes.size() * sizeof(IndexSnapshotNode);
+    size_t users_size = users.size() * sizeof(UserInfo);
+    size_t attributes_size = attributes.size() * sizeof(IndexSnapshotAttribute);
+
+    IndexSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = INDEX_SNAPSHOT_VERSION;
+    header.generation = generation;
+    header.maxFiles = fs->config.max_files;
+    header.nodeCount = nodes.size();
+    header.userCount = users.size();
+    header.nameHeapSize = heap.size();
+    header.slotBitmapSize = slots.size();
+    header.fileCount = fs->total_files;
+    header.directoryCount = fs->total_directories;
+    header.flags = partial ? INDEX_SNAPSHOT_PARTIAL : 0;
+    header.attributeCount = attributes.size();
+    header.payloadSize = nodes_size + users_size + slots.size() + attributes_size + heap.size();
+
+    vector<uint8_t> data(sizeof(header) + header.payloadSize);
+    uint8_t* payload = data.data() + sizeof(header);
+    uint8_t* attribute_data = payload + nodes_size + users_size + slots.size();
+    if (nodes_size > 0) memcpy(payload, nodes.data(), nodes_size);
+    if (users_size > 0) memcpy(payload + nodes_size, users.data(), users_size);
+    if (!slots.empty()) memcpy(payload + nodes_size + users_size, slots.data(), slots.size());
+    if (attributes_size > 0) memcpy(attribute_data, attributes.data(), attributes_size);
+    if (!heap.empty()) memcpy(attribute_data + attributes_size, heap.data(), heap.size());
+
+    header.payloadChecksum = crc32(payload, header.payloadSize);
+    header.headerChecksum = crc32(&header, sizeof(header));
+    memcpy(data.data(), &header, sizeof(header));
+
+    return data;
+}
+
+// rebuilds the tree, user index, entry slot map and attribute index from the snapshot the
+// header extension points at. Returns false (leaving the instance empty)
+// if there is none or it is stale or damaged, or if it is partial and
+// allow_partial is off.
+inline bool loadIndexSnapshot(OFSInstance* fs, bool allow_partial) {
+    const OMNIHeaderExt& ext = fs->header_ext;
+    if (!ext.isValid() || ext.index_snapshot_offset == 0 ||
+        ext.index_snapshot_size < sizeof(IndexSnapshotHeader)) {
+        return false;
+    }
+
+    vector<uint8_t> data(ext.index_snapshot_size);
+    fseek(fs->omni_file, ext.index_snapshot_offset, SEEK_SET);
+    if (fread(data.data(), 1, data.size(), fs->omni_file) != data.size()) {
+        return false;
+    }
+
+    IndexSnapshotHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+
+    uint32_t stored_checksum = header.headerChecksum;
+    header.headerChecksum = 0;
+    if (memcmp(header.magic, INDEX_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INDEX_SNAPSHOT_VERSION ||
+        crc32(&header, sizeof(header)) != stored_checksum ||
+        header.generation != ext.generation ||
+        header.maxFiles != fs->config.max_files ||
+        header.nodeCount == 0 ||
+        header.slotBitmapSize != (header.maxFiles + 7) / 8 ||
+        ((header.flags & INDEX_SNAPSHOT_PARTIAL) && !allow_partial) ||
+        sizeof(header) + (uint64_t)header.payloadSize != data.size()) {
+        return false;
+    }
+
+    const uint8_t* payload = data.data() + sizeof(header);
+    if (crc32(payload, header.payloadSize) != header.payloadChecksum) {
+        return false;
+    }
+
+    uint64_t nodes_size = (uint64_t)header.nodeCount * sizeof(IndexSnapshotNode);
+    uint64_t users_size = (uint64_t)header.userCount * sizeof(UserInfo);
+    uint64_t attributes_size = (uint64_t)header.attributeCount * sizeof(IndexSnapshotAttribute);
+    if (nodes_size + users_size + header.slotBitmapSize + attributes_size + header.nameHeapSize !=
+        header.payloadSize) {
+        return false;
+    }
+
+    const uint8_t* node_data = payload;
+    const uint8_t* user_data = payload + nodes_size;
+    const uint8_t* slot_data = payload + nodes_size + users_size;
+    const uint8_t* attribute_data = slot_data + header.slotBitmapSize;
+    const char* heap = (const char*)(attribute_data + attributes_size);
+
+    FileTree* tree = new FileTree();
+    vector<TreeNode*> built(header.nodeCount, nullptr);
+    bool ok = true;
+
+    for (uint32_t i = 0; i < header.nodeCount && ok; i++) {
+        IndexSnapshotNode record;
+        memcpy(&record, node_data + (uint64_t)i * sizeof(record), sizeof(record));
+
+        if ((uint64_t)record.nameOffset + record.nameLength > header.nameHeapSize ||
+            (uint64_t)record.ownerOffset + record.ownerLength > header.nameHeapSize ||
+            record.entryIndex >= fs->config.max_files) {
+            ok = false;
+            break;
+        }
+
+        TreeNode* node;
+        if (i == 0) {
+            node = tree->getRoot();
+        } else {
+            if (record.parent >= i || built[record.parent]->isFile) {
+                ok = false;
+                break;
+            }
+            node = new TreeNode(string_view(heap + record.nameOffset, record.nameLength), record.isFile != 0);
+            built[record.parent]->addChild(node);
+        }
+
+        node->entryIndex = record.entryIndex;
+        node->startBlockIndex = record.startBlock;
+        node->permissions = record.permissions;
+        node->size = record.size;
+        node->created_time = record.createdTime;
+        node->modified_time = record.modifiedTime;
+        node->setOwner(string_view(heap + record.ownerOffset, record.ownerLength));
+        node->childrenLoaded = node->isFile || !(record.flags & INDEX_NODE_UNLOADED);
+
+        built[i] = node;
+    }
+
+    AttributeIndex& index = tree->getAttributeIndex();
+    for (uint32_t i = 0; i < header.attributeCount && ok; i++) {
+        IndexSnapshotAttribute record;
+        memcpy(&record, attribute_data + (uint64_t)i * sizeof(record), sizeof(record));
+
+        if ((uint64_t)record.ownerOffset + record.ownerLength > header.nameHeapSize ||
+            record.entryIndex >= fs->config.max_files || record.parent >= fs->config.max_files) {
+            ok = false;
+            break;
+        }
+
+        uint16_t owner_id = OwnerNames::intern(string_view(heap + record.ownerOffset, record.ownerLength));
+        index.put(record.entryIndex, record.parent, owner_id, record.modifiedTime);
+    }
+
+    if (!ok) {
+        delete tree;
+        return false;
+    }
+
+    tree->recountNodes();
+    fs->entry_slots.fromBitmap(slot_data, fs->config.max_files);
+
+    for (uint32_t i = 0; i < header.userCount; i++) {
+        UserInfo user;
+        memcpy(&user, user_data + (uint64_t)i * sizeof(UserInfo), sizeof(UserInfo));
+        fs->users.insert(user.username, user);
+    }
+
+    delete fs->file_tree;
+    fs->file_tree = tree;
+    fs->total_files = header.fileCount;
+    fs->total_directories = header.directoryCount;
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "odf_types.hpp"
+#include "odf_ext_types.hpp"
+#include "ofs_instance.h"
+#include "index_snapshot.h"
+#include "checksum.h"
+#include <vector>
+#include <map>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+#define JOURNAL_RECORD_MAGIC 0x314C4E4A    // "JNL1"
+
+// One record of the metadata journal: the FileEntry images one flush made
+// final. Records are appended one after another from the start of the
+// region with rising sequence numbers; when the next one doesn't fit, a
+// checkpoint writes everything journaled home and the region starts over.
+// header_ext.journal_sequence is the number the first record must carry,
+// so records left from before a checkpoint are never replayed.
+struct JournalRecordHeader {
+    uint32_t magic;             // JOURNAL_RECORD_MAGIC
+    uint32_t count;             // JournalRecordEntry records following
+    uint64_t sequence;
+    uint32_t checksum;          // CRC-32 of the records
+    uint32_t headerChecksum;    // CRC-32 of this header with this field zeroed
+};  // Total: 24 bytes
+
+struct JournalRecordEntry {
+    uint32_t entryIndex;
+    uint32_t padding;
+    FileEntry entry;
+};
+
+inline uint64_t getJournalOffset(OFSInstance* fs, uint32_t start_block) {
+    uint64_t content_offset = fs->header.user_table_offset +
+                              (fs->header.max_users * sizeof(UserInfo)) +
+                              ((uint64_t)fs->config.max_files * sizeof(FileEntry));
+    return content_offset + ((uint64_t)start_block * fs->header.block_size);
+}
+
+// writes images to the entry table; consecutive slots go out in one write
+inline void writeEntryImages(OFSInstance* fs, const map<uint32_t, FileEntry>& images) {
+    uint64_t table_offset = fs->header.user_table_offset + (fs->header.max_users * sizeof(UserInfo));
+    vector<FileEntry> run;
+
+    map<uint32_t, FileEntry>::const_iterator it = images.begin();
+    while (it != images.end()) {
+        uint32_t first = it->first;
+        run.clear();
+        run.push_back(it->second);
+        for (++it; it != images.end() && it->first == first + run.size(); ++it) {
+            run.push_back(it->second);
+        }
+
+        fseek(fs->omni_file, table_offset + ((uint64_t)first * sizeof(FileEntry)), SEEK_SET);
+        fwrite(run.data(), sizeof(FileEntry), run.size(), fs->omni_file);
+    }
+}
+
+// writes every journaled image home and empties the region. The table is
+// synced before the header stops pointing at the records.
+inline void checkpointJournal(OFSInstance* fs) {
+    MetadataJournal& journal = fs->journal;
+    if (!journal.isEnabled()) return;
+
+    if (!journal.getJournaled().empty()) {
+        writeEntryImages(fs, journal.getJournaled());
+        fflush(fs->omni_file);
+        fdatasync(fileno(fs->omni_file));
+    }
+
+    journal.checkpointed();
+    fs->header_ext.journal_sequence = journal.getSequence();
+    writeHeader(fs);
+}
+
+inline vector<char> serializeJournalRecord(const map<uint32_t, FileEntry>& images, uint64_t sequence) {
+    vector<JournalRecordEntry> entries;
+    entries.reserve(images.size());
+    for (map<uint32_t, FileEntry>::const_iterator it = images.begin(); it != images.end(); ++it) {
+        JournalRecordEntry record;
+        record.entryIndex = it->first;
+        record.padding = 0;
+        record.entry = it->second;
+        entries.push_back(record);
+    }
+
+    JournalRecordHeader header;
+    header.magic = JOURNAL_RECORD_MAGIC;
+    header.count = entries.size();
+    header.sequence = sequence;
+    header.checksum = crc32(entries.data(), entries.size() * sizeof(JournalRecordEntry));
+    header.headerChecksum = 0;
+    header.headerChecksum = crc32(&header, sizeof(header));
+
+    vector<char> data(sizeof(header) + entries.size() * sizeof(JournalRecordEntry));
+    memcpy(data.data(), &header, sizeof(header));
+    if (!entries.empty()) {
+        memcpy(data.data() + sizeof(header), entries.data(), entries.size() * sizeof(JournalRecordEntry));
+    }
+    return data;
+}
+
+// makes what has been written final: the staged FileEntry images are
+// appended to the journal as one record, then the file is flushed. Images
+// too many for the whole region are written home directly instead.
+inline void commitMetadata(OFSInstance* fs) {
+    MetadataJournal& journal = fs->journal;
+    if (journal.isEnabled() && !journal.getStaged().empty()) {
+        vector<char> record = serializeJournalRecord(journal.getStaged(), journal.getSequence());
+
+        if (record.size() > journal.getCapacity()) {
+            journal.unstage();
+            checkpointJournal(fs);
+        } else {
+            if (journal.getHead() + record.size() > journal.getCapacity()) {
+                checkpointJournal(fs);
+            }
+            fseek(fs->omni_file, getJournalOffset(fs, journal.getStartBlock()) + journal.getHead(), SEEK_SET);
+            fwrite(record.data(), 1, record.size(), fs->omni_file);
+            journal.appended(journal.getHead(), record.size());
+        }
+    }
+    fflush(fs->omni_file);
+    fs->op_flushes++;
+}
+
+// the staged images plus extra more still fit one record, so writing
+// them before the next flush stays all or nothing
+inline bool journalCanHold(OFSInstance* fs, size_t extra) {
+    const MetadataJournal& journal = fs->journal;
+    uint64_t size = sizeof(JournalRecordHeader) +
+                    (journal.getStaged().size() + extra) * sizeof(JournalRecordEntry);
+    return journal.isEnabled() && size <= journal.getCapacity();
+}
+
+// writes home the images of every record a crash left in the journal;
+// runs in fs_init before either table is read. Returns the records
+// replayed.
+inline uint32_t replayJournal(OFSInstance* fs) {
+    const OMNIHeaderExt& ext = fs->header_ext;
+    if (ext.journal_block == 0) return 0;
+
+    uint64_t region = getJournalOffset(fs, ext.journal_block);
+    uint64_t capacity = (uint64_t)ext.journal_blocks * fs->header.block_size;
+    uint64_t sequence = ext.journal_sequence;
+    uint64_t offset = 0;
+    uint32_t replayed = 0;
+
+    map<uint32_t, FileEntry> images;
+    vector<JournalRecordEntry> entries;
+    while (offset + sizeof(JournalRecordHeader) <= capacity) {
+        JournalRecordHeader header;
+        fseek(fs->omni_file, region + offset, SEEK_SET);
+        if (fread(&header, sizeof(header), 1, fs->omni_file) != 1) break;
+
+        uint32_t stored = header.headerChecksum;
+        header.headerChecksum = 0;
+        uint64_t size = sizeof(header) + (uint64_t)header.count * sizeof(JournalRecordEntry);
+        if (header.magic != JOURNAL_RECORD_MAGIC || header.sequence != sequence ||
+            crc32(&header, sizeof(header)) != stored || offset + size > capacity) {
+            break;
+        }
+
+        entries.resize(header.count);
+        if (header.count > 0 &&
+            fread(entries.data(), sizeof(JournalRecordEntry), entries.size(), fs->omni_file) != entries.size()) {
+            break;
+        }
+        if (crc32(entries.data(), entries.size() * sizeof(JournalRecordEntry)) != header.checksum) {
+            break;
+        }
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].entryIndex >= 1 && entries[i].entryIndex < fs->config.max_files) {
+                images[entries[i].entryIndex] = entries[i].entry;
+            }
+        }
+        offset += size;
+        sequence++;
+        replayed++;
+    }
+
+    if (replayed > 0) {
+        writeEntryImages(fs, images);
+        fflush(fs->omni_file);
+        fdatasync(fileno(fs->omni_file));
+
+        fs->header_ext.journal_sequence = sequence;
+        writeHeader(fs);
+    }
+    return replayed;
+}
+
+#endif
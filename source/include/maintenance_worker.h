@@ -0,0 +1,67 @@
+#ifndef MAINTENANCE_WORKER_H
+#define MAINTENANCE_WORKER_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+
+// how often the background thread wakes up to look for work
+#define MAINTENANCE_INTERVAL_MS 1000
+
+// Background thread that runs a task every interval until stopped.
+// The task is responsible for taking the instance's operation lock, so it
+// only ever runs between two API calls, never inside one.
+class MaintenanceWorker {
+private:
+    thread worker;
+    mutex wait_lock;
+    condition_variable wake;
+    bool stopping;
+
+public:
+    MaintenanceWorker() : stopping(false) {}
+
+    ~MaintenanceWorker() {
+        stop();
+    }
+
+    void start(uint32_t interval_ms, function<void()> task) {
+        if (worker.joinable()) return;
+
+        stopping = false;
+        worker = thread([this, interval_ms, task]() {
+            unique_lock<mutex> lock(wait_lock);
+            while (!stopping) {
+                wake.wait_for(lock, chrono::milliseconds(interval_ms));
+                if (stopping) break;
+
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(wait_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    bool isRunning() const {
+        return worker.joinable();
+    }
+};
+
+#endif
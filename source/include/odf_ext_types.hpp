@@ -0,0 +1,251 @@
+#ifndef ODF_EXT_TYPES_HPP
+#define ODF_EXT_TYPES_HPP
+
+#include <cstdint>
+#include <cstring>
+
+// ============================================================================
+// EXTENDED STRUCTURES - used by operations beyond the standard API in
+// odf_types.hpp. The standard structures there stay untouched.
+// ============================================================================
+
+/**
+ * Header extension
+ * Lives in OMNIHeader.reserved; an image formatted before it existed has
+ * zeros there and is treated as having no extension.
+ */
+#define OMNI_HEADER_EXT_MAGIC 0x3158484F    // "OHX1"
+#define OMNI_HEADER_EXT_VERSION 1
+
+// OMNIHeaderExt.flags
+#define OMNI_EXT_CHILD_INDEX_READY 0x04     // every directory has an up to date paged child list
+                                            // (0x01 and 0x02 marked the older unsorted and
+                                            // packed stream formats)
+
+struct OMNIHeaderExt {
+    uint32_t magic;                 // OMNI_HEADER_EXT_MAGIC
+    uint32_t version;               // OMNI_HEADER_EXT_VERSION
+    uint64_t generation;            // Bumped by fs_init and by a clean fs_shutdown
+    uint64_t index_snapshot_offset; // Byte offset of the index snapshot (0 = none)
+    uint64_t index_snapshot_size;   // Size of the index snapshot in bytes
+    uint64_t clean_generation;      // Generation written by the last clean fs_shutdown
+    uint32_t flags;                 // OMNI_EXT_* flags
+    uint32_t txn_record_block;      // First block of a commit record not yet fully applied (0 = none)
+    uint32_t txn_record_size;       // Size of that record in bytes
+    uint32_t journal_block;         // First block of the metadata journal region (0 = none)
+    uint32_t journal_blocks;        // Blocks in that region
+    uint32_t padding;
+    uint64_t journal_sequence;      // Sequence number the record at the start of the region must carry
+    uint8_t reserved[256];          // Reserved
+
+    OMNIHeaderExt() : magic(0), version(0), generation(0),
+                      index_snapshot_offset(0), index_snapshot_size(0),
+                      clean_generation(0), flags(0), txn_record_block(0), txn_record_size(0),
+                      journal_block(0), journal_blocks(0), padding(0), journal_sequence(0) {
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+
+    bool isValid() const {
+        return magic == OMNI_HEADER_EXT_MAGIC && version == OMNI_HEADER_EXT_VERSION;
+    }
+
+    // nothing has been mounted since the last clean shutdown
+    bool isClean() const {
+        return isValid() && clean_generation == generation;
+    }
+};  // Total: 328 bytes
+
+// Flags kept in FileEntry.reserved[0]
+#define ENTRY_FLAG_PENDING_RECLAIM 0x01   // deleted file whose blocks aren't freed yet
+#define ENTRY_FLAG_CHILD_INDEX 0x02       // directory whose inode heads its child list chain
+
+// FileEntry.reserved offsets used by directories with ENTRY_FLAG_CHILD_INDEX
+#define ENTRY_CHILD_COUNT_OFFSET 4        // uint32_t, records in the child list
+#define ENTRY_CHILD_BLOCKS_OFFSET 8       // uint32_t, pages in the child list chain
+
+/**
+ * Defragmentation progress
+ * Returned by fs_defragment and get_defrag_stats
+ */
+struct DefragStats {
+    uint32_t passes;                // Number of defragment passes run
+    uint32_t files_examined;        // Files looked at in the last pass
+    uint32_t fragmented_files;      // Fragmented files found in the last pass
+    uint32_t files_moved;           // Files relocated into one extent (total)
+    uint64_t blocks_moved;          // Blocks copied (total)
+    uint64_t bytes_moved;           // Bytes copied, including block headers (total)
+    uint64_t last_pass_time;        // When the last pass finished (Unix epoch)
+    uint8_t reserved[32];           // Reserved
+
+    DefragStats() : passes(0), files_examined(0), fragmented_files(0), files_moved(0),
+                    blocks_moved(0), bytes_moved(0), last_pass_time(0) {
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+/**
+ * Background block reclamation
+ * Returned by get_reclaim_stats
+ */
+struct ReclaimStats {
+    uint32_t pending_files;         // Deleted files still waiting for their blocks to be freed
+    uint64_t pending_blocks;        // Blocks waiting to be freed
+    uint64_t pending_free;          // Bytes that become free once the queue drains
+    uint64_t reclaimed_files;       // Deleted files fully reclaimed since fs_init
+    uint64_t reclaimed_blocks;      // Blocks freed by the reclaimer since fs_init
+    uint8_t reserved[32];           // Reserved
+
+    ReclaimStats() : pending_files(0), pending_blocks(0), pending_free(0),
+                     reclaimed_files(0), reclaimed_blocks(0) {
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+// Durability modes: what a mutating call does after its metadata flush
+#define DURABILITY_NONE 0                 // nothing; the OS writes the data back when it likes
+#define DURABILITY_PERIODIC 1             // a background thread syncs every durability_interval_ms
+#define DURABILITY_GROUP 2                // waits for a sync it may share with concurrent calls
+#define DURABILITY_STRICT 3               // runs its own fdatasync
+#define DURABILITY_DEFAULT 0xFF           // a session following the config
+
+// latency histogram buckets: bucket i counts times below 2^(i+1) us
+// (and at least 2^i us but for bucket 0); the last one takes the rest
+#define DURABILITY_HISTOGRAM_BUCKETS 24
+
+/**
+ * Syncs issued for durability
+ * Returned by get_durability_stats
+ */
+struct DurabilityStats {
+    uint32_t mode;                  // DURABILITY_* the session runs with
+    uint32_t interval_ms;           // durability_interval_ms
+    uint64_t syncs;                 // fdatasync calls issued
+    uint64_t periodic_syncs;        // Of those, issued by the background thread
+    uint64_t synced_operations;     // Calls those syncs made durable
+    uint64_t sync_time_us;          // Time spent in fdatasync
+    uint64_t sync_latency[DURABILITY_HISTOGRAM_BUCKETS];   // Time of each fdatasync
+    uint64_t wait_latency[DURABILITY_HISTOGRAM_BUCKETS];   // Time a GROUP or STRICT call waited for its sync
+    uint8_t reserved[32];           // Reserved
+
+    DurabilityStats() : mode(0), interval_ms(0), syncs(0), periodic_syncs(0),
+                        synced_operations(0), sync_time_us(0) {
+        std::memset(sync_latency, 0, sizeof(sync_latency));
+        std::memset(wait_latency, 0, sizeof(wait_latency));
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+/**
+ * Path lookup cache
+ * Returned by get_path_cache_stats
+ */
+struct PathCacheStats {
+    uint64_t hits;                  // Lookups answered with a cached node
+    uint64_t negative_hits;         // Lookups answered with a cached "does not exist"
+    uint64_t misses;                // Lookups that walked the tree
+    uint64_t invalidations;         // Times the whole cache went stale
+    uint32_t entries;               // Paths currently cached
+    uint32_t capacity;              // path_cache_entries
+    double hit_rate;                // (hits + negative_hits) / lookups, 0.0 - 1.0
+    uint8_t reserved[32];           // Reserved
+
+    PathCacheStats() : hits(0), negative_hits(0), misses(0), invalidations(0),
+                       entries(0), capacity(0), hit_rate(0.0) {
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+/**
+ * Directory usage
+ * Returned by dir_usage; counts everything below the directory, not the
+ * directory itself
+ */
+struct DirUsage {
+    uint64_t total_bytes;           // Logical size of every file below
+    uint64_t file_count;            // Files below
+    uint64_t directory_count;       // Directories below
+    uint64_t blocks_used;           // Content blocks of those files
+    uint64_t actual_size;           // blocks_used in bytes on disk
+    uint8_t reserved[32];           // Reserved
+
+    DirUsage() : total_bytes(0), file_count(0), directory_count(0), blocks_used(0), actual_size(0) {
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+/**
+ * Search cursor
+ * Passed to fs_find, find_by_owner or find_modified, which update it for
+ * the next call. Name and owner results come in entry index order,
+ * modification time results oldest first; a default constructed cursor
+ * starts at the first.
+ */
+struct FindCursor {
+    uint32_t last_entry;            // Entry index of the last result returned
+    uint32_t done;                  // 1 once the last result has been returned
+    uint64_t returned;              // Results returned so far
+    uint64_t last_time;             // Modified time of the last result (find_modified)
+    uint8_t reserved[32];           // Reserved
+
+    FindCursor() : last_entry(0), done(0), returned(0), last_time(0) {
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+/**
+ * Paged directory listing
+ * Passed to dir_list_page, which updates it for the next call. A default
+ * constructed (zeroed) cursor starts at the first entry.
+ */
+#define DIR_LIST_SORT_NONE 0                // Listing order
+#define DIR_LIST_SORT_NAME 1                // By name
+#define DIR_LIST_SORT_SIZE 2                // Smallest first, ties by name
+#define DIR_LIST_SORT_MTIME 3               // Least recently modified first, ties by name
+#define DIR_LIST_SORT_COUNT 4
+
+struct DirListCursor {
+    uint64_t position;              // Entries returned so far
+    uint64_t last_key;              // Size or modified time of the last entry returned
+    uint32_t sort_key;              // DIR_LIST_SORT_* the listing is in
+    uint32_t done;                  // 1 once the last entry has been returned
+    char last_name[256];            // Name of the last entry returned
+    uint8_t reserved[32];           // Reserved
+
+    DirListCursor() : position(0), last_key(0), sort_key(0), done(0) {
+        std::memset(last_name, 0, sizeof(last_name));
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+// dir_delete_recursive flags
+#define DIR_DELETE_BACKGROUND_FREE 0x01     // Leave freeing the block chains to the reclaimer
+
+/**
+ * Batched operation
+ * One element of the array passed to ofs_batch. Fields an operation
+ * doesn't use are ignored.
+ */
+#define BATCH_OP_FILE_CREATE 1              // path, data, size
+#define BATCH_OP_FILE_EDIT 2                // path, data, size, index
+#define BATCH_OP_FILE_DELETE 3              // path
+#define BATCH_OP_DIR_CREATE 4               // path
+#define BATCH_OP_DIR_DELETE 5               // path
+#define BATCH_OP_STAT 6                     // path, meta
+
+struct FileMetadata;
+
+struct BatchOp {
+    uint32_t type;                  // BATCH_OP_*
+    uint32_t index;                 // Byte offset for BATCH_OP_FILE_EDIT
+    const char* path;               // Path the operation acts on
+    const char* data;               // Content for create and edit
+    uint64_t size;                  // Length of data
+    FileMetadata* meta;             // Filled in by BATCH_OP_STAT
+    uint8_t reserved[32];           // Reserved
+
+    BatchOp() : type(0), index(0), path(nullptr), data(nullptr), size(0), meta(nullptr) {
+        std::memset(reserved, 0, sizeof(reserved));
+    }
+};
+
+#endif // ODF_EXT_TYPES_HPP
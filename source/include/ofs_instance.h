@@ -2,28 +2,72 @@
 #define OFS_INSTANCE_HPP
 
 #include "../include/odf_types.hpp"
+#include "../include/odf_ext_types.hpp"
 #include "../include/config_parser.h"
 #include "../data_structures/avl_tree.h"
 #include "../data_structures/file_tree.h"
 #include "../data_structures/free_space_manager.h"
+#include "../data_structures/delayed_write_cache.h"
+#include "../data_structures/reclaim_queue.h"
+#include "../data_structures/entry_slot_map.h"
+#include "../data_structures/metadata_journal.h"
+#include "../data_structures/child_page_index.h"
+#include "maintenance_worker.h"
+#include "group_commit.h"
+#include <mutex>
+#include <unordered_set>
+
+struct Transaction;
 
 struct OFSInstance {
     FILE* omni_file;
     OMNIHeader header;
+    OMNIHeaderExt header_ext;
     AVLTree<UserInfo> users;
     AVLTree<SessionInfo> sessions;
     FileTree* file_tree;
     FreeSpaceManager* free_manager;
     uint32_t total_files;
     uint32_t total_directories;
+    DefragStats defrag_stats;
+    uint32_t defrag_cursor;         // entry index the next fs_defragment pass starts at
+    DelayedWriteCache delayed_writes;
+    ReclaimQueue reclaim_queue;
+    EntrySlotMap entry_slots;
+    MetadataJournal journal;
+    ChildPageCache child_pages;
+    
+    // held by every API call and by the maintenance worker, so background
+    // work never interleaves with an operation
+    recursive_mutex op_lock;
+    MaintenanceWorker maintenance;
+    
+    // background sync of the periodic durability mode
+    MaintenanceWorker periodic_sync;
+    
+    // API calls nested under op_lock, and metadata commits since the
+    // outermost one began (see DurableOperation)
+    uint32_t op_depth;
+    uint64_t op_flushes;
+    
+    // while non-zero, metadata writes skip their flush and whoever raised it
+    // flushes once when done (see flushMetadata)
+    uint32_t flush_hold;
+    
+    // transactions begun and not yet committed or aborted; their staged
+    // blocks are allocated but nothing on disk points at them
+    unordered_set<Transaction*> open_transactions;
+    GroupCommit group_commit;
     
     // Store config for use
     FileSystemConfig config;
     
     OFSInstance() : omni_file(nullptr), file_tree(nullptr), free_manager(nullptr),
-                   total_files(0), total_directories(1) {}
+                   total_files(0), total_directories(1), defrag_cursor(0), op_depth(0), op_flushes(0), flush_hold(0) {}
     
     ~OFSInstance() {
+        maintenance.stop();
+        periodic_sync.stop();
         if (omni_file) fclose(omni_file);
         if (file_tree) delete file_tree;
         if (free_manager) delete free_manager;
@@ -4,7 +4,14 @@
 #include "../include/odf_types.hpp"
 #include "../include/config_parser.h"
 #include "ofs_instance.h"
+#include "transaction.h"
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
 #include <ctime>
 #include <iostream>
 
@@ -14,36 +21,45 @@ struct ManagedSession {
     string session_id;
     SessionInfo info;
     OFSInstance* instance;
-    bool is_active;
+    atomic<bool> is_active;             // false once logged out
+    atomic<uint64_t> last_activity;     // set by every lookup, which only share the slot lock
+    uint8_t durability;     // DURABILITY_* override, DURABILITY_DEFAULT follows the config
     
-    ManagedSession() : instance(nullptr), is_active(false) {}
     ManagedSession(const string& id, const SessionInfo& si, OFSInstance* inst)
-        : session_id(id), info(si), instance(inst), is_active(true) {}
+        : session_id(id), info(si), instance(inst), is_active(true),
+          last_activity(si.last_activity), durability(DURABILITY_DEFAULT) {}
 };
 
+// A looked up session. An API call keeps it for the whole call, so a logout
+// on another thread (or the slot going to a new login) can't free it
+// underneath; the session itself goes once the last call holding it returns.
+typedef shared_ptr<ManagedSession> SessionRef;
+
 class SessionManager {
 private:
-    static inline ManagedSession* sessions = nullptr;
+    static inline vector<SessionRef> sessions;         // by slot, empty when free
     static inline OFSInstance* global_instance = nullptr;
     static inline int session_count = 0;
     static inline int max_sessions = 0;
     
+    // session id -> slot of every active session, so a lookup doesn't scan the slots
+    static inline unordered_map<string, int> session_slots;
+    
+    // guards the slots and session_slots: lookups share it, login, logout
+    // and setup take it alone
+    static inline shared_mutex slots_lock;
+    
+    // callers hold slots_lock
     static int findSessionIndex(const string& session_id) {
-        if (!sessions) return -1;
         
-        for (int i = 0; i < max_sessions; i++) {
-            if (sessions[i].is_active && sessions[i].session_id == session_id) {
-                return i;
-            }
-        }
-        return -1;
+        unordered_map<string, int>::const_iterator it = session_slots.find(session_id);
+        return it == session_slots.end() ? -1 : it->second;
     }
     
+    // callers hold slots_lock
     static int findFreeSlot() {
-        if (!sessions) return -1;
-        
         for (int i = 0; i < max_sessions; i++) {
-            if (!sessions[i].is_active) {
+            if (!sessions[i]) {
                 return i;
             }
         }
@@ -52,12 +68,10 @@ private:
     
 public:
     static void initialize(const FileSystemConfig& config) {
-        if (sessions) {
-            delete[] sessions;
-        }
-        
+        unique_lock<shared_mutex> lock(slots_lock);
         max_sessions = config.max_connections;
-        sessions = new ManagedSession[max_sessions];
+        sessions.assign(max_sessions, SessionRef());
+        session_slots.clear();
         session_count = 0;
     }
     
@@ -70,14 +84,11 @@ public:
     }
     
     static string createSession(const UserInfo& user, OFSInstance* inst) {
-        if (!sessions) {
-            return "";
-        }
-        
+        unique_lock<shared_mutex> lock(slots_lock);
         for (int i = 0; i < max_sessions; i++) {
-            if (sessions[i].is_active && 
-                string(sessions[i].info.user.username) == string(user.username)) {
-                return sessions[i].session_id;
+            if (sessions[i] && 
+                string(sessions[i]->info.user.username) == string(user.username)) {
+                return sessions[i]->session_id;
             }
         }
         
@@ -86,7 +97,8 @@ public:
         
         int slot = findFreeSlot();
         if (slot != -1) {
-            sessions[slot] = ManagedSession(session_id, info, inst);
+            sessions[slot] = make_shared<ManagedSession>(session_id, info, inst);
+            session_slots[session_id] = slot;
             session_count++;
             
             inst->sessions.insert(session_id, info);
@@ -97,36 +109,49 @@ public:
         return "";
     }
     
-    static ManagedSession* getSession(const string& session_id) {
+    static SessionRef getSession(const string& session_id) {
+        shared_lock<shared_mutex> lock(slots_lock);
         int index = findSessionIndex(session_id);
         if (index != -1) {
-            sessions[index].info.last_activity = time(nullptr);
-            return &sessions[index];
+            sessions[index]->last_activity.store(time(nullptr), memory_order_relaxed);
+            return sessions[index];
         }
-        return nullptr;
+        return SessionRef();
     }
     
     static bool removeSession(const string& session_id) {
-        int index = findSessionIndex(session_id);
-        if (index != -1) {
-            if (sessions[index].instance) {
-                sessions[index].instance->sessions.remove(session_id);
+        OFSInstance* inst = nullptr;
+        {
+            unique_lock<shared_mutex> lock(slots_lock);
+            int index = findSessionIndex(session_id);
+            if (index == -1) return false;
+            
+            inst = sessions[index]->instance;
+            if (inst) {
+                inst->sessions.remove(session_id);
             }
             
-            sessions[index].is_active = false;
+            sessions[index]->is_active = false;
+            sessions[index].reset();
+            session_slots.erase(session_id);
             session_count--;
-            
-            return true;
         }
-        return false;
+        
+        // staged blocks of transactions left open go back; outside the slot
+        // lock, as API calls look sessions up while holding op_lock
+        if (inst) {
+            discardSessionTransactions(inst, session_id);
+        }
+        return true;
     }
     
     static void clearAll() {
-        if (!sessions) return;
-        
+        unique_lock<shared_mutex> lock(slots_lock);
         for (int i = 0; i < max_sessions; i++) {
-            sessions[i].is_active = false;
+            if (sessions[i]) sessions[i]->is_active = false;
+            sessions[i].reset();
         }
+        session_slots.clear();
         session_count = 0;
     }
     
@@ -139,24 +164,20 @@ public:
     }
     
     static void printActiveSessions() {
-        if (!sessions) {
-            return;
-        }
-        
+        shared_lock<shared_mutex> lock(slots_lock);
         for (int i = 0; i < max_sessions; i++) {
-            if (sessions[i].is_active) {
-                cout << "  " << sessions[i].session_id 
-                     << " - User: " << sessions[i].info.user.username
-                     << " - Last Activity: " << sessions[i].info.last_activity << endl;
+            if (sessions[i]) {
+                cout << "  " << sessions[i]->session_id 
+                     << " - User: " << sessions[i]->info.user.username
+                     << " - Last Activity: " << sessions[i]->last_activity << endl;
             }
         }
     }
     
     static void cleanup() {
-        if (sessions) {
-            delete[] sessions;
-            sessions = nullptr;
-        }
+        unique_lock<shared_mutex> lock(slots_lock);
+        sessions.clear();
+        session_slots.clear();
         session_count = 0;
         max_sessions = 0;
     }
@@ -0,0 +1,181 @@
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+#include "odf_types.hpp"
+#include "odf_ext_types.hpp"
+#include "ofs_instance.h"
+#include "helper_functions.h"
+#include "index_snapshot.h"
+#include "checksum.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+
+using namespace std;
+
+#define TXN_RECORD_MAGIC 0x314E5854    // "TXN1"
+
+// TxnPath states
+#define TXN_PATH_ABSENT 0
+#define TXN_PATH_FILE 1
+#define TXN_PATH_DIRECTORY 2
+
+// What a transaction has done to one path. The base fields are what the
+// tree held when the path was first touched; commit fails if that has
+// changed since; for a file an edit read, that includes its content, as
+// an edit in place changes neither block nor size. Touched parents are
+// recorded too, so a directory removed underneath a staged create is
+// noticed.
+struct TxnPath {
+    uint8_t baseState;              // TXN_PATH_* in the tree
+    uint32_t baseEntry;             // its entry index, 0 when absent
+    uint32_t baseBlock;             // start block of a file
+    uint64_t baseSize;              // size of a file
+    bool baseRead;                  // base content was read (by an edit)
+    uint32_t baseChecksum;          // CRC-32 of that content
+    uint8_t state;                  // TXN_PATH_* once committed
+    bool rewritten;                 // file content replaced by the staged chain
+    vector<uint32_t> blocks;        // staged chain of a rewritten file
+    uint64_t size;                  // size of the staged content
+    uint32_t entryIndex;            // slot a new entry gets, chosen at commit
+
+    TxnPath() : baseState(TXN_PATH_ABSENT), baseEntry(0), baseBlock(0), baseSize(0),
+                baseRead(false), baseChecksum(0), state(TXN_PATH_ABSENT), rewritten(false), size(0), entryIndex(0) {}
+};
+
+// An open transaction: everything staged so far, by path. New content is
+// already written to blocks allocated for it; no entry or child list is
+// touched before commit.
+struct Transaction {
+    string session_id;
+    OFSInstance* fs;
+    map<string, TxnPath> paths;
+
+    Transaction(const string& id, OFSInstance* instance) : session_id(id), fs(instance) {}
+};
+
+// gives back every block a transaction still has staged and forgets it
+inline void discardTransaction(OFSInstance* fs, Transaction* txn) {
+    for (map<string, TxnPath>::iterator it = txn->paths.begin(); it != txn->paths.end(); ++it) {
+        fs->free_manager->freeBlockSegments(it->second.blocks);
+    }
+    fs->open_transactions.erase(txn);
+    delete txn;
+}
+
+// discards every transaction a session left open when it logs out
+inline void discardSessionTransactions(OFSInstance* fs, const string& session_id) {
+    lock_guard<recursive_mutex> lock(fs->op_lock);
+
+    vector<Transaction*> owned;
+    for (unordered_set<Transaction*>::iterator it = fs->open_transactions.begin();
+         it != fs->open_transactions.end(); ++it) {
+        if ((*it)->session_id == session_id) owned.push_back(*it);
+    }
+    for (size_t i = 0; i < owned.size(); i++) {
+        discardTransaction(fs, owned[i]);
+    }
+}
+
+// Commit record: the FileEntry images a commit is about to write, in a
+// chain of freshly allocated blocks the header extension points at until
+// they are all in place. Only used when the metadata journal is off or
+// can't take the commit as one record. fs_init writes the images of a record it finds
+// and mounts as after a crash, which rebuilds the child lists and the free
+// map from the entry table.
+struct TxnRecordHeader {
+    uint32_t magic;             // TXN_RECORD_MAGIC
+    uint32_t count;             // TxnRecordEntry records following
+    uint32_t checksum;          // CRC-32 of the records
+    uint32_t headerChecksum;    // CRC-32 of this header with this field zeroed
+};  // Total: 16 bytes
+
+struct TxnRecordEntry {
+    uint32_t entryIndex;
+    uint32_t padding;
+    FileEntry entry;
+};
+
+inline vector<char> serializeTxnRecord(const vector<TxnRecordEntry>& images) {
+    vector<char> data(sizeof(TxnRecordHeader) + images.size() * sizeof(TxnRecordEntry));
+
+    TxnRecordHeader header;
+    header.magic = TXN_RECORD_MAGIC;
+    header.count = images.size();
+    header.checksum = crc32(images.data(), images.size() * sizeof(TxnRecordEntry));
+    header.headerChecksum = 0;
+    header.headerChecksum = crc32(&header, sizeof(header));
+
+    memcpy(data.data(), &header, sizeof(header));
+    if (!images.empty()) {
+        memcpy(data.data() + sizeof(header), images.data(), images.size() * sizeof(TxnRecordEntry));
+    }
+    return data;
+}
+
+// reads the record the header extension points at; false if it is damaged
+// (the commit never reached its commit point)
+inline bool readTxnRecord(OFSInstance* fs, vector<TxnRecordEntry>& images) {
+    uint64_t block_size = fs->header.block_size;
+    uint32_t usable_block_size = getUsableBlockSize(fs);
+    uint64_t content_offset = calculateContentOffset(fs->header, fs->config.max_files);
+    uint32_t total_blocks = calculateTotalBlocks(fs->header.total_size, content_offset, block_size);
+
+    // a damaged header must not size the buffer past what the chain can hold
+    uint64_t size = fs->header_ext.txn_record_size;
+    if (size < sizeof(TxnRecordHeader) || size > (uint64_t)total_blocks * usable_block_size) return false;
+
+    vector<char> data(size);
+    vector<char> block(block_size);
+    uint32_t current_block = fs->header_ext.txn_record_block;
+    for (uint64_t done = 0; done < size; ) {
+        if (current_block == 0 || current_block >= total_blocks) return false;
+
+        fseek(fs->omni_file, content_offset + ((uint64_t)current_block * block_size), SEEK_SET);
+        if (fread(block.data(), 1, block.size(), fs->omni_file) != block.size()) return false;
+
+        size_t take = min((uint64_t)usable_block_size, size - done);
+        memcpy(data.data() + done, block.data() + 4, take);
+        done += take;
+        memcpy(&current_block, block.data(), sizeof(uint32_t));
+    }
+
+    TxnRecordHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    uint32_t stored = header.headerChecksum;
+    header.headerChecksum = 0;
+    if (header.magic != TXN_RECORD_MAGIC || crc32(&header, sizeof(header)) != stored ||
+        size != sizeof(header) + (uint64_t)header.count * sizeof(TxnRecordEntry)) {
+        return false;
+    }
+
+    images.resize(header.count);
+    if (header.count > 0) {
+        memcpy(images.data(), data.data() + sizeof(header), header.count * sizeof(TxnRecordEntry));
+    }
+    return crc32(images.data(), images.size() * sizeof(TxnRecordEntry)) == header.checksum;
+}
+
+// finishes a commit interrupted after its commit point; runs in fs_init
+// before either table is read. Returns true if images were written.
+inline bool replayTxnRecord(OFSInstance* fs) {
+    if (fs->header_ext.txn_record_block == 0) return false;
+
+    vector<TxnRecordEntry> images;
+    bool complete = readTxnRecord(fs, images);
+    if (complete) {
+        for (size_t i = 0; i < images.size(); i++) {
+            if (images[i].entryIndex >= 2 && images[i].entryIndex < fs->config.max_files) {
+                writeFileEntry(fs, images[i].entryIndex, images[i].entry);
+            }
+        }
+    }
+
+    fs->header_ext.txn_record_block = 0;
+    fs->header_ext.txn_record_size = 0;
+    writeHeader(fs);
+    return complete;
+}
+
+#endif